@@ -63,5 +63,21 @@ make -j4 -k
 echo ""
 echo "Running umockdev tests ..."
 tests/umockdev
+
+# the poll() event path is only built without epoll
+mkdir "/tmp/builddir-poll"
+cd "/tmp/builddir-poll"
+
+echo ""
+echo "Configuring without epoll ..."
+/source/configure --enable-examples-build --enable-tests-build --disable-epoll
+
+echo ""
+echo "Building ..."
+make -j4 -k
+
+echo ""
+echo "Running umockdev tests on the poll() path ..."
+tests/umockdev
 EOG
 EOF
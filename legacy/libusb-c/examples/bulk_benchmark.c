@@ -0,0 +1,152 @@
+/*
+ * libusb example program to compare bulk throughput with heap buffers and
+ * with buffers from libusb_alloc_transfer_buffer()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "libusb.h"
+
+static double get_seconds(void)
+{
+#if defined(HAVE_CLOCK_GETTIME)
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+#endif
+}
+
+/* Runs count bulk transfers of length bytes and returns the throughput in
+ * MB/s, or a negative value on error */
+static double run(libusb_device_handle *devh, unsigned char endpoint,
+	unsigned char *buf, int length, int count)
+{
+	double start, elapsed;
+	long long total = 0;
+	int i, r, transferred;
+
+	start = get_seconds();
+	for (i = 0; i < count; i++) {
+		r = libusb_bulk_transfer(devh, endpoint, buf, length, &transferred, 5000);
+		if (r < 0) {
+			fprintf(stderr, "bulk transfer failed: %s\n", libusb_error_name(r));
+			return -1.0;
+		}
+		total += transferred;
+	}
+	elapsed = get_seconds() - start;
+
+	return (double)total / elapsed / 1e6;
+}
+
+static void usage(const char *progname)
+{
+	printf("usage: %s vid:pid endpoint [length [count]]\n", progname);
+	printf("  endpoint  bulk endpoint address, e.g. 0x81 for IN or 0x01 for OUT\n");
+	printf("  length    bytes per transfer (default 1048576)\n");
+	printf("  count     number of transfers per run (default 256)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_device_handle *devh = NULL;
+	unsigned char *heap_buf = NULL, *dev_buf = NULL;
+	unsigned int vid, pid;
+	unsigned char endpoint;
+	int length = 1024 * 1024, count = 256;
+	double heap_rate, dev_rate;
+	int rc;
+
+	if (argc < 3 || sscanf(argv[1], "%x:%x", &vid, &pid) != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	endpoint = (unsigned char)strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		length = atoi(argv[3]);
+	if (argc > 4)
+		count = atoi(argv[4]);
+	if (length <= 0 || count <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rc = libusb_init_context(/*ctx=*/NULL, /*options=*/NULL, /*num_options=*/0);
+	if (rc < 0) {
+		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
+		return 1;
+	}
+
+	devh = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
+	if (!devh) {
+		fprintf(stderr, "Error finding USB device\n");
+		rc = 1;
+		goto out;
+	}
+
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	rc = libusb_claim_interface(devh, 0);
+	if (rc < 0) {
+		fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
+		goto out;
+	}
+
+	heap_buf = malloc((size_t)length);
+	dev_buf = libusb_alloc_transfer_buffer(devh, (size_t)length);
+	if (!heap_buf || !dev_buf) {
+		fprintf(stderr, "Error allocating buffers\n");
+		rc = 1;
+		goto out_release;
+	}
+	memset(heap_buf, 0x55, (size_t)length);
+	memset(dev_buf, 0x55, (size_t)length);
+
+	heap_rate = run(devh, endpoint, heap_buf, length, count);
+	dev_rate = run(devh, endpoint, dev_buf, length, count);
+	if (heap_rate < 0 || dev_rate < 0) {
+		rc = 1;
+		goto out_release;
+	}
+
+	printf("%d transfers of %d bytes on endpoint 0x%02x\n", count, length, endpoint);
+	printf("  heap buffer:            %8.2f MB/s\n", heap_rate);
+	printf("  transfer buffer (pool): %8.2f MB/s\n", dev_rate);
+
+out_release:
+	free(heap_buf);
+	libusb_free_transfer_buffer(devh, dev_buf);
+	libusb_release_interface(devh, 0);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(NULL);
+	return rc;
+}
@@ -0,0 +1,146 @@
+/*
+ * libusb example program to read from a bulk endpoint with the C++20
+ * coroutine binding in libusb_coro.hpp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "libusb_coro.hpp"
+
+namespace {
+
+struct reader_state {
+	int remaining;
+	long long total;
+	int status;
+	int done;
+};
+
+libusb::detached_task reader(libusb::device dev, unsigned char endpoint,
+	int length, reader_state &state)
+{
+	unsigned char *buf = new unsigned char[static_cast<std::size_t>(length)];
+
+	while (state.remaining > 0) {
+		libusb::transfer_result r = co_await dev.bulk_in(endpoint,
+			std::span<unsigned char>(buf, static_cast<std::size_t>(length)), 5000);
+
+		if (!r) {
+			state.status = r.status;
+			break;
+		}
+		state.total += r.actual_length;
+		state.remaining--;
+	}
+
+	delete[] buf;
+	state.done = 1;
+}
+
+void usage(const char *progname)
+{
+	std::printf("usage: %s vid:pid endpoint [length [count]]\n", progname);
+	std::printf("  endpoint  bulk IN endpoint address, e.g. 0x81\n");
+	std::printf("  length    bytes per transfer (default 16384)\n");
+	std::printf("  count     number of transfers (default 64)\n");
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[])
+{
+	libusb_context *ctx = nullptr;
+	libusb_device_handle *devh = nullptr;
+	reader_state state = { 64, 0, LIBUSB_TRANSFER_COMPLETED, 0 };
+	unsigned int vid, pid;
+	unsigned char endpoint;
+	int length = 16384;
+	int rc;
+
+	if (argc < 3 || std::sscanf(argv[1], "%x:%x", &vid, &pid) != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	endpoint = static_cast<unsigned char>(std::strtoul(argv[2], nullptr, 0));
+	if (argc > 3)
+		length = std::atoi(argv[3]);
+	if (argc > 4)
+		state.remaining = std::atoi(argv[4]);
+	if (length <= 0 || state.remaining <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rc = libusb_init_context(&ctx, /*options=*/nullptr, /*num_options=*/0);
+	if (rc < 0) {
+		std::fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
+		return 1;
+	}
+
+	/* reuse the transfers behind the awaiters instead of allocating one
+	 * for each read */
+	libusb_set_option(ctx, LIBUSB_OPTION_TRANSFER_POOL, 4);
+
+	devh = libusb_open_device_with_vid_pid(ctx, static_cast<uint16_t>(vid),
+		static_cast<uint16_t>(pid));
+	if (!devh) {
+		std::fprintf(stderr, "Error finding USB device\n");
+		rc = 1;
+		goto out;
+	}
+
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	rc = libusb_claim_interface(devh, 0);
+	if (rc < 0) {
+		std::fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
+		goto out;
+	}
+
+	/* the coroutine runs until its first transfer is submitted, and is
+	 * resumed from the event handling below */
+	reader(libusb::device(ctx, devh), endpoint, length, state);
+
+	while (!state.done) {
+		rc = libusb_handle_events_completed(ctx, &state.done);
+		if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+			std::fprintf(stderr, "Error handling events: %s\n", libusb_error_name(rc));
+			break;
+		}
+	}
+
+	if (state.status != LIBUSB_TRANSFER_COMPLETED) {
+		if (state.status < 0)
+			std::fprintf(stderr, "Error submitting transfer: %s\n",
+				libusb_error_name(state.status));
+		else
+			std::fprintf(stderr, "Transfer failed with status %d\n", state.status);
+		rc = 1;
+	} else {
+		std::printf("read %lld bytes from endpoint 0x%02x\n", state.total, endpoint);
+		rc = 0;
+	}
+
+	libusb_release_interface(devh, 0);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(ctx);
+	return rc;
+}
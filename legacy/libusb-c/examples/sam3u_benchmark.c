@@ -148,7 +148,8 @@ static int benchmark_in(uint8_t ep)
 	 * This is avoided by queueing multiple transfers in advance, so
 	 * that the host controller is always kept busy, and will schedule
 	 * more transfers on the bus while the callback is running for
-	 * transfers which have completed on the bus.
+	 * transfers which have completed on the bus. libusb_stream_open()
+	 * takes care of this, including the resubmission.
 	 */
 
 	return libusb_submit_transfer(xfr);
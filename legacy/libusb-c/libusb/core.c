@@ -26,11 +26,15 @@
 #ifdef __ANDROID__
 #include <android/log.h>
 #endif
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #ifdef HAVE_SYSLOG
 #include <syslog.h>
 #endif
+#ifdef PLATFORM_POSIX
+#include <unistd.h>
+#endif
 
 static const struct libusb_version libusb_version_internal =
 	{ LIBUSB_MAJOR, LIBUSB_MINOR, LIBUSB_MICRO, LIBUSB_NANO,
@@ -722,6 +726,7 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 		return NULL;
 
 	usbi_atomic_store(&dev->refcnt, 1);
+	usbi_mutex_init(&dev->config_cache_lock);
 
 	dev->ctx = ctx;
 	dev->session_data = session_id;
@@ -1030,29 +1035,159 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return (int)(dev->speed);
 }
 
-static const struct libusb_endpoint_descriptor *find_endpoint(
-	struct libusb_config_descriptor *config, unsigned char endpoint)
+static int is_table_endpoint(const struct libusb_descriptor_iterator *iter,
+	const unsigned char *desc)
 {
-	int iface_idx;
-	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
-		const struct libusb_interface *iface = &config->interface[iface_idx];
-		int altsetting_idx;
+	return desc[0] >= LIBUSB_DT_ENDPOINT_SIZE &&
+		iter->interface_index >= 0 && iter->interface_index <= UINT8_MAX &&
+		iter->altsetting_index <= UINT8_MAX;
+}
 
-		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
-				altsetting_idx++) {
-			const struct libusb_interface_descriptor *altsetting
-				= &iface->altsetting[altsetting_idx];
-			int ep_idx;
+/* Builds the endpoint table of the active configuration from its raw
+ * descriptors, in two passes: one to count the endpoints of each slot and
+ * one to fill them in. Returns NULL on failure. */
+static struct usbi_endpoint_table *build_endpoint_table(struct libusb_device *dev)
+{
+	struct libusb_descriptor_iterator iter;
+	struct usbi_endpoint_table *table;
+	struct usbi_endpoint_info *ep;
+	uint16_t next[USBI_ENDPOINT_SLOTS] = { 0 };
+	const unsigned char *data, *desc;
+	unsigned char *copy;
+	unsigned int slot, num_endpoints = 0;
+	int len, r;
+
+	len = usbi_get_active_config_data(dev, &data, &copy);
+	if (len < LIBUSB_DT_CONFIG_SIZE) {
+		free(copy);
+		return NULL;
+	}
+
+	libusb_descriptor_iterator_init(&iter, data, len);
+	while ((r = libusb_descriptor_iterator_find(&iter, LIBUSB_DT_ENDPOINT, &desc)) > 0) {
+		if (!is_table_endpoint(&iter, desc))
+			continue;
+		next[usbi_endpoint_slot(desc[2])]++;
+		num_endpoints++;
+	}
+	if (r < 0)
+		usbi_warn(DEVICE_CTX(dev), "ignoring config descriptor data after offset %d",
+			  iter.offset);
+
+	table = malloc(sizeof(*table) + num_endpoints * sizeof(table->endpoint[0]));
+	if (!table)
+		goto out;
+
+	/* turn the counts into the start of each slot */
+	table->bConfigurationValue = data[5];
+	table->first[0] = 0;
+	for (slot = 0; slot < USBI_ENDPOINT_SLOTS; slot++) {
+		table->first[slot + 1] = (uint16_t)(table->first[slot] + next[slot]);
+		next[slot] = table->first[slot];
+	}
+
+	ep = NULL;
+	libusb_descriptor_iterator_init(&iter, data, len);
+	while (libusb_descriptor_iterator_next(&iter, &desc) > 0) {
+		switch (desc[1]) {
+		case LIBUSB_DT_INTERFACE:
+			ep = NULL;
+			break;
+		case LIBUSB_DT_ENDPOINT:
+			ep = NULL;
+			if (!is_table_endpoint(&iter, desc))
+				break;
+			ep = &table->endpoint[next[usbi_endpoint_slot(desc[2])]++];
+			ep->interface_index = (uint8_t)iter.interface_index;
+			ep->altsetting_index = (uint8_t)iter.altsetting_index;
+			ep->bEndpointAddress = desc[2];
+			ep->bmAttributes = desc[3];
+			ep->wMaxPacketSize = (uint16_t)(desc[4] | (desc[5] << 8));
+			ep->has_ss_companion = 0;
+			ep->ss_max_burst = 0;
+			ep->ss_attributes = 0;
+			ep->ss_bytes_per_interval = 0;
+			break;
+		case LIBUSB_DT_SS_ENDPOINT_COMPANION:
+			/* only the first companion of an endpoint counts */
+			if (!ep || ep->has_ss_companion ||
+			    desc[0] < LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE)
+				break;
+			ep->has_ss_companion = 1;
+			ep->ss_max_burst = desc[2];
+			ep->ss_attributes = desc[3];
+			ep->ss_bytes_per_interval = (uint16_t)(desc[4] | (desc[5] << 8));
+			break;
+		}
+	}
+
+out:
+	free(copy);
+	return table;
+}
+
+static int find_endpoint(const struct usbi_endpoint_table *table,
+	int iface_idx, int altsetting_idx, unsigned char endpoint,
+	struct usbi_endpoint_info *info)
+{
+	unsigned int i, slot = usbi_endpoint_slot(endpoint);
+
+	for (i = table->first[slot]; i < table->first[slot + 1]; i++) {
+		const struct usbi_endpoint_info *ep = &table->endpoint[i];
+
+		if (ep->bEndpointAddress != endpoint)
+			continue;
+		if (iface_idx >= 0 && (ep->interface_index != iface_idx ||
+		    ep->altsetting_index != altsetting_idx))
+			continue;
+		*info = *ep;
+		return LIBUSB_SUCCESS;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
 
-			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
-				const struct libusb_endpoint_descriptor *ep =
-					&altsetting->endpoint[ep_idx];
-				if (ep->bEndpointAddress == endpoint)
-					return ep;
+/* Looks up an endpoint of the active configuration, in any interface and
+ * alternate setting if iface_idx is -1. The endpoint table is built on the
+ * first lookup and reused until the configuration cache is cleared. */
+static int get_endpoint_info(struct libusb_device *dev, int iface_idx,
+	int altsetting_idx, unsigned char endpoint, struct usbi_endpoint_info *info)
+{
+	struct usbi_endpoint_table *table, *built = NULL;
+	unsigned int gen;
+	int r;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	table = dev->endpoint_table;
+	if (!table) {
+		gen = dev->config_cache_gen;
+		usbi_mutex_unlock(&dev->config_cache_lock);
+
+		built = build_endpoint_table(dev);
+		if (!built) {
+			usbi_err(DEVICE_CTX(dev),
+				"could not retrieve active config descriptor");
+			return LIBUSB_ERROR_OTHER;
+		}
+
+		/* a table built from data read before the cache was cleared is
+		 * only good for this lookup */
+		usbi_mutex_lock(&dev->config_cache_lock);
+		if (gen == dev->config_cache_gen) {
+			if (!dev->endpoint_table) {
+				dev->endpoint_table = built;
+				built = NULL;
 			}
+			table = dev->endpoint_table;
+		} else {
+			table = built;
 		}
 	}
-	return NULL;
+
+	r = find_endpoint(table, iface_idx, altsetting_idx, endpoint, info);
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	free(built);
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1065,6 +1200,13 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
  * its contents. If you're dealing with isochronous transfers, you probably
  * want libusb_get_max_iso_packet_size() instead.
  *
+ * Since version 1.0.30, the endpoints of the active configuration are
+ * looked up in a table that is cached along with the configuration
+ * descriptors and follows the same rules, see
+ * libusb_get_active_config_descriptor(): it is not checked against the
+ * operating system on each call, and a configuration changed outside of
+ * libusb is picked up once libusb_get_configuration() has read it.
+ *
  * \param dev a device
  * \param endpoint address of the endpoint in question
  * \returns the wMaxPacketSize value
@@ -1074,85 +1216,32 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
+	struct usbi_endpoint_info ep;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	r = ep->wMaxPacketSize;
-
-out:
-	libusb_free_config_descriptor(config);
-	return r;
-}
-
-static const struct libusb_endpoint_descriptor *find_alt_endpoint(
-	struct libusb_config_descriptor *config,
-	int iface_idx, int altsetting_idx, unsigned char endpoint)
-{
-	if (iface_idx >= config->bNumInterfaces) {
-		return NULL;
-	}
-
-	const struct libusb_interface *iface = &config->interface[iface_idx];
-
-	if (altsetting_idx >= iface->num_altsetting) {
-		return NULL;
-	}
-
-	const struct libusb_interface_descriptor *altsetting
-		= &iface->altsetting[altsetting_idx];
-	int ep_idx;
+	r = get_endpoint_info(dev, -1, 0, endpoint, &ep);
+	if (r < 0)
+		return r;
 
-	for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
-		const struct libusb_endpoint_descriptor *ep =
-			&altsetting->endpoint[ep_idx];
-		if (ep->bEndpointAddress == endpoint)
-			return ep;
-	}
-	return NULL;
+	return ep.wMaxPacketSize;
 }
 
 static int get_endpoint_max_packet_size(libusb_device *dev,
-	const struct libusb_endpoint_descriptor *ep)
+	const struct usbi_endpoint_info *ep)
 {
-	struct libusb_ss_endpoint_companion_descriptor *ss_ep_cmp;
 	enum libusb_endpoint_transfer_type ep_type;
-	uint16_t val;
-	int r = 0;
-	int speed;
-
-	speed = libusb_get_device_speed(dev);
-	if (speed >= LIBUSB_SPEED_SUPER) {
-		r = libusb_get_ss_endpoint_companion_descriptor(dev->ctx, ep, &ss_ep_cmp);
-		if (r == LIBUSB_SUCCESS) {
-			r = ss_ep_cmp->wBytesPerInterval;
-			libusb_free_ss_endpoint_companion_descriptor(ss_ep_cmp);
-		}
-	}
+	int r;
 
-	/* If the device isn't a SuperSpeed device or retrieving the SS endpoint didn't worked. */
-	if (speed < LIBUSB_SPEED_SUPER || r < 0) {
-		val = ep->wMaxPacketSize;
-		ep_type = (enum libusb_endpoint_transfer_type) (ep->bmAttributes & 0x3);
+	if (libusb_get_device_speed(dev) >= LIBUSB_SPEED_SUPER && ep->has_ss_companion)
+		return ep->ss_bytes_per_interval;
 
-		r = val & 0x07ff;
-		if (ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS
-		    || ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT)
-			r *= (1 + ((val >> 11) & 3));
-	}
+	/* If the device isn't a SuperSpeed device or has no companion descriptor */
+	ep_type = (enum libusb_endpoint_transfer_type) (ep->bmAttributes & 0x3);
+
+	r = ep->wMaxPacketSize & 0x07ff;
+	if (ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS
+	    || ep_type == LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT)
+		r *= (1 + ((ep->wMaxPacketSize >> 11) & 3));
 
 	return r;
 }
@@ -1193,28 +1282,14 @@ static int get_endpoint_max_packet_size(libusb_device *dev,
 int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
+	struct usbi_endpoint_info ep;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	r = get_endpoint_max_packet_size(dev, ep);
+	r = get_endpoint_info(dev, -1, 0, endpoint, &ep);
+	if (r < 0)
+		return r;
 
-out:
-	libusb_free_config_descriptor(config);
-	return r;
+	return get_endpoint_max_packet_size(dev, &ep);
 }
 
 /** \ingroup libusb_dev
@@ -1252,29 +1327,17 @@ out:
 int API_EXPORTED libusb_get_max_alt_packet_size(libusb_device *dev,
 	int interface_number, int alternate_setting, unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
+	struct usbi_endpoint_info ep;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_alt_endpoint(config, interface_number,
-		alternate_setting, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
+	if (interface_number < 0 || alternate_setting < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
 
-	r = get_endpoint_max_packet_size(dev, ep);
+	r = get_endpoint_info(dev, interface_number, alternate_setting, endpoint, &ep);
+	if (r < 0)
+		return r;
 
-out:
-	libusb_free_config_descriptor(config);
-	return r;
+	return get_endpoint_max_packet_size(dev, &ep);
 }
 
 /** \ingroup libusb_dev
@@ -1326,6 +1389,8 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 			free(dev->device_strings_utf8[idx]);
 		}
 
+		usbi_clear_config_cache(dev);
+		usbi_mutex_destroy(&dev->config_cache_lock);
 		free(dev);
 	}
 }
@@ -1384,10 +1449,14 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_cond_init(&_dev_handle->deferred_cond);
+	list_init(&_dev_handle->dev_mem_used);
+	list_init(&_dev_handle->dev_mem_free);
 
 	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
 	if (r < 0) {
 		usbi_dbg(ctx, "wrap_sys_device 0x%" PRIxPTR " returns %d", (uintptr_t)sys_dev, r);
+		usbi_cond_destroy(&_dev_handle->deferred_cond);
 		usbi_mutex_destroy(&_dev_handle->lock);
 		free(_dev_handle);
 		return r;
@@ -1438,6 +1507,9 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_cond_init(&_dev_handle->deferred_cond);
+	list_init(&_dev_handle->dev_mem_used);
+	list_init(&_dev_handle->dev_mem_free);
 
 	_dev_handle->dev = libusb_ref_device(dev);
 
@@ -1445,6 +1517,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	if (r < 0) {
 		usbi_dbg(DEVICE_CTX(dev), "open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
+		usbi_cond_destroy(&_dev_handle->deferred_cond);
 		usbi_mutex_destroy(&_dev_handle->lock);
 		free(_dev_handle);
 		return r;
@@ -1510,12 +1583,34 @@ out:
 	return dev_handle;
 }
 
+/* Unmaps all device memory buffers of a handle that is being closed */
+static void dev_mem_pool_release(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_dev_mem_buffer *dev_mem, *tmp;
+
+	if (!list_empty(&dev_handle->dev_mem_used)) {
+		usbi_warn(HANDLE_CTX(dev_handle), "device closed with transfer buffers still allocated");
+		list_splice_front(&dev_handle->dev_mem_used, &dev_handle->dev_mem_free);
+	}
+
+	for_each_safe_helper(dev_mem, tmp, &dev_handle->dev_mem_free, struct usbi_dev_mem_buffer) {
+		list_del(&dev_mem->list);
+		libusb_dev_mem_free(dev_handle, dev_mem->buffer, dev_mem->length);
+		free(dev_mem);
+	}
+	dev_handle->dev_mem_free_count = 0;
+}
+
 static void do_close(struct libusb_context *ctx,
 	struct libusb_device_handle *dev_handle)
 {
 	struct usbi_transfer *itransfer;
 	struct usbi_transfer *tmp;
 
+	/* completions must not race with the detaching of the transfers below */
+	if (usbi_backend.stop_completion_thread)
+		usbi_backend.stop_completion_thread(dev_handle);
+
 	/* remove any transfers in flight that are for this device */
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
@@ -1544,7 +1639,7 @@ static void do_close(struct libusb_context *ctx,
 		 * we don't accidentally use the device handle in the future
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
-		list_del(&itransfer->list);
+		usbi_remove_closed_transfer(itransfer);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1556,16 +1651,57 @@ static void do_close(struct libusb_context *ctx,
 	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
+	/* no callback of the handle can be deferred any more, so the tasks
+	 * that are still with the executor are the last to use its queues */
+	usbi_wait_deferred_callbacks(dev_handle);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
+	free(dev_handle->deferred);
+	dev_mem_pool_release(dev_handle);
 	usbi_backend.close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	usbi_cond_destroy(&dev_handle->deferred_cond);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
 }
 
+/* Interrupt the event handlers and take the event handling lock, so that
+ * the event sources of a device handle can be changed. */
+static void interrupt_and_lock_events(struct libusb_context *ctx)
+{
+	unsigned int event_flags;
+
+	/* Record that we are closing a device or changing its event sources.
+	 * Only signal an event if there are no prior pending events. */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	event_flags = ctx->event_flags;
+	if (!ctx->device_close++)
+		ctx->event_flags |= USBI_EVENT_DEVICE_CLOSE;
+	if (!event_flags)
+		usbi_signal_event(&ctx->event);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	/* take event handling lock */
+	libusb_lock_events(ctx);
+}
+
+static void unlock_interrupted_events(struct libusb_context *ctx)
+{
+	/* We're done with this device.
+	 * Clear the event pipe if there are no further pending events. */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!--ctx->device_close)
+		ctx->event_flags &= ~USBI_EVENT_DEVICE_CLOSE;
+	usbi_clear_event_if_idle(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	/* Release event handling lock and wake up event waiters */
+	libusb_unlock_events(ctx);
+}
+
 /** \ingroup libusb_dev
  * Close a device handle. Should be called on all open handles before your
  * application exits.
@@ -1580,7 +1716,6 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
-	unsigned int event_flags;
 	int handling_events;
 
 	if (!dev_handle)
@@ -1599,36 +1734,123 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	 * hold the event handling lock. */
 
 	if (!handling_events) {
-		/* Record that we are closing a device.
-		 * Only signal an event if there are no prior pending events. */
-		usbi_mutex_lock(&ctx->event_data_lock);
-		event_flags = ctx->event_flags;
-		if (!ctx->device_close++)
-			ctx->event_flags |= USBI_EVENT_DEVICE_CLOSE;
-		if (!event_flags)
-			usbi_signal_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
-
-		/* take event handling lock */
-		libusb_lock_events(ctx);
+		/* Deferred callbacks may do synchronous I/O, which needs the
+		 * event handling lock, so wait for them before taking it. No
+		 * task is handed to the executor for the handle afterwards. */
+		usbi_wait_deferred_callbacks(dev_handle);
+		interrupt_and_lock_events(ctx);
 	}
 
 	/* Close the device */
 	do_close(ctx, dev_handle);
 
-	if (!handling_events) {
-		/* We're done with closing this device.
-		 * Clear the event pipe if there are no further pending events. */
-		usbi_mutex_lock(&ctx->event_data_lock);
-		if (!--ctx->device_close)
-			ctx->event_flags &= ~USBI_EVENT_DEVICE_CLOSE;
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+	if (!handling_events)
+		unlock_interrupted_events(ctx);
+}
 
-		/* Release event handling lock and wake up event waiters */
-		libusb_unlock_events(ctx);
-	}
+/** \ingroup libusb_dev
+ * Handle the completions of a device handle in a thread of its own.
+ *
+ * By default the transfers of all device handles complete in whichever
+ * thread handles the events of the context. This function starts a thread
+ * that waits for the completions of this handle only and runs their
+ * callbacks, optionally pinned to a CPU, so that a busy device neither
+ * delays nor is delayed by the other devices of the context. Transfers of
+ * the handle that are already in flight complete in the new thread.
+ *
+ * Timeouts and hotplug events are still processed by the event handling
+ * of the context, so an application must keep handling events as usual.
+ * Threads waiting in libusb_handle_events_completed() for a transfer of
+ * the handle, including those of the synchronous I/O functions, are woken
+ * after completions whenever a thread is handling events.
+ *
+ * Transfer callbacks of the handle run in the completion thread, which
+ * counts as event handling context. They must not close the handle or stop
+ * the completion thread, and synchronous I/O from them fails with
+ * \ref LIBUSB_ERROR_BUSY as it does in any other transfer callback.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle a device handle
+ * \param cpu the CPU to run the completion thread on, or -1 to let the
+ * scheduler choose
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the handle already has a completion
+ * thread
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the CPU is invalid
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the platform has no
+ * completion threads
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_stop_completion_thread()
+ */
+int API_EXPORTED libusb_start_completion_thread(libusb_device_handle *dev_handle,
+	int cpu)
+{
+	struct libusb_context *ctx;
+	int handling_events, r;
+
+	if (!dev_handle || cpu < -1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend.start_completion_thread)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctx = HANDLE_CTX(dev_handle);
+	usbi_dbg(ctx, "handle %p cpu %d", (void *) dev_handle, cpu);
+
+	/* the event sources of the handle move out of the context */
+	handling_events = usbi_handling_events(ctx);
+	if (!handling_events)
+		interrupt_and_lock_events(ctx);
+
+	r = usbi_backend.start_completion_thread(dev_handle, cpu);
+
+	if (!handling_events)
+		unlock_interrupted_events(ctx);
+
+	return r;
+}
+
+/** \ingroup libusb_dev
+ * Stop the completion thread of a device handle and go back to handling its
+ * completions in the event handling of the context. The thread finishes the
+ * callback it is running, if any, before this function returns.
+ *
+ * There is no need to call this function before libusb_close().
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle a device handle
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the handle has no completion
+ * thread
+ * \returns \ref LIBUSB_ERROR_BUSY if called from the completion thread
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_start_completion_thread()
+ */
+int API_EXPORTED libusb_stop_completion_thread(libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx;
+	int handling_events, r;
+
+	if (!dev_handle)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend.stop_completion_thread)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	ctx = HANDLE_CTX(dev_handle);
+	usbi_dbg(ctx, "handle %p", (void *) dev_handle);
+
+	handling_events = usbi_handling_events(ctx);
+	if (!handling_events)
+		interrupt_and_lock_events(ctx);
+
+	r = usbi_backend.stop_completion_thread(dev_handle);
+
+	if (!handling_events)
+		unlock_interrupted_events(ctx);
+
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1657,6 +1879,9 @@ libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle)
  * This function will return a value of 0 in the <tt>config</tt> output
  * parameter if the device is in unconfigured state.
  *
+ * A cached active configuration descriptor that does not match the
+ * configuration read is dropped, see libusb_get_active_config_descriptor().
+ *
  * \param dev_handle a device handle
  * \param config output location for the bConfigurationValue of the active
  * configuration (only valid for return code 0)
@@ -1691,6 +1916,7 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev_handle,
 
 	if (r == 0) {
 		usbi_dbg(ctx, "active config %u", tmp);
+		usbi_check_config_cache(dev_handle->dev, tmp);
 		*config = (int)tmp;
 	}
 
@@ -1754,10 +1980,16 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev_handle,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev_handle,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg(HANDLE_CTX(dev_handle), "configuration %d", configuration);
 	if (configuration < -1 || configuration > (int)UINT8_MAX)
 		return LIBUSB_ERROR_INVALID_PARAM;
-	return usbi_backend.set_configuration(dev_handle, configuration);
+	r = usbi_backend.set_configuration(dev_handle, configuration);
+
+	/* the active configuration may have changed even on failure */
+	usbi_clear_config_cache(dev_handle->dev);
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1949,14 +2181,20 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev_handle,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev_handle)
 {
+	int r;
+
 	usbi_dbg(HANDLE_CTX(dev_handle), " ");
 	if (!usbi_atomic_load(&dev_handle->dev->attached))
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.reset_device)
-		return usbi_backend.reset_device(dev_handle);
-	else
+	if (!usbi_backend.reset_device)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend.reset_device(dev_handle);
+
+	/* the device may come back with different descriptors */
+	usbi_clear_config_cache(dev_handle->dev);
+	return r;
 }
 
 /** \ingroup libusb_asyncio
@@ -2082,6 +2320,152 @@ int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+static size_t dev_mem_page_size(void)
+{
+#ifdef PLATFORM_POSIX
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (page_size > 0)
+		return (size_t)page_size;
+#endif
+	return 4096;
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a buffer for transfers against the given device. Buffers of at
+ * least \ref LIBUSB_OPTION_DEV_MEM_THRESHOLD bytes are taken from a pool of
+ * device memory kept by the device handle (see libusb_dev_mem_alloc()), so
+ * that the kernel does not need to copy the data to and from an
+ * intermediate buffer. Smaller buffers, and all buffers on systems without
+ * device memory, are allocated from the heap.
+ *
+ * The buffer can be used with both the asynchronous and the synchronous API,
+ * e.g. with libusb_bulk_transfer(). The same rules as for
+ * libusb_dev_mem_alloc() apply while a transfer is in progress.
+ *
+ * The buffer must be freed with libusb_free_transfer_buffer() before the
+ * device handle is closed. Specifically, this means that the flag
+ * \ref LIBUSB_TRANSFER_FREE_BUFFER cannot be used to free it.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle a device handle
+ * \param length size of desired data buffer
+ * \returns a pointer to the buffer, or NULL on failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_alloc_transfer_buffer(
+	libusb_device_handle *dev_handle, size_t length)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_dev_mem_buffer *dev_mem;
+	size_t page_size, dev_mem_length;
+
+	if (!length)
+		return NULL;
+
+	if (!ctx->dev_mem_threshold || length < ctx->dev_mem_threshold ||
+	    !usbi_backend.dev_mem_alloc)
+		return malloc(length);
+
+	/* device memory is mapped in whole pages */
+	page_size = dev_mem_page_size();
+	dev_mem_length = (length + page_size - 1) & ~(page_size - 1);
+
+	/* reuse a retained buffer that is not more than twice as large */
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->dev_mem_unavailable) {
+		usbi_mutex_unlock(&dev_handle->lock);
+		return malloc(length);
+	}
+	for_each_helper(dev_mem, &dev_handle->dev_mem_free, struct usbi_dev_mem_buffer) {
+		if (dev_mem->length >= dev_mem_length && dev_mem->length / 2 <= dev_mem_length) {
+			list_del(&dev_mem->list);
+			dev_handle->dev_mem_free_count--;
+			list_add(&dev_mem->list, &dev_handle->dev_mem_used);
+			usbi_mutex_unlock(&dev_handle->lock);
+			return dev_mem->buffer;
+		}
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	dev_mem = malloc(sizeof(*dev_mem));
+	if (!dev_mem)
+		return NULL;
+
+	dev_mem->buffer = libusb_dev_mem_alloc(dev_handle, dev_mem_length);
+	if (!dev_mem->buffer) {
+		int err = errno;
+
+		/* only stop trying when the device cannot map memory at all,
+		 * a transient failure such as ENOMEM may not recur. Kernels
+		 * without usbfs mmap support fail with ENODEV */
+		if (err == ENOTTY || err == ENOSYS || err == ENODEV) {
+			usbi_dbg(ctx, "device memory unavailable, using the heap");
+			usbi_mutex_lock(&dev_handle->lock);
+			dev_handle->dev_mem_unavailable = 1;
+			usbi_mutex_unlock(&dev_handle->lock);
+		}
+		free(dev_mem);
+		return malloc(length);
+	}
+	dev_mem->length = dev_mem_length;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_add(&dev_mem->list, &dev_handle->dev_mem_used);
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	return dev_mem->buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Free a buffer allocated with libusb_alloc_transfer_buffer(). Device memory
+ * is retained by the device handle for reuse by later allocations.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle the device handle the buffer was allocated for
+ * \param buffer the buffer to free, may be NULL
+ * \returns \ref LIBUSB_SUCCESS, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_free_transfer_buffer(libusb_device_handle *dev_handle,
+	unsigned char *buffer)
+{
+	struct usbi_dev_mem_buffer *dev_mem;
+	int found = 0;
+	int r;
+
+	if (!buffer)
+		return LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	for_each_helper(dev_mem, &dev_handle->dev_mem_used, struct usbi_dev_mem_buffer) {
+		if (dev_mem->buffer == buffer) {
+			found = 1;
+			break;
+		}
+	}
+
+	if (!found) {
+		usbi_mutex_unlock(&dev_handle->lock);
+		free(buffer);
+		return LIBUSB_SUCCESS;
+	}
+
+	list_del(&dev_mem->list);
+	if (dev_handle->dev_mem_free_count < USBI_DEV_MEM_POOL_RETAIN) {
+		list_add(&dev_mem->list, &dev_handle->dev_mem_free);
+		dev_handle->dev_mem_free_count++;
+		usbi_mutex_unlock(&dev_handle->lock);
+		return LIBUSB_SUCCESS;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	r = libusb_dev_mem_free(dev_handle, dev_mem->buffer, dev_mem->length);
+	free(dev_mem);
+	return r;
+}
+
 /** \ingroup libusb_dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -2432,6 +2816,20 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	if (LIBUSB_OPTION_LOG_CB == option) {
 		log_cb = (libusb_log_cb) va_arg(ap, libusb_log_cb);
 	}
+	if (LIBUSB_OPTION_TRANSFER_POOL == option || LIBUSB_OPTION_REAP_BUDGET == option ||
+	    LIBUSB_OPTION_DEV_MEM_THRESHOLD == option || LIBUSB_OPTION_BUSY_POLL == option ||
+	    LIBUSB_OPTION_TIMER_SLACK == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_BUSY_POLL_CPU_LIMIT == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > 100) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
 
 	do {
 		if (LIBUSB_SUCCESS != r) {
@@ -2446,7 +2844,10 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 		if (NULL == ctx) {
 			usbi_mutex_static_lock(&default_context_lock);
 			default_context_options[option].is_set = 1;
-			if (LIBUSB_OPTION_LOG_LEVEL == option) {
+			if (LIBUSB_OPTION_LOG_LEVEL == option || LIBUSB_OPTION_TRANSFER_POOL == option ||
+			    LIBUSB_OPTION_REAP_BUDGET == option || LIBUSB_OPTION_DEV_MEM_THRESHOLD == option ||
+			    LIBUSB_OPTION_BUSY_POLL == option || LIBUSB_OPTION_BUSY_POLL_CPU_LIMIT == option ||
+			    LIBUSB_OPTION_TIMER_SLACK == option) {
 				default_context_options[option].arg.ival = arg;
 			} else if (LIBUSB_OPTION_LOG_CB == option) {
 				default_context_options[option].arg.log_cbval = log_cb;
@@ -2485,6 +2886,30 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			libusb_set_log_cb_internal(ctx, log_cb, LIBUSB_LOG_CB_CONTEXT);
 			break;
 
+		case LIBUSB_OPTION_TRANSFER_POOL:
+			usbi_transfer_pool_set_limit(ctx, arg);
+			break;
+
+		case LIBUSB_OPTION_REAP_BUDGET:
+			ctx->reap_budget = (unsigned int)arg;
+			break;
+
+		case LIBUSB_OPTION_DEV_MEM_THRESHOLD:
+			ctx->dev_mem_threshold = (unsigned int)arg;
+			break;
+
+		case LIBUSB_OPTION_BUSY_POLL:
+			ctx->busy_poll.window_us = (unsigned int)arg;
+			break;
+
+		case LIBUSB_OPTION_BUSY_POLL_CPU_LIMIT:
+			ctx->busy_poll.cpu_limit = (unsigned int)arg;
+			break;
+
+		case LIBUSB_OPTION_TIMER_SLACK:
+			ctx->timer_slack = (unsigned int)arg;
+			break;
+
 		case LIBUSB_OPTION_MAX: /* unreachable */
 		default:
 			r = LIBUSB_ERROR_INVALID_PARAM;
@@ -2585,6 +3010,7 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 	usbi_mutex_init(&_ctx->open_devs_lock);
 	list_init(&_ctx->usb_devs);
 	list_init(&_ctx->open_devs);
+	_ctx->dev_mem_threshold = USBI_DEFAULT_DEV_MEM_THRESHOLD;
 
 	/* apply default options to all new contexts */
 	for (enum libusb_option option = 0 ; option < LIBUSB_OPTION_MAX ; option++) {
@@ -2592,7 +3018,7 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 			continue;
 		}
 		if (LIBUSB_OPTION_LOG_CB != option) {
-			r = libusb_set_option(_ctx, option);
+			r = libusb_set_option(_ctx, option, default_context_options[option].arg.ival);
 		} else {
 			r = libusb_set_option(_ctx, option, default_context_options[option].arg.log_cbval);
 		}
@@ -2610,6 +3036,12 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		case LIBUSB_OPTION_LOG_LEVEL:
 		case LIBUSB_OPTION_USE_USBDK:
 		case LIBUSB_OPTION_NO_DEVICE_DISCOVERY:
+		case LIBUSB_OPTION_TRANSFER_POOL:
+		case LIBUSB_OPTION_REAP_BUDGET:
+		case LIBUSB_OPTION_DEV_MEM_THRESHOLD:
+		case LIBUSB_OPTION_BUSY_POLL:
+		case LIBUSB_OPTION_BUSY_POLL_CPU_LIMIT:
+		case LIBUSB_OPTION_TIMER_SLACK:
 		case LIBUSB_OPTION_MAX:
 		default:
 			r = libusb_set_option(_ctx, options[i].option, options[i].value.ival);
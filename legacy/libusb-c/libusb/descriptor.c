@@ -44,17 +44,45 @@ static inline uint32_t ReadLittleEndian32(const uint8_t p[4])
 			(uint32_t)p[0]);
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
+/* The head of a parsed configuration descriptor. The reference count is
+ * held by the configuration descriptor cache of the device and by every
+ * caller the descriptor was handed to. */
+struct config_block {
+	usbi_atomic_t refcnt;
+	struct libusb_config_descriptor config;
+};
+
+/* A parsed configuration descriptor lives in a single allocation, which is
+ * sized up front by size_configuration() and carved into one region per
+ * kind of object: the config_block, the interfaces, the altsettings, the
+ * endpoints, the extra descriptors of the config and those of the
+ * interfaces and endpoints. Separate regions keep the altsettings of an
+ * interface and the extra descriptors of the config contiguous although
+ * other objects are allocated in between. Each region holds a single type
+ * whose size is a multiple of its alignment, so no padding is needed. */
+struct config_arena {
+	struct libusb_interface_descriptor *altsetting;
+	struct libusb_endpoint_descriptor *endpoint;
+	uint8_t *config_extra;
+	uint8_t *extra;
+};
+
+static uint8_t *arena_copy_extra(struct config_arena *arena,
+	const uint8_t *begin, size_t len)
 {
-	free((void *)endpoint->extra);
+	uint8_t *extra = arena->extra;
+
+	memcpy(extra, begin, len);
+	arena->extra += len;
+	return extra;
 }
 
 static int parse_endpoint(struct libusb_context *ctx,
-	struct libusb_endpoint_descriptor *endpoint, const uint8_t *buffer, int size)
+	struct config_arena *arena, struct libusb_endpoint_descriptor *endpoint,
+	const uint8_t *buffer, int size)
 {
 	const struct usbi_descriptor_header *header;
 	const uint8_t *begin;
-	void *extra;
 	int parsed = 0;
 
 	if (size < DESC_HEADER_LENGTH) {
@@ -126,43 +154,13 @@ static int parse_endpoint(struct libusb_context *ctx,
 	if (len <= 0)
 		return parsed;
 
-	extra = malloc((size_t)len);
-	if (!extra)
-		return LIBUSB_ERROR_NO_MEM;
-
-	memcpy(extra, begin, (size_t)len);
-	endpoint->extra = extra;
+	endpoint->extra = arena_copy_extra(arena, begin, (size_t)len);
 	endpoint->extra_length = (int)len;
 
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
-{
-	int i;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-
-			free((void *)ifp->extra);
-			if (ifp->endpoint) {
-				uint8_t j;
-
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						       ifp->endpoint + j);
-			}
-			free((void *)ifp->endpoint);
-		}
-	}
-	free((void *)usb_interface->altsetting);
-	usb_interface->altsetting = NULL;
-}
-
-static int parse_interface(libusb_context *ctx,
+static int parse_interface(libusb_context *ctx, struct config_arena *arena,
 	struct libusb_interface *usb_interface, const uint8_t *buffer, int size)
 {
 	int r;
@@ -174,17 +172,31 @@ static int parse_interface(libusb_context *ctx,
 	const uint8_t *begin;
 
 	while (size >= LIBUSB_DT_INTERFACE_SIZE) {
-		struct libusb_interface_descriptor *altsetting;
-
-		altsetting = realloc((void *)usb_interface->altsetting,
-			sizeof(*altsetting) * (size_t)(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
+		if_desc = (const struct usbi_interface_descriptor *)buffer;
+		if (if_desc->bDescriptorType != LIBUSB_DT_INTERFACE) {
+			usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
+				 if_desc->bDescriptorType, LIBUSB_DT_INTERFACE);
+			return parsed;
+		} else if (if_desc->bLength < LIBUSB_DT_INTERFACE_SIZE) {
+			usbi_err(ctx, "invalid interface bLength (%u)",
+				 if_desc->bLength);
+			return LIBUSB_ERROR_IO;
+		} else if (if_desc->bLength > size) {
+			usbi_warn(ctx, "short intf descriptor read %d/%u",
+				 size, if_desc->bLength);
+			return parsed;
+		} else if (if_desc->bNumEndpoints > USB_MAXENDPOINTS) {
+			usbi_err(ctx, "too many endpoints (%u)", if_desc->bNumEndpoints);
+			return LIBUSB_ERROR_IO;
 		}
-		usb_interface->altsetting = altsetting;
 
-		ifp = altsetting + usb_interface->num_altsetting;
+		/* the altsettings of this interface are the only ones taken
+		 * from the arena until it is done, so they are contiguous */
+		ifp = arena->altsetting++;
+		if (!usb_interface->altsetting)
+			usb_interface->altsetting = ifp;
+		usb_interface->num_altsetting++;
+
 		ifp->bLength = buffer[0];
 		ifp->bDescriptorType = buffer[1];
 		ifp->bInterfaceNumber = buffer[2];
@@ -194,29 +206,6 @@ static int parse_interface(libusb_context *ctx,
 		ifp->bInterfaceSubClass = buffer[6];
 		ifp->bInterfaceProtocol = buffer[7];
 		ifp->iInterface = buffer[8];
-		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
-			usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
-				 ifp->bDescriptorType, LIBUSB_DT_INTERFACE);
-			return parsed;
-		} else if (ifp->bLength < LIBUSB_DT_INTERFACE_SIZE) {
-			usbi_err(ctx, "invalid interface bLength (%u)",
-				 ifp->bLength);
-			r = LIBUSB_ERROR_IO;
-			goto err;
-		} else if (ifp->bLength > size) {
-			usbi_warn(ctx, "short intf descriptor read %d/%u",
-				 size, ifp->bLength);
-			return parsed;
-		} else if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
-			usbi_err(ctx, "too many endpoints (%u)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
-		}
-
-		usb_interface->num_altsetting++;
-		ifp->extra = NULL;
-		ifp->extra_length = 0;
-		ifp->endpoint = NULL;
 
 		if (interface_number == -1)
 			interface_number = ifp->bInterfaceNumber;
@@ -235,8 +224,7 @@ static int parse_interface(libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%u)",
 					 header->bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header->bLength > size) {
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%u",
@@ -260,33 +248,20 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		ptrdiff_t len = buffer - begin;
 		if (len > 0) {
-			void *extra = malloc((size_t)len);
-
-			if (!extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-
-			memcpy(extra, begin, (size_t)len);
-			ifp->extra = extra;
+			ifp->extra = arena_copy_extra(arena, begin, (size_t)len);
 			ifp->extra_length = (int)len;
 		}
 
 		if (ifp->bNumEndpoints > 0) {
-			struct libusb_endpoint_descriptor *endpoint;
+			struct libusb_endpoint_descriptor *endpoint = arena->endpoint;
 			uint8_t i;
 
-			endpoint = calloc(ifp->bNumEndpoints, sizeof(*endpoint));
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-
+			arena->endpoint += ifp->bNumEndpoints;
 			ifp->endpoint = endpoint;
 			for (i = 0; i < ifp->bNumEndpoints; i++) {
-				r = parse_endpoint(ctx, endpoint + i, buffer, size);
+				r = parse_endpoint(ctx, arena, endpoint + i, buffer, size);
 				if (r < 0)
-					goto err;
+					return r;
 				if (r == 0) {
 					ifp->bNumEndpoints = i;
 					break;
@@ -307,31 +282,54 @@ static int parse_interface(libusb_context *ctx,
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
 }
 
-static void clear_configuration(struct libusb_config_descriptor *config)
+/* Walks the descriptors following a configuration descriptor the way the
+ * parser does and returns upper bounds for the altsettings, endpoints and
+ * extra descriptor bytes it can produce. */
+static void size_configuration(const uint8_t *buffer, int size,
+	size_t *num_altsettings, size_t *num_endpoints, size_t *extra_length)
 {
-	uint8_t i;
+	const struct usbi_descriptor_header *header;
 
-	if (config->interface) {
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-					config->interface + i);
+	*num_altsettings = *num_endpoints = *extra_length = 0;
+	while (size >= DESC_HEADER_LENGTH) {
+		header = (const struct usbi_descriptor_header *)buffer;
+		if (header->bLength < DESC_HEADER_LENGTH || header->bLength > size)
+			break;
+
+		switch (header->bDescriptorType) {
+		case LIBUSB_DT_INTERFACE:
+			(*num_altsettings)++;
+			if (header->bLength >= LIBUSB_DT_INTERFACE_SIZE)
+				*num_endpoints += ((const struct usbi_interface_descriptor *)buffer)->bNumEndpoints;
+			break;
+		case LIBUSB_DT_ENDPOINT:
+		case LIBUSB_DT_CONFIG:
+		case LIBUSB_DT_DEVICE:
+			break;
+		default:
+			*extra_length += header->bLength;
+		}
+
+		buffer += header->bLength;
+		size -= header->bLength;
 	}
-	free((void *)config->interface);
-	free((void *)config->extra);
 }
 
 static int parse_configuration(struct libusb_context *ctx,
-	struct libusb_config_descriptor *config, const uint8_t *buffer, int size)
+	struct libusb_config_descriptor **config_out, const uint8_t *buffer,
+	int size)
 {
 	uint8_t i;
 	int r;
 	const struct usbi_descriptor_header *header;
+	const struct usbi_configuration_descriptor *config_desc;
+	struct config_block *block;
+	struct libusb_config_descriptor *config;
 	struct libusb_interface *usb_interface;
+	struct config_arena arena;
+	size_t num_altsettings, num_endpoints, extra_length;
 
 	if (size < LIBUSB_DT_CONFIG_SIZE) {
 		usbi_err(ctx, "short config descriptor read %d/%d",
@@ -339,34 +337,52 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	config->bLength = buffer[0];
-	config->bDescriptorType = buffer[1];
-	config->wTotalLength = ReadLittleEndian16(&buffer[2]);
-	config->bNumInterfaces = buffer[4];
-	config->bConfigurationValue = buffer[5];
-	config->iConfiguration = buffer[6];
-	config->bmAttributes = buffer[7];
-	config->MaxPower = buffer[8];
-	if (config->bDescriptorType != LIBUSB_DT_CONFIG) {
+	config_desc = (const struct usbi_configuration_descriptor *)buffer;
+	if (config_desc->bDescriptorType != LIBUSB_DT_CONFIG) {
 		usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
-			 config->bDescriptorType, LIBUSB_DT_CONFIG);
+			 config_desc->bDescriptorType, LIBUSB_DT_CONFIG);
 		return LIBUSB_ERROR_IO;
-	} else if (config->bLength < LIBUSB_DT_CONFIG_SIZE) {
-		usbi_err(ctx, "invalid config bLength (%u)", config->bLength);
+	} else if (config_desc->bLength < LIBUSB_DT_CONFIG_SIZE) {
+		usbi_err(ctx, "invalid config bLength (%u)", config_desc->bLength);
 		return LIBUSB_ERROR_IO;
-	} else if (config->bLength > size) {
+	} else if (config_desc->bLength > size) {
 		usbi_err(ctx, "short config descriptor read %d/%u",
-			 size, config->bLength);
+			 size, config_desc->bLength);
 		return LIBUSB_ERROR_IO;
-	} else if (config->bNumInterfaces > USB_MAXINTERFACES) {
-		usbi_err(ctx, "too many interfaces (%u)", config->bNumInterfaces);
+	} else if (config_desc->bNumInterfaces > USB_MAXINTERFACES) {
+		usbi_err(ctx, "too many interfaces (%u)", config_desc->bNumInterfaces);
 		return LIBUSB_ERROR_IO;
 	}
 
-	usb_interface = calloc(config->bNumInterfaces, sizeof(*usb_interface));
-	if (!usb_interface)
+	size_configuration(buffer + config_desc->bLength, size - config_desc->bLength,
+		&num_altsettings, &num_endpoints, &extra_length);
+
+	block = calloc(1, sizeof(*block) +
+		config_desc->bNumInterfaces * sizeof(*usb_interface) +
+		num_altsettings * sizeof(*arena.altsetting) +
+		num_endpoints * sizeof(*arena.endpoint) +
+		2 * extra_length);
+	if (!block)
 		return LIBUSB_ERROR_NO_MEM;
 
+	usbi_atomic_store(&block->refcnt, 1);
+	config = &block->config;
+	usb_interface = (struct libusb_interface *)(block + 1);
+	arena.altsetting = (struct libusb_interface_descriptor *)
+		(usb_interface + config_desc->bNumInterfaces);
+	arena.endpoint = (struct libusb_endpoint_descriptor *)
+		(arena.altsetting + num_altsettings);
+	arena.config_extra = (uint8_t *)(arena.endpoint + num_endpoints);
+	arena.extra = arena.config_extra + extra_length;
+
+	config->bLength = buffer[0];
+	config->bDescriptorType = buffer[1];
+	config->wTotalLength = ReadLittleEndian16(&buffer[2]);
+	config->bNumInterfaces = buffer[4];
+	config->bConfigurationValue = buffer[5];
+	config->iConfiguration = buffer[6];
+	config->bmAttributes = buffer[7];
+	config->MaxPower = buffer[8];
 	config->interface = usb_interface;
 
 	buffer += config->bLength;
@@ -391,6 +407,7 @@ static int parse_configuration(struct libusb_context *ctx,
 					  "short extra config desc read %d/%u",
 					  size, header->bLength);
 				config->bNumInterfaces = i;
+				*config_out = config;
 				return size;
 			}
 
@@ -410,20 +427,12 @@ static int parse_configuration(struct libusb_context *ctx,
 		/*  drivers to later parse */
 		ptrdiff_t len = buffer - begin;
 		if (len > 0) {
-			uint8_t *extra = realloc((void *)config->extra,
-						 (size_t)(config->extra_length) + (size_t)len);
-
-			if (!extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-
-			memcpy(extra + config->extra_length, begin, (size_t)len);
-			config->extra = extra;
+			memcpy(arena.config_extra + config->extra_length, begin, (size_t)len);
+			config->extra = arena.config_extra;
 			config->extra_length += (int)len;
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size);
+		r = parse_interface(ctx, &arena, usb_interface + i, buffer, size);
 		if (r < 0)
 			goto err;
 		if (r == 0) {
@@ -435,35 +444,178 @@ static int parse_configuration(struct libusb_context *ctx,
 		size -= r;
 	}
 
+	*config_out = config;
 	return size;
 
 err:
-	clear_configuration(config);
+	free(block);
 	return r;
 }
 
 static int raw_desc_to_config(struct libusb_context *ctx,
 	const uint8_t *buf, int size, struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = calloc(1, sizeof(*_config));
 	int r;
 
-	if (!_config)
-		return LIBUSB_ERROR_NO_MEM;
-
-	r = parse_configuration(ctx, _config, buf, size);
+	r = parse_configuration(ctx, config, buf, size);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
 
-	*config = _config;
 	return LIBUSB_SUCCESS;
 }
 
+static void ref_config(struct libusb_config_descriptor *config)
+{
+	struct config_block *block = container_of(config, struct config_block, config);
+
+	(void)usbi_atomic_inc(&block->refcnt);
+}
+
+static void unref_config(struct libusb_config_descriptor *config)
+{
+	struct config_block *block = container_of(config, struct config_block, config);
+
+	if (usbi_atomic_dec(&block->refcnt) == 0)
+		free(block);
+}
+
+/* returns the cache entry for the configuration with the given index, or
+ * for the active configuration if the index is -1, or NULL if the cache
+ * cannot be allocated.
+ * NB: config_cache_lock must be held when calling this. */
+static struct libusb_config_descriptor **config_cache_entry(
+	struct libusb_device *dev, int config_idx)
+{
+	if (config_idx < 0)
+		return &dev->active_config;
+
+	if (!dev->configs) {
+		dev->num_configs = dev->device_descriptor.bNumConfigurations;
+		dev->configs = calloc(dev->num_configs, sizeof(*dev->configs));
+		if (!dev->configs)
+			return NULL;
+	}
+	if (config_idx >= dev->num_configs)
+		return NULL;
+
+	return &dev->configs[config_idx];
+}
+
+/* returns a new reference to a cached configuration descriptor, or NULL if
+ * it is not cached. gen receives the cache generation to pass to
+ * cache_config() after parsing the descriptor. */
+static struct libusb_config_descriptor *lookup_config(struct libusb_device *dev,
+	int config_idx, unsigned int *gen)
+{
+	struct libusb_config_descriptor **entry, *config = NULL;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	entry = config_cache_entry(dev, config_idx);
+	if (entry && *entry) {
+		config = *entry;
+		ref_config(config);
+	}
+	*gen = dev->config_cache_gen;
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	return config;
+}
+
+/* caches a newly parsed configuration descriptor unless the cache has been
+ * cleared since lookup_config() returned gen. If another thread has cached
+ * the descriptor in the meantime, config is dropped in favour of that one.
+ * Returns the descriptor to hand to the caller. */
+static struct libusb_config_descriptor *cache_config(struct libusb_device *dev,
+	int config_idx, unsigned int gen, struct libusb_config_descriptor *config)
+{
+	struct libusb_config_descriptor **entry, *cached = NULL;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	if (gen == dev->config_cache_gen) {
+		entry = config_cache_entry(dev, config_idx);
+		if (entry && *entry) {
+			cached = *entry;
+			ref_config(cached);
+		} else if (entry) {
+			ref_config(config);
+			*entry = config;
+		}
+	}
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	if (!cached)
+		return config;
+
+	unref_config(config);
+	return cached;
+}
+
+/* Drops the cached configuration descriptors and endpoint table of a
+ * device. Descriptors that were handed out stay valid until they are
+ * freed. */
+void usbi_clear_config_cache(struct libusb_device *dev)
+{
+	struct libusb_config_descriptor *active, **configs;
+	struct usbi_endpoint_table *endpoint_table;
+	uint8_t i, num_configs;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	active = dev->active_config;
+	configs = dev->configs;
+	num_configs = dev->num_configs;
+	endpoint_table = dev->endpoint_table;
+	dev->active_config = NULL;
+	dev->configs = NULL;
+	dev->num_configs = 0;
+	dev->endpoint_table = NULL;
+	dev->config_cache_gen++;
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	free(endpoint_table);
+
+	if (active)
+		unref_config(active);
+	if (configs) {
+		for (i = 0; i < num_configs; i++) {
+			if (configs[i])
+				unref_config(configs[i]);
+		}
+		free(configs);
+	}
+}
+
+/* Drops the cached active configuration descriptor and endpoint table of a
+ * device if they do not match the given bConfigurationValue, which is 0 for
+ * an unconfigured device. Called with the value read by
+ * libusb_get_configuration(). */
+void usbi_check_config_cache(struct libusb_device *dev, uint8_t active_value)
+{
+	struct libusb_config_descriptor *active = NULL;
+	struct usbi_endpoint_table *endpoint_table = NULL;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	if ((dev->active_config &&
+	     dev->active_config->bConfigurationValue != active_value) ||
+	    (dev->endpoint_table &&
+	     dev->endpoint_table->bConfigurationValue != active_value) ||
+	    (active_value == 0 && (dev->active_config || dev->endpoint_table))) {
+		active = dev->active_config;
+		endpoint_table = dev->endpoint_table;
+		dev->active_config = NULL;
+		dev->endpoint_table = NULL;
+		dev->config_cache_gen++;
+	}
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	free(endpoint_table);
+	if (active)
+		unref_config(active);
+}
+
 static int get_active_config_descriptor(struct libusb_device *dev,
 	uint8_t *buffer, size_t size)
 {
@@ -530,6 +682,15 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * Since version 1.0.30, parsed descriptors are cached on the device and
+ * shared between callers, so the returned descriptor must not be modified.
+ * Once cached, a descriptor is returned without asking the operating system
+ * again; the cost of a call is a mutex and a reference count. The cache is
+ * dropped by libusb_set_configuration() and libusb_reset_device(). If the
+ * configuration may have been changed outside of libusb, call
+ * libusb_get_configuration(), which drops a cached active descriptor that
+ * no longer matches, including when the device became unconfigured.
+ *
  * \param dev a device
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
@@ -544,9 +705,14 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 {
 	union usbi_config_desc_buf _config;
 	uint16_t config_len;
+	unsigned int gen;
 	uint8_t *buf;
 	int r;
 
+	*config = lookup_config(dev, -1, &gen);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	r = get_active_config_descriptor(dev, _config.buf, sizeof(_config.buf));
 	if (r < 0)
 		return r;
@@ -559,6 +725,8 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	r = get_active_config_descriptor(dev, buf, config_len);
 	if (r >= 0)
 		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
+	if (r == LIBUSB_SUCCESS)
+		*config = cache_config(dev, -1, gen, *config);
 
 	free(buf);
 	return r;
@@ -569,6 +737,9 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * The returned descriptor is shared and must not be modified, see
+ * libusb_get_active_config_descriptor().
+ *
  * \param dev a device
  * \param config_index the index of the configuration you wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
@@ -585,6 +756,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 {
 	union usbi_config_desc_buf _config;
 	uint16_t config_len;
+	unsigned int gen;
 	uint8_t *buf;
 	int r;
 
@@ -592,6 +764,10 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->device_descriptor.bNumConfigurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	*config = lookup_config(dev, config_index, &gen);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	r = get_config_descriptor(dev, config_index, _config.buf, sizeof(_config.buf));
 	if (r < 0)
 		return r;
@@ -604,6 +780,8 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	r = get_config_descriptor(dev, config_index, buf, config_len);
 	if (r >= 0)
 		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
+	if (r == LIBUSB_SUCCESS)
+		*config = cache_config(dev, config_index, gen, *config);
 
 	free(buf);
 	return r;
@@ -614,6 +792,9 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * The returned descriptor is shared and must not be modified, see
+ * libusb_get_active_config_descriptor().
+ *
  * \param dev a device
  * \param bConfigurationValue the bConfigurationValue of the configuration you
  * wish to retrieve
@@ -632,6 +813,21 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t idx;
 	int r;
 
+	/* look for a cached descriptor first */
+	*config = NULL;
+	usbi_mutex_lock(&dev->config_cache_lock);
+	for (idx = 0; idx < dev->num_configs; idx++) {
+		if (dev->configs[idx] &&
+		    dev->configs[idx]->bConfigurationValue == bConfigurationValue) {
+			*config = dev->configs[idx];
+			ref_config(*config);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&dev->config_cache_lock);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	if (usbi_backend.get_config_descriptor_by_value) {
 		void *buf;
 
@@ -664,6 +860,9 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
+ * As descriptors are shared, this drops the caller's reference; the memory
+ * is released once the device no longer caches the descriptor either.
+ *
  * \param config the configuration descriptor to free
  */
 void API_EXPORTED libusb_free_config_descriptor(
@@ -672,8 +871,217 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	unref_config(config);
+}
+
+/** \ingroup libusb_desc
+ * Get the raw descriptors of the currently active configuration without
+ * copying or parsing them. The data starts with the configuration descriptor
+ * and is in bus-endian (little-endian) format; walk it with a
+ * \ref libusb_descriptor_iterator.
+ *
+ * The data belongs to the device and remains valid until the device is
+ * destroyed. It must not be modified or freed.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev a device
+ * \param data output location for the descriptor data. Only valid if a
+ * length was returned.
+ * \returns the length of the data in bytes on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the platform does not keep the
+ * descriptors in memory, use libusb_get_active_config_descriptor() instead
+ * \returns another LIBUSB_ERROR code on error
+ */
+int API_EXPORTED libusb_get_raw_active_config_descriptor(libusb_device *dev,
+	const unsigned char **data)
+{
+	const void *buf;
+	int r;
+
+	if (!usbi_backend.get_raw_config_descriptor)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend.get_raw_config_descriptor(dev, -1, &buf);
+	if (r < 0)
+		return r;
+
+	*data = buf;
+	return r;
+}
+
+/** \ingroup libusb_desc
+ * Get the raw descriptors of a configuration based on its index, without
+ * copying or parsing them. Behaves as
+ * libusb_get_raw_active_config_descriptor() otherwise.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev a device
+ * \param config_index the index of the configuration you wish to retrieve
+ * \param data output location for the descriptor data. Only valid if a
+ * length was returned.
+ * \returns the length of the data in bytes on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the platform does not keep the
+ * descriptors in memory
+ * \returns another LIBUSB_ERROR code on error
+ */
+int API_EXPORTED libusb_get_raw_config_descriptor(libusb_device *dev,
+	uint8_t config_index, const unsigned char **data)
+{
+	const void *buf;
+	int r;
+
+	if (config_index >= dev->device_descriptor.bNumConfigurations)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (!usbi_backend.get_raw_config_descriptor)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend.get_raw_config_descriptor(dev, config_index, &buf);
+	if (r < 0)
+		return r;
+
+	*data = buf;
+	return r;
+}
+
+/* Gets the raw descriptors of the active configuration, directly from the
+ * backend when it keeps them in memory and otherwise by reading them into a
+ * buffer returned in *copy, which the caller must free. Returns the length
+ * of the data or a LIBUSB_ERROR code. */
+int usbi_get_active_config_data(struct libusb_device *dev,
+	const unsigned char **data, unsigned char **copy)
+{
+	union usbi_config_desc_buf _config;
+	uint16_t config_len;
+	uint8_t *buf;
+	int r;
+
+	*copy = NULL;
+	r = libusb_get_raw_active_config_descriptor(dev, data);
+	if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+		return r;
+
+	r = get_active_config_descriptor(dev, _config.buf, sizeof(_config.buf));
+	if (r < 0)
+		return r;
+
+	config_len = libusb_le16_to_cpu(_config.desc.wTotalLength);
+	buf = malloc(config_len);
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = get_active_config_descriptor(dev, buf, config_len);
+	if (r < 0) {
+		free(buf);
+		return r;
+	}
+
+	*data = *copy = buf;
+	return r;
+}
+
+/** \ingroup libusb_desc
+ * Prepare an iterator over raw descriptor data, such as that returned by
+ * libusb_get_raw_config_descriptor().
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param iter the iterator to initialize
+ * \param data the descriptor data
+ * \param length length of data in bytes
+ */
+void API_EXPORTED libusb_descriptor_iterator_init(
+	struct libusb_descriptor_iterator *iter, const unsigned char *data,
+	int length)
+{
+	iter->data = data;
+	iter->length = (data && length > 0) ? length : 0;
+	iter->offset = 0;
+	iter->interface_index = -1;
+	iter->altsetting_index = -1;
+	iter->interface_number = -1;
+}
+
+/** \ingroup libusb_desc
+ * Advance an iterator to the next descriptor. Every descriptor is returned in
+ * turn, starting with the configuration descriptor itself; the type is in
+ * byte 1 of the returned descriptor and its length in byte 0.
+ *
+ * Interface descriptors update the interface and alternate setting indices
+ * of the iterator, which match the layout produced by
+ * libusb_get_config_descriptor(). Descriptors after an interface descriptor
+ * belong to that alternate setting.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param iter the iterator
+ * \param desc output location for the descriptor, which is at least 2 bytes
+ * long and lies entirely within the data. Only valid if 1 was returned.
+ * \returns 1 if a descriptor was returned
+ * \returns 0 at the end of the data
+ * \returns \ref LIBUSB_ERROR_IO if a descriptor has an invalid length
+ */
+int API_EXPORTED libusb_descriptor_iterator_next(
+	struct libusb_descriptor_iterator *iter, const unsigned char **desc)
+{
+	const unsigned char *p;
+	int remaining = iter->length - iter->offset;
+
+	/* trailing bytes too short for a header are ignored, as when parsing */
+	if (remaining < DESC_HEADER_LENGTH)
+		return 0;
+
+	p = iter->data + iter->offset;
+	if (p[0] < DESC_HEADER_LENGTH || p[0] > remaining)
+		return LIBUSB_ERROR_IO;
+
+	if (p[1] == LIBUSB_DT_INTERFACE && p[0] >= LIBUSB_DT_INTERFACE_SIZE) {
+		if (iter->interface_index < 0 || p[2] != iter->interface_number) {
+			iter->interface_index++;
+			iter->altsetting_index = 0;
+			iter->interface_number = p[2];
+		} else {
+			iter->altsetting_index++;
+		}
+	}
+
+	iter->offset += p[0];
+	*desc = p;
+	return 1;
+}
+
+/** \ingroup libusb_desc
+ * Advance an iterator to the next descriptor of the given type, skipping all
+ * others.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param iter the iterator
+ * \param descriptor_type the \ref libusb_descriptor_type to look for, or a
+ * class-specific type
+ * \param desc output location for the descriptor. Only valid if 1 was
+ * returned.
+ * \returns 1 if a descriptor was found
+ * \returns 0 if there are no more descriptors of this type
+ * \returns \ref LIBUSB_ERROR_IO if a descriptor has an invalid length
+ * \see libusb_descriptor_iterator_next()
+ */
+int API_EXPORTED libusb_descriptor_iterator_find(
+	struct libusb_descriptor_iterator *iter, uint8_t descriptor_type,
+	const unsigned char **desc)
+{
+	int r;
+
+	while ((r = libusb_descriptor_iterator_next(iter, desc)) > 0) {
+		if ((*desc)[1] == descriptor_type)
+			return 1;
+	}
+
+	return r;
 }
 
 /** \ingroup libusb_desc
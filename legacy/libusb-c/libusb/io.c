@@ -23,6 +23,8 @@
 
 #include "libusbi.h"
 
+#include <string.h>
+
 /**
  * \page libusb_io Synchronous and asynchronous device I/O
  *
@@ -534,6 +536,10 @@ if (r == 0 && actual_length == sizeof(data)) {
  * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
  *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
  *   transfer after the transfer callback returns.
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_DEFER_CALLBACK
+ *   "LIBUSB_TRANSFER_DEFER_CALLBACK" hands the transfer callback to the
+ *   executor set with libusb_set_executor(), so that slow callbacks do not
+ *   hold up event handling.
  *
  * \section asyncevent Event handling
  *
@@ -1177,7 +1183,7 @@ int usbi_io_init(struct libusb_context *ctx)
 	if (r < 0)
 		goto err;
 
-	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS);
+	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS, NULL);
 	if (r < 0)
 		goto err_destroy_event;
 
@@ -1185,7 +1191,7 @@ int usbi_io_init(struct libusb_context *ctx)
 	r = usbi_create_timer(&ctx->timer);
 	if (r == 0) {
 		usbi_dbg(ctx, "using timer for timeouts");
-		r = usbi_add_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer), USBI_TIMER_POLL_EVENTS);
+		r = usbi_add_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer), USBI_TIMER_POLL_EVENTS, NULL);
 		if (r < 0)
 			goto err_destroy_timer;
 	} else {
@@ -1238,8 +1244,10 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
+	usbi_free_event_data(ctx);
 	cleanup_removed_event_sources(ctx);
-	free(ctx->event_data);
+	free(ctx->timeout_heap);
+	usbi_transfer_pool_set_limit(ctx, 0);
 }
 
 static void calculate_timeout(struct usbi_transfer *itransfer)
@@ -1262,6 +1270,31 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 	}
 }
 
+static size_t transfer_alloc_size(int iso_packets)
+{
+	size_t priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
+	size_t usbi_transfer_size = PTR_ALIGN(sizeof(struct usbi_transfer));
+	size_t libusb_transfer_size = PTR_ALIGN(sizeof(struct libusb_transfer));
+	size_t iso_packets_size = sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets;
+
+	return priv_size + usbi_transfer_size + libusb_transfer_size + iso_packets_size;
+}
+
+/* initializes a zeroed transfer allocation of transfer_alloc_size(iso_packets)
+ * bytes and returns the usbi_transfer within it */
+static struct usbi_transfer *transfer_init(unsigned char *ptr, int iso_packets)
+{
+	size_t priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
+	struct usbi_transfer *itransfer = (struct usbi_transfer *)(ptr + priv_size);
+
+	itransfer->num_iso_packets = iso_packets;
+	itransfer->pool_class = -1;
+	itransfer->priv = ptr;
+	usbi_mutex_init(&itransfer->lock);
+
+	return itransfer;
+}
+
 /** \ingroup libusb_asyncio
  * Allocate a libusb transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1284,6 +1317,7 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
  *
  * \param iso_packets number of isochronous packet descriptors to allocate. Must be non-negative.
  * \returns a newly allocated transfer, or NULL on error
+ * \see libusb_alloc_pooled_transfer()
  */
 DEFAULT_VISIBILITY
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
@@ -1293,33 +1327,247 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	if (iso_packets < 0)
 		return NULL;
 
-	size_t priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
-	size_t usbi_transfer_size = PTR_ALIGN(sizeof(struct usbi_transfer));
-	size_t libusb_transfer_size = PTR_ALIGN(sizeof(struct libusb_transfer));
-	size_t iso_packets_size = sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets;
-	size_t alloc_size = priv_size + usbi_transfer_size + libusb_transfer_size + iso_packets_size;
-	unsigned char *ptr = calloc(1, alloc_size);
+	unsigned char *ptr = calloc(1, transfer_alloc_size(iso_packets));
 	if (!ptr)
 		return NULL;
 
-	struct usbi_transfer *itransfer = (struct usbi_transfer *)(ptr + priv_size);
-	itransfer->num_iso_packets = iso_packets;
-	itransfer->priv = ptr;
-	usbi_mutex_init(&itransfer->lock);
+	struct usbi_transfer *itransfer = transfer_init(ptr, iso_packets);
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	return transfer;
 }
 
+/* Transfer pool
+ *
+ * Each context owns one lock-free free-list per size class. Pushing a
+ * transfer is a plain compare-and-swap loop. Popping detaches the whole list
+ * with an atomic exchange, keeps the first entry and gives the rest back.
+ * This avoids the ABA problem of a compare-and-swap based pop without needing
+ * double-width atomics, at the cost of a concurrent pop occasionally seeing
+ * an empty list and falling back to the system allocator. */
+
+/* returns the size class for the given number of isochronous packets, or -1
+ * if transfers of this size are not pooled */
+static int transfer_pool_class(int iso_packets)
+{
+	int pool_class, class_iso_packets = USBI_TRANSFER_POOL_MIN_ISO;
+
+	if (iso_packets == 0)
+		return 0;
+
+	for (pool_class = 1; pool_class < USBI_TRANSFER_POOL_CLASSES; pool_class++) {
+		if (iso_packets <= class_iso_packets)
+			return pool_class;
+		class_iso_packets <<= 2;
+	}
+
+	return -1;
+}
+
+static int transfer_pool_class_iso_packets(int pool_class)
+{
+	if (pool_class == 0)
+		return 0;
+
+	return USBI_TRANSFER_POOL_MIN_ISO << (2 * (pool_class - 1));
+}
+
+static void transfer_pool_push(usbi_atomic_ptr_t *head,
+	struct usbi_transfer *first)
+{
+	struct usbi_transfer *last = first;
+	void *old = NULL;
+
+	/* common case, nobody put anything back in the meantime */
+	if (usbi_atomic_ptr_cas(head, &old, first))
+		return;
+
+	while (last->pool_next)
+		last = last->pool_next;
+
+	do {
+		last->pool_next = old;
+	} while (!usbi_atomic_ptr_cas(head, &old, first));
+}
+
+static struct usbi_transfer *transfer_pool_pop(usbi_atomic_ptr_t *head)
+{
+	struct usbi_transfer *itransfer;
+
+	if (!usbi_atomic_ptr_load(head))
+		return NULL;
+
+	itransfer = usbi_atomic_ptr_exchange(head, NULL);
+	if (!itransfer)
+		return NULL;
+
+	if (itransfer->pool_next) {
+		transfer_pool_push(head, itransfer->pool_next);
+		itransfer->pool_next = NULL;
+	}
+
+	return itransfer;
+}
+
+/* releases all transfers retained by the pool to the system allocator */
+static void transfer_pool_drain(struct libusb_context *ctx)
+{
+	struct usbi_transfer_pool *pool = &ctx->transfer_pool;
+	struct usbi_transfer *itransfer, *next;
+	int pool_class;
+
+	for (pool_class = 0; pool_class < USBI_TRANSFER_POOL_CLASSES; pool_class++) {
+		itransfer = usbi_atomic_ptr_exchange(&pool->free_lists[pool_class], NULL);
+		while (itransfer) {
+			next = itransfer->pool_next;
+			(void)usbi_atomic_dec(&pool->retained);
+			free(itransfer->priv);
+			itransfer = next;
+		}
+	}
+}
+
+void usbi_transfer_pool_set_limit(struct libusb_context *ctx, int limit)
+{
+	usbi_atomic_store(&ctx->transfer_pool.limit, limit);
+	if (!limit)
+		transfer_pool_drain(ctx);
+}
+
+/* returns non-zero if the transfer was taken by its pool */
+static int transfer_pool_put(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = itransfer->pool_ctx;
+	struct usbi_transfer_pool *pool;
+
+	if (itransfer->pool_class < 0 || !ctx)
+		return 0;
+
+	pool = &ctx->transfer_pool;
+	if (usbi_atomic_inc(&pool->retained) > usbi_atomic_load(&pool->limit)) {
+		(void)usbi_atomic_dec(&pool->retained);
+		(void)usbi_atomic_inc(&pool->overflows);
+		return 0;
+	}
+
+	itransfer->pool_next = NULL;
+	transfer_pool_push(&pool->free_lists[itransfer->pool_class], itransfer);
+	return 1;
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a libusb transfer from the transfer pool of a context. This
+ * behaves like libusb_alloc_transfer(), except that the transfer is returned
+ * to the pool of the context when it is freed with libusb_free_transfer(),
+ * and that the allocation is served from the pool whenever a previously freed
+ * transfer of a compatible size is available.
+ *
+ * Transfers are pooled in a small number of size classes keyed by the number
+ * of isochronous packet descriptors, so the transfer may have room for more
+ * descriptors than requested. Transfers with a very large number of
+ * descriptors are never pooled.
+ *
+ * The pool is disabled by default, in which case this function is
+ * equivalent to libusb_alloc_transfer(). Enable it by setting the
+ * \ref LIBUSB_OPTION_TRANSFER_POOL option on the context. All pooled
+ * transfers must be freed before the context is deinitialized with
+ * libusb_exit().
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param ctx the context whose pool to use, or NULL for the default context
+ * \param iso_packets number of isochronous packet descriptors to allocate. Must be non-negative.
+ * \returns a newly allocated or recycled transfer, or NULL on error
+ * \see libusb_get_transfer_pool_stats()
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_pooled_transfer(
+	libusb_context *ctx, int iso_packets)
+{
+	struct usbi_transfer_pool *pool;
+	struct usbi_transfer *itransfer = NULL;
+	unsigned char *ptr;
+	size_t alloc_size;
+	int pool_class;
+
+	assert(iso_packets >= 0);
+	if (iso_packets < 0)
+		return NULL;
+
+	ctx = usbi_get_context(ctx);
+	pool_class = transfer_pool_class(iso_packets);
+	if (!ctx || pool_class < 0)
+		return libusb_alloc_transfer(iso_packets);
+
+	pool = &ctx->transfer_pool;
+	if (!usbi_atomic_load(&pool->limit))
+		return libusb_alloc_transfer(iso_packets);
+
+	iso_packets = transfer_pool_class_iso_packets(pool_class);
+	alloc_size = transfer_alloc_size(iso_packets);
+
+	itransfer = transfer_pool_pop(&pool->free_lists[pool_class]);
+	if (itransfer) {
+		(void)usbi_atomic_dec(&pool->retained);
+		(void)usbi_atomic_inc(&pool->hits);
+		ptr = itransfer->priv;
+		memset(ptr, 0, alloc_size);
+	} else {
+		(void)usbi_atomic_inc(&pool->misses);
+		ptr = calloc(1, alloc_size);
+		if (!ptr)
+			return NULL;
+	}
+
+	itransfer = transfer_init(ptr, iso_packets);
+	itransfer->pool_ctx = ctx;
+	itransfer->pool_class = pool_class;
+
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+}
+
+/** \ingroup libusb_asyncio
+ * Retrieve statistics of the transfer pool of a context.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param ctx the context to query, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stats is NULL or there is no context
+ * \see libusb_alloc_pooled_transfer()
+ */
+int API_EXPORTED libusb_get_transfer_pool_stats(libusb_context *ctx,
+	struct libusb_transfer_pool_stats *stats)
+{
+	struct usbi_transfer_pool *pool;
+
+	ctx = usbi_get_context(ctx);
+	if (!ctx || !stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	pool = &ctx->transfer_pool;
+	stats->hits = (uint64_t)usbi_atomic_load(&pool->hits);
+	stats->misses = (uint64_t)usbi_atomic_load(&pool->misses);
+	stats->overflows = (uint64_t)usbi_atomic_load(&pool->overflows);
+	stats->retained = (uint32_t)usbi_atomic_load(&pool->retained);
+	stats->limit = (uint32_t)usbi_atomic_load(&pool->limit);
+
+	return LIBUSB_SUCCESS;
+}
+
 /** \ingroup libusb_asyncio
  * Free a transfer structure. This should be called for all transfers
- * allocated with libusb_alloc_transfer().
+ * allocated with libusb_alloc_transfer() or libusb_alloc_pooled_transfer().
  *
  * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
  * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set and the transfer buffer is
  * non-NULL, this function will also free the transfer buffer using the
  * standard system memory allocator (e.g. free()).
  *
+ * Transfers allocated with libusb_alloc_pooled_transfer() are returned to
+ * the transfer pool of their context if it has room for them.
+ *
  * It is legal to call this function with a NULL transfer. In this case,
  * the function will simply return safely.
  *
@@ -1338,21 +1586,203 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
-	if (itransfer->dev)
+	if (usbi_backend.free_transfer_priv)
+		usbi_backend.free_transfer_priv(itransfer);
+	if (itransfer->dev) {
 		libusb_unref_device(itransfer->dev);
+		itransfer->dev = NULL;
+	}
+
+	/* the lock is initialized again when a pooled transfer is reused */
+	usbi_mutex_destroy(&itransfer->lock);
+	if (transfer_pool_put(itransfer))
+		return;
 
 	unsigned char *ptr = USBI_TRANSFER_TO_TRANSFER_PRIV(itransfer);
 	assert(ptr == itransfer->priv);
 	free(ptr);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
+/* Timeout heap
+ *
+ * In-flight transfers with a finite timeout are kept in a binary min-heap
+ * ordered by timeout expiration, so that adding and removing a transfer is
+ * O(log n) and finding the next timeout is O(1). Each transfer records its
+ * position in the heap so it can be removed without a search. Transfers with
+ * an infinite timeout are never added to the heap.
+ *
+ * NB: flying_transfers_lock must be held when calling any of these. */
+
+static void timeout_heap_set(struct libusb_context *ctx, unsigned int idx,
+	struct usbi_transfer *itransfer)
+{
+	ctx->timeout_heap[idx] = itransfer;
+	itransfer->timeout_heap_index = idx + 1;
+}
+
+static void timeout_heap_sift_up(struct libusb_context *ctx, unsigned int idx,
+	struct usbi_transfer *itransfer)
+{
+	while (idx > 0) {
+		unsigned int parent = (idx - 1) / 2;
+		struct usbi_transfer *cur = ctx->timeout_heap[parent];
+
+		if (!TIMESPEC_CMP(&itransfer->timeout, &cur->timeout, <))
+			break;
+
+		timeout_heap_set(ctx, idx, cur);
+		idx = parent;
+	}
+
+	timeout_heap_set(ctx, idx, itransfer);
+}
+
+static void timeout_heap_sift_down(struct libusb_context *ctx, unsigned int idx,
+	struct usbi_transfer *itransfer)
+{
+	struct usbi_transfer **heap = ctx->timeout_heap;
+	unsigned int len = ctx->timeout_heap_len;
+
+	while (2 * idx + 1 < len) {
+		unsigned int child = 2 * idx + 1;
+
+		if (child + 1 < len &&
+		    TIMESPEC_CMP(&heap[child + 1]->timeout, &heap[child]->timeout, <))
+			child++;
+
+		if (!TIMESPEC_CMP(&heap[child]->timeout, &itransfer->timeout, <))
+			break;
+
+		timeout_heap_set(ctx, idx, heap[child]);
+		idx = child;
+	}
+
+	timeout_heap_set(ctx, idx, itransfer);
+}
+
+static int timeout_heap_insert(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		unsigned int heap_size = ctx->timeout_heap_size ? 2 * ctx->timeout_heap_size : 64;
+		struct usbi_transfer **heap;
+
+		/* the transfers already in the heap stay there on failure */
+		heap = realloc(ctx->timeout_heap, heap_size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = heap_size;
+	}
+
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_len++, itransfer);
+	return 0;
+}
+
+static void timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	unsigned int idx = itransfer->timeout_heap_index - 1;
+	struct usbi_transfer *last;
+
+	assert(itransfer->timeout_heap_index);
+	itransfer->timeout_heap_index = 0;
+
+	last = ctx->timeout_heap[--ctx->timeout_heap_len];
+	if (last == itransfer)
+		return;
+
+	/* move the last entry into the hole and restore the heap order */
+	if (idx > 0 && TIMESPEC_CMP(&last->timeout, &ctx->timeout_heap[(idx - 1) / 2]->timeout, <))
+		timeout_heap_sift_up(ctx, idx, last);
+	else
+		timeout_heap_sift_down(ctx, idx, last);
+}
+
+/* returns the in-flight transfer with the next upcoming timeout that has not
+ * already been handled, or NULL if there is none. transfers whose timeout is
+ * handled by the OS are dropped from the timeout heap on the way.
+ * NB: flying_transfers_lock must be held when calling this. */
+static struct usbi_transfer *next_timeout_transfer(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *itransfer = ctx->timeout_heap[0];
+
+		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return itransfer;
+
+		timeout_heap_remove(ctx, itransfer);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_OS_TIMER
+/* arms the timer for the given expiration, or disarms it if timeout is NULL.
+ * The system call is skipped if the timer is already in that state.
+ * NB: flying_transfers_lock must be held when calling this.
+ * returns 0 on success or a LIBUSB_ERROR code on failure. */
+static int set_timer(struct libusb_context *ctx, const struct timespec *timeout)
+{
+	int r;
+
+	if (!timeout) {
+		if (!ctx->timer_armed)
+			return 0;
+		r = usbi_disarm_timer(&ctx->timer);
+		if (r)
+			return r;
+		ctx->timer_armed = 0;
+	} else {
+		if (ctx->timer_armed && TIMESPEC_CMP(&ctx->timer_expiry, timeout, ==))
+			return 0;
+		r = usbi_arm_timer(&ctx->timer, timeout);
+		if (r)
+			return r;
+		ctx->timer_expiry = *timeout;
+		ctx->timer_armed = 1;
+	}
+
+	(void)usbi_atomic_inc(&ctx->event_stats.timer_updates);
+	return 0;
+}
+
+/* adds the timer slack to a timeout */
+static void add_timer_slack(struct libusb_context *ctx, struct timespec *timeout)
+{
+	unsigned int slack = ctx->timer_slack;
+
+	timeout->tv_sec += slack / 1000U;
+	timeout->tv_nsec += (slack % 1000U) * 1000000L;
+	if (timeout->tv_nsec >= NSEC_PER_SEC) {
+		++timeout->tv_sec;
+		timeout->tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+/* arms the timer for a new timeout unless it is already armed to fire no
+ * later than the timeout plus the timer slack. The timer is not rearmed when
+ * the transfer it was armed for goes away, so it may fire early; the trigger
+ * handler then simply rearms it for the next timeout.
+ * NB: flying_transfers_lock must be held when calling this. */
+static int arm_timer_for_timeout(struct libusb_context *ctx,
+	const struct timespec *timeout)
+{
+	struct timespec latest = *timeout;
+
+	add_timer_slack(ctx, &latest);
+	if (ctx->timer_armed && TIMESPEC_IS_SET(&ctx->timer_expiry) &&
+	    TIMESPEC_CMP(&ctx->timer_expiry, &latest, <=))
+		return 0;
+
+	return set_timer(ctx, timeout);
+}
+
+/* rearms the timer based on the next upcoming timeout.
  * NB: flying_transfers_lock must be held when calling this.
  * returns 0 on success or a LIBUSB_ERROR code on failure.
  */
-#ifdef HAVE_OS_TIMER
 static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 {
 	struct usbi_transfer *itransfer;
@@ -1360,24 +1790,19 @@ static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 	if (!usbi_using_timer(ctx))
 		return 0;
 
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			break;
+	itransfer = next_timeout_transfer(ctx);
+	if (itransfer) {
+		struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		struct timespec expiry = itransfer->timeout;
 
-		/* act on first transfer that has not already been handled */
-		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-			usbi_dbg(ctx, "next timeout originally %ums", transfer->timeout);
-			return usbi_arm_timer(&ctx->timer, cur_ts);
-		}
+		/* let the timeouts within the slack of this one expire with it */
+		usbi_dbg(ctx, "next timeout originally %ums", transfer->timeout);
+		add_timer_slack(ctx, &expiry);
+		return set_timer(ctx, &expiry);
 	}
 
 	usbi_dbg(ctx, "no timeouts, disarming timer");
-	return usbi_disarm_timer(&ctx->timer);
+	return set_timer(ctx, NULL);
 }
 #else
 static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
@@ -1387,86 +1812,63 @@ static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
 }
 #endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
+/* add a transfer to the active transfers list and, unless its timeout is
+ * infinite, to the timeout heap. The timer is only rearmed if arm_timer is
+ * set, otherwise the caller is responsible for doing so.
  * This function will return non 0 if fails to update the timer,
  * in which case the transfer is *not* on the flying_transfers list.
  * NB: flying_transfers_lock MUST be held when calling this. */
-static int add_to_flying_list(struct usbi_transfer *itransfer)
+static int add_to_flying_list(struct usbi_transfer *itransfer, int arm_timer)
 {
-	struct usbi_transfer *cur;
-	struct timespec *timeout = &itransfer->timeout;
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
-	int first = 1;
+	int r;
 
 	calculate_timeout(itransfer);
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&itransfer->list, &ctx->flying_transfers);
-		goto out;
-	}
-
-	/* if we have infinite timeout, append to end of list */
-	if (!TIMESPEC_IS_SET(timeout)) {
-		list_add_tail(&itransfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
-
-	/* otherwise, find appropriate place in list */
-	for_each_transfer(ctx, cur) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timespec *cur_ts = &cur->timeout;
+	if (TIMESPEC_IS_SET(&itransfer->timeout)) {
+		r = timeout_heap_insert(ctx, itransfer);
+		if (r)
+			return r;
 
-		if (!TIMESPEC_IS_SET(cur_ts) || TIMESPEC_CMP(cur_ts, timeout, >)) {
-			list_add_tail(&itransfer->list, &cur->list);
-			goto out;
+#ifndef HAVE_OS_TIMER
+		UNUSED(arm_timer);
+#else
+		if (arm_timer && itransfer->timeout_heap_index == 1 && usbi_using_timer(ctx)) {
+			/* if this transfer has the lowest timeout of all active
+			 * transfers, rearm the timer with this transfer's timeout */
+			struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+			usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
+				transfer->timeout);
+			r = arm_timer_for_timeout(ctx, &itransfer->timeout);
+			if (r) {
+				timeout_heap_remove(ctx, itransfer);
+				return r;
+			}
 		}
-		first = 0;
+#endif
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
 	list_add_tail(&itransfer->list, &ctx->flying_transfers);
-out:
-#ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-		usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
-			transfer->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
-	}
-#else
-	UNUSED(first);
-#endif
-
-	if (r)
-		list_del(&itransfer->list);
-
-	return r;
+	return 0;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout.
+/* remove a transfer from the active transfers list and the timeout heap.
+ * The timer is left alone even if it was armed for this transfer's timeout;
+ * it is rearmed when it fires, see arm_timer_for_timeout().
  * NB: flying_transfers_lock MUST be held when calling this. */
-static int remove_from_flying_list(struct usbi_transfer *itransfer)
+static void remove_from_flying_list(struct usbi_transfer *itransfer)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int rearm_timer;
-	int r = 0;
-
-	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
 	list_del(&itransfer->list);
-	if (rearm_timer)
-		r = arm_timer_for_next_timeout(ctx);
+	if (itransfer->timeout_heap_index)
+		timeout_heap_remove(ITRANSFER_CTX(itransfer), itransfer);
+}
 
-	return r;
+/* remove a transfer whose device handle is being closed from the active
+ * transfers list and the timeout heap, so that it does not time out later.
+ * NB: flying_transfers_lock MUST be held when calling this. */
+void usbi_remove_closed_transfer(struct usbi_transfer *itransfer)
+{
+	remove_from_flying_list(itransfer);
 }
 
 /** \ingroup libusb_asyncio
@@ -1540,7 +1942,7 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	itransfer->transferred = 0;
 	itransfer->state_flags = 0;
 	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
+	r = add_to_flying_list(itransfer, 1);
 	if (r) {
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 		usbi_mutex_unlock(&itransfer->lock);
@@ -1568,28 +1970,177 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 }
 
 /** \ingroup libusb_asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
- *
- * This function behaves differently on Darwin-based systems (macOS and iOS):
- *
- * - Calling this function for one transfer will cause all transfers on the
- *   same endpoint to be cancelled. Your callback function will be invoked with
- *   a transfer status of
- *   \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- *   "LIBUSB_TRANSFER_CANCELLED" for each transfer that was cancelled.
+ * Submit a batch of transfers. This behaves like calling
+ * libusb_submit_transfer() on each transfer in turn, but the transfers are
+ * added to the active transfers with a single acquisition of the internal
+ * lock and the timeout timer is rearmed at most once, which makes queueing
+ * many transfers at once considerably cheaper.
+ *
+ * All transfers must belong to device handles of the same context. The
+ * outcome for each transfer is stored in the corresponding element of
+ * results: 0 if the transfer was submitted, or the error code
+ * libusb_submit_transfer() would have returned for it. Transfers that fail
+ * do not affect the submission of the others.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param transfers array of transfers to submit
+ * \param num_transfers number of elements in transfers and results
+ * \param results output array for the per-transfer result
+ * \returns the number of transfers successfully submitted
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if an array is NULL, or the
+ * transfers do not all belong to the same context
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results)
+{
+	struct usbi_transfer *itransfer;
+	struct libusb_context *ctx;
+	int i, r, submitted = 0;
+#ifdef HAVE_OS_TIMER
+	struct usbi_transfer *first;
+#endif
 
- * - When built for macOS versions prior to 10.5, this function sends a
- *   \c ClearFeature(ENDPOINT_HALT) request for the transfer's endpoint.
- *   (Prior to libusb 1.0.27, this request was sent on all Darwin systems.)
- *   If the device does not handle this request correctly, the data toggle
- *   bits for the endpoint can be left out of sync between host and device,
- *   which can have unpredictable results when the next data is sent on
- *   the endpoint, including data being silently lost. A call to
+	if (!transfers || !results || num_transfers < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!num_transfers)
+		return 0;
+
+	ctx = HANDLE_CTX(transfers[0]->dev_handle);
+	for (i = 0; i < num_transfers; i++) {
+		assert(transfers[i]->dev_handle);
+		if (HANDLE_CTX(transfers[i]->dev_handle) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_dbg(ctx, "%d transfers", num_transfers);
+
+	for (i = 0; i < num_transfers; i++) {
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+		if (itransfer->dev)
+			libusb_unref_device(itransfer->dev);
+		itransfer->dev = libusb_ref_device(transfers[i]->dev_handle->dev);
+	}
+
+	/*
+	 * The locking follows libusb_submit_transfer(): each transfer lock is
+	 * taken while holding flying_transfers_lock and kept until the backend
+	 * has accepted the transfer. A transfer that is already on the flying
+	 * list, including one that appears twice in the batch, is rejected
+	 * before its lock is taken. A result of 0 marks the transfers that are
+	 * queued and still locked.
+	 */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+#ifdef HAVE_OS_TIMER
+	first = ctx->timeout_heap_len ? ctx->timeout_heap[0] : NULL;
+#endif
+	for (i = 0; i < num_transfers; i++) {
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+		/* list.next is only written while flying_transfers_lock is
+		 * held, which this thread holds, so the check needs no
+		 * transfer lock */
+		if (itransfer->list.next) {
+			results[i] = LIBUSB_ERROR_BUSY;
+			continue;
+		}
+
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+			usbi_mutex_unlock(&itransfer->lock);
+			results[i] = LIBUSB_ERROR_BUSY;
+			continue;
+		}
+		itransfer->transferred = 0;
+		itransfer->state_flags = 0;
+		itransfer->timeout_flags = 0;
+		r = add_to_flying_list(itransfer, 0);
+		if (r)
+			usbi_mutex_unlock(&itransfer->lock);
+		results[i] = r;
+	}
+
+#ifdef HAVE_OS_TIMER
+	/* rearm the timer once if the batch changed the earliest timeout */
+	if (ctx->timeout_heap_len && ctx->timeout_heap[0] != first &&
+	    usbi_using_timer(ctx)) {
+		r = arm_timer_for_timeout(ctx, &ctx->timeout_heap[0]->timeout);
+		if (r) {
+			for (i = 0; i < num_transfers; i++) {
+				if (results[i])
+					continue;
+				itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+				remove_from_flying_list(itransfer);
+				usbi_mutex_unlock(&itransfer->lock);
+				results[i] = r;
+			}
+		}
+	}
+#endif
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	/*
+	 * The transfers after the current one are still locked, so a transfer
+	 * the backend rejects cannot be taken off the flying list here without
+	 * taking flying_transfers_lock after a transfer lock. Until every
+	 * transfer lock is released, a rejected transfer is marked by the
+	 * positive value of its error code.
+	 */
+	for (i = 0; i < num_transfers; i++) {
+		if (results[i])
+			continue;
+
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+		r = usbi_backend.submit_transfer(itransfer);
+		if (r == LIBUSB_SUCCESS)
+			itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		usbi_mutex_unlock(&itransfer->lock);
+
+		if (r != LIBUSB_SUCCESS)
+			results[i] = -r;
+		else
+			submitted++;
+	}
+
+	if (submitted == num_transfers)
+		return submitted;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for (i = 0; i < num_transfers; i++) {
+		if (results[i] <= 0)
+			continue;
+
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+		remove_from_flying_list(itransfer);
+		results[i] = -results[i];
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return submitted;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * This function behaves differently on Darwin-based systems (macOS and iOS):
+ *
+ * - Calling this function for one transfer will cause all transfers on the
+ *   same endpoint to be cancelled. Your callback function will be invoked with
+ *   a transfer status of
+ *   \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ *   "LIBUSB_TRANSFER_CANCELLED" for each transfer that was cancelled.
+
+ * - When built for macOS versions prior to 10.5, this function sends a
+ *   \c ClearFeature(ENDPOINT_HALT) request for the transfer's endpoint.
+ *   (Prior to libusb 1.0.27, this request was sent on all Darwin systems.)
+ *   If the device does not handle this request correctly, the data toggle
+ *   bits for the endpoint can be left out of sync between host and device,
+ *   which can have unpredictable results when the next data is sent on
+ *   the endpoint, including data being silently lost. A call to
  *   \ref libusb_clear_halt will not resolve this situation, since that
  *   function uses the same request. Therefore, if your program runs on
  *   macOS < 10.5 (or libusb < 1.0.27), and uses a device that does not
@@ -1673,6 +2224,142 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
 	return itransfer->stream_id;
 }
 
+static void run_callback(struct libusb_context *ctx,
+	struct libusb_transfer *transfer)
+{
+	uint8_t flags = transfer->flags;
+
+	if (transfer->callback) {
+		libusb_lock_event_waiters (ctx);
+		transfer->callback(transfer);
+		libusb_unlock_event_waiters(ctx);
+	}
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* Runs the deferred callbacks of one endpoint in completion order until
+ * its queue is empty. Only one task per queue is with the executor at any
+ * time, which keeps the callbacks of an endpoint serialized.
+ * The callbacks run without the event waiters lock, so that they may do
+ * synchronous I/O. */
+static void LIBUSB_CALL run_deferred_callbacks(void *task)
+{
+	struct usbi_deferred_queue *queue = task;
+	struct libusb_device_handle *dev_handle = queue->dev_handle;
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int ran = 0;
+
+	for (;;) {
+		struct usbi_transfer *itransfer;
+		struct libusb_transfer *transfer;
+		uint8_t flags;
+
+		usbi_mutex_lock(&dev_handle->lock);
+		if (list_empty(&queue->transfers)) {
+			if (ran) {
+				usbi_mutex_unlock(&dev_handle->lock);
+
+				/* a thread waiting in libusb_handle_events_completed()
+				 * has either seen the completion flags set by the
+				 * callbacks or waits for the event handler to return,
+				 * which is interrupted here */
+				libusb_lock_event_waiters(ctx);
+				libusb_unlock_event_waiters(ctx);
+				libusb_interrupt_event_handler(ctx);
+				ran = 0;
+				continue;
+			}
+
+			/* the handle and its context may be freed as soon as
+			 * the lock is released, so do not touch them afterwards */
+			queue->scheduled = 0;
+			usbi_cond_broadcast(&dev_handle->deferred_cond);
+			usbi_mutex_unlock(&dev_handle->lock);
+			break;
+		}
+		itransfer = list_first_entry(&queue->transfers, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		usbi_mutex_unlock(&dev_handle->lock);
+
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		flags = transfer->flags;
+		if (transfer->callback)
+			transfer->callback(transfer);
+		/* transfer might have been freed by the above call */
+		if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+		ran = 1;
+	}
+}
+
+/* Queues the callback of a completed transfer for the executor. Returns 0
+ * on success, or a LIBUSB_ERROR code if the callback must run here. */
+static int defer_callback(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct usbi_deferred_queue *queue;
+	unsigned int index, i;
+	int schedule;
+
+	if (!dev_handle)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	index = (transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) |
+		((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) >> 3);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->deferred_closing &&
+	    (!dev_handle->deferred || !dev_handle->deferred[index].scheduled)) {
+		/* the handle is being closed, hand out no new tasks */
+		usbi_mutex_unlock(&dev_handle->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	if (!dev_handle->deferred) {
+		dev_handle->deferred = calloc(USBI_MAX_ENDPOINTS, sizeof(*dev_handle->deferred));
+		if (!dev_handle->deferred) {
+			usbi_mutex_unlock(&dev_handle->lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		for (i = 0; i < USBI_MAX_ENDPOINTS; i++) {
+			dev_handle->deferred[i].dev_handle = dev_handle;
+			list_init(&dev_handle->deferred[i].transfers);
+		}
+	}
+	queue = &dev_handle->deferred[index];
+	list_add_tail(&itransfer->completed_list, &queue->transfers);
+	schedule = !queue->scheduled;
+	queue->scheduled = 1;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (schedule)
+		ctx->executor(ctx, run_deferred_callbacks, queue, ctx->executor_user_data);
+
+	return 0;
+}
+
+/* Stops handing out tasks for the deferred callbacks of the handle and
+ * waits until none is with the executor. Callbacks of transfers that
+ * complete afterwards run in the event handling thread. */
+void usbi_wait_deferred_callbacks(struct libusb_device_handle *dev_handle)
+{
+	unsigned int i = 0;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	dev_handle->deferred_closing = 1;
+	while (dev_handle->deferred && i < USBI_MAX_ENDPOINTS) {
+		if (dev_handle->deferred[i].scheduled)
+			usbi_cond_wait(&dev_handle->deferred_cond, &dev_handle->lock);
+		else
+			i++;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
 /* Handle completion of a transfer (completion might be an error condition).
  * This will invoke the user-supplied callback function, which may end up
  * freeing the transfer. Therefore you cannot use the transfer structure
@@ -1687,14 +2374,10 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	uint8_t flags;
-	int r;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = remove_from_flying_list(itransfer);
+	remove_from_flying_list(itransfer);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (r < 0)
-		usbi_err(ctx, "failed to set timer for next timeout");
 
 	usbi_mutex_lock(&itransfer->lock);
 	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
@@ -1711,22 +2394,18 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
-	flags = transfer->flags;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
 	assert(transfer->actual_length >= 0);
 	usbi_dbg(ctx, "transfer %p has callback %p",
 		 (void *) transfer, transfer->callback);
-	if (transfer->callback) {
-		libusb_lock_event_waiters (ctx);
-		transfer->callback(transfer);
-		libusb_unlock_event_waiters(ctx);
-	}
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	return r;
+
+	if ((transfer->flags & LIBUSB_TRANSFER_DEFER_CALLBACK) && transfer->callback &&
+	    ctx->executor && defer_callback(ctx, itransfer) == 0)
+		return 0;
+
+	run_callback(ctx, transfer);
+	return 0;
 }
 
 /* Similar to usbi_handle_transfer_completion() but exclusively for transfers
@@ -1754,27 +2433,64 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
+/* Add a completed transfer to the completed_queue of the context and
+ * signal the event. The backend's handle_transfer_completion() function
+ * will be called the next time an event handler runs.
+ *
+ * Any thread may call this concurrently with the others and with the event
+ * handler. Only the completion that finds the queue empty signals the
+ * event, so a burst of completions costs a single wakeup. */
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 {
 	struct libusb_device *dev = itransfer->dev;
 
 	if (dev) {
 		struct libusb_context *ctx = DEVICE_CTX(dev);
-		unsigned int event_flags;
+		void *head = usbi_atomic_ptr_load(&ctx->completed_queue);
 
-		usbi_mutex_lock(&ctx->event_data_lock);
-		event_flags = ctx->event_flags;
-		ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
-		list_add_tail(&itransfer->completed_list, &ctx->completed_transfers);
-		if (!event_flags)
+		do {
+			itransfer->completed_next = head;
+		} while (!usbi_atomic_ptr_cas(&ctx->completed_queue, &head, itransfer));
+
+		if (!head)
 			usbi_signal_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
 	}
 }
 
+/* Move the transfers of completed_queue to the end of completed_transfers.
+ * Completions queued after this signal the event again. */
+static void take_completed_transfers(struct libusb_context *ctx)
+{
+	struct list_head *tail = ctx->completed_transfers.prev;
+	struct usbi_transfer *itransfer;
+
+	if (!usbi_atomic_ptr_load(&ctx->completed_queue))
+		return;
+
+	/* the queue holds the most recent completion first, so inserting each
+	 * transfer right after the old tail restores completion order */
+	itransfer = usbi_atomic_ptr_exchange(&ctx->completed_queue, NULL);
+	while (itransfer) {
+		list_add(&itransfer->completed_list, tail);
+		itransfer = itransfer->completed_next;
+	}
+}
+
+/* Clear the event of the context unless events are pending. Must be called
+ * with the event_data_lock and the event handling lock held. */
+void usbi_clear_event_if_idle(struct libusb_context *ctx)
+{
+	if (ctx->event_flags || !list_empty(&ctx->completed_transfers))
+		return;
+
+	usbi_clear_event(&ctx->event);
+
+	/* a completion queued since the last drain signalled the event that
+	 * was just cleared, and a later one will not signal it again */
+	if (usbi_atomic_ptr_load(&ctx->completed_queue))
+		usbi_signal_event(&ctx->event);
+}
+
 /** \ingroup libusb_poll
  * Attempt to acquire the event handling lock. This lock is used to ensure that
  * only one thread is monitoring libusb event sources at any one time.
@@ -1815,7 +2531,7 @@ int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 	if (!r)
 		return 1;
 
-	ctx->event_handler_active = 1;
+	(void)usbi_atomic_inc(&ctx->event_handler_active);
 	return 0;
 }
 
@@ -1841,7 +2557,7 @@ void API_EXPORTED libusb_lock_events(libusb_context *ctx)
 {
 	ctx = usbi_get_context(ctx);
 	usbi_mutex_lock(&ctx->events_lock);
-	ctx->event_handler_active = 1;
+	(void)usbi_atomic_inc(&ctx->event_handler_active);
 }
 
 /** \ingroup libusb_poll
@@ -1855,7 +2571,7 @@ void API_EXPORTED libusb_lock_events(libusb_context *ctx)
 void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 {
 	ctx = usbi_get_context(ctx);
-	ctx->event_handler_active = 0;
+	(void)usbi_atomic_dec(&ctx->event_handler_active);
 	usbi_mutex_unlock(&ctx->events_lock);
 
 	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
@@ -1932,7 +2648,7 @@ int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 		return 1;
 	}
 
-	return ctx->event_handler_active;
+	return usbi_atomic_load(&ctx->event_handler_active) != 0;
 }
 
 /** \ingroup libusb_poll
@@ -2053,6 +2769,8 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 	int r;
 
 	itransfer->timeout_flags |= USBI_TRANSFER_TIMEOUT_HANDLED;
+	if (itransfer->timeout_heap_index)
+		timeout_heap_remove(ITRANSFER_CTX(itransfer), itransfer);
 	r = libusb_cancel_transfer(transfer);
 	if (r == LIBUSB_SUCCESS)
 		itransfer->timeout_flags |= USBI_TRANSFER_TIMED_OUT;
@@ -2067,30 +2785,18 @@ static void handle_timeouts_locked(struct libusb_context *ctx)
 	struct timespec systime;
 	struct usbi_transfer *itransfer;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!ctx->timeout_heap_len)
 		return;
 
 	/* get current time */
 	usbi_get_monotonic_time(&systime);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
-
-		/* ignore timeouts we've already handled */
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if transfer has non-expired timeout, nothing more to do */
-		if (TIMESPEC_CMP(cur_ts, &systime, >))
+	/* handle transfers from the top of the timeout heap until we reach one
+	 * whose timeout has not expired yet */
+	while ((itransfer = next_timeout_transfer(ctx)) != NULL) {
+		if (TIMESPEC_CMP(&itransfer->timeout, &systime, >))
 			return;
 
-		/* otherwise, we've got an expired timeout to handle */
 		handle_timeout(itransfer);
 	}
 }
@@ -2144,14 +2850,21 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		list_cut(&hotplug_msgs, &ctx->hotplug_msgs);
 	}
 
+	/* if no further pending events, clear the event. completions are
+	 * taken from the queue only afterwards, as one that is queued in
+	 * between signals the event again. */
+	if (!ctx->event_flags && list_empty(&ctx->completed_transfers))
+		usbi_clear_event(&ctx->event);
+
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
 	/* complete any pending transfers */
-	if (ctx->event_flags & USBI_EVENT_TRANSFER_COMPLETED) {
+	take_completed_transfers(ctx);
+	if (!list_empty(&ctx->completed_transfers)) {
 		struct usbi_transfer *itransfer, *tmp;
 		struct list_head completed_transfers;
 
-		assert(!list_empty(&ctx->completed_transfers));
 		list_cut(&completed_transfers, &ctx->completed_transfers);
-		usbi_mutex_unlock(&ctx->event_data_lock);
 
 		__for_each_completed_transfer_safe(&completed_transfers, itransfer, tmp) {
 			list_del(&itransfer->completed_list);
@@ -2162,21 +2875,14 @@ static int handle_event_trigger(struct libusb_context *ctx)
 			}
 		}
 
-		usbi_mutex_lock(&ctx->event_data_lock);
 		if (!list_empty(&completed_transfers)) {
-			/* an error occurred, put the remaining transfers back on the list */
+			/* an error occurred, keep the remaining transfers for the
+			 * next run of the event handler */
 			list_splice_front(&completed_transfers, &ctx->completed_transfers);
-		} else if (list_empty(&ctx->completed_transfers)) {
-			ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
+			usbi_signal_event(&ctx->event);
 		}
 	}
 
-	/* if no further pending events, clear the event */
-	if (!ctx->event_flags)
-		usbi_clear_event(&ctx->event);
-
-	usbi_mutex_unlock(&ctx->event_data_lock);
-
 	/* process the hotplug events, if any */
 	if (hotplug_event)
 		usbi_hotplug_process(ctx, &hotplug_msgs);
@@ -2191,6 +2897,10 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
+	/* the timer stays signalled until it is rearmed or disarmed, so make
+	 * sure it is updated even if the next timeout matches the old one */
+	TIMESPEC_CLEAR(&ctx->timer_expiry);
+
 	/* process the timeout that just happened */
 	handle_timeouts_locked(ctx);
 
@@ -2203,11 +2913,99 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 }
 #endif
 
+static int64_t elapsed_ns_since(const struct timespec *start, struct timespec *now)
+{
+	struct timespec diff;
+
+	usbi_get_monotonic_time(now);
+	TIMESPEC_SUB(now, start, &diff);
+	return (int64_t)diff.tv_sec * NSEC_PER_SEC + diff.tv_nsec;
+}
+
+/* count a wait for device activity in the log2 histogram of wait times */
+static void record_wait(struct libusb_context *ctx, int64_t wait_ns)
+{
+	uint64_t us = (uint64_t)wait_ns / 1000;
+	unsigned int bucket = 0;
+
+	while (us && bucket < LIBUSB_EVENT_WAIT_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	(void)usbi_atomic_inc(&ctx->event_stats.wait_histogram[bucket]);
+}
+
+/* Spin reaping completions before waiting, see LIBUSB_OPTION_BUSY_POLL.
+ * Returns 1 if completions were handled, 0 if the event handler should
+ * wait, or a LIBUSB_ERROR code on failure. */
+static int busy_poll(struct libusb_context *ctx, int timeout_ms,
+	const struct timespec *start)
+{
+	struct usbi_busy_poll *bp = &ctx->busy_poll;
+	struct usbi_event_stats *stats = &ctx->event_stats;
+	unsigned int window_us = bp->window_us;
+	unsigned int cpu_limit = bp->cpu_limit ? bp->cpu_limit : 100;
+	unsigned int reaped = 0;
+	struct timespec now;
+	int64_t window_ns, spun_ns;
+	int r;
+
+	if (!window_us || !timeout_ms || !usbi_backend.busy_poll)
+		return 0;
+
+	/* spinning is accounted per second of wall clock time */
+	if (!TIMESPEC_IS_SET(&bp->period_start) ||
+	    elapsed_ns_since(&bp->period_start, &now) >= NSEC_PER_SEC) {
+		usbi_get_monotonic_time(&bp->period_start);
+		bp->period_spin_ns = 0;
+	}
+	if (bp->period_spin_ns >= (int64_t)cpu_limit * (NSEC_PER_SEC / 100))
+		return 0;
+
+	if (!bp->cur_window_us || bp->cur_window_us > window_us)
+		bp->cur_window_us = window_us;
+	window_ns = MIN((int64_t)bp->cur_window_us * 1000, (int64_t)timeout_ms * 1000000);
+
+	do {
+		r = usbi_backend.busy_poll(ctx, &reaped);
+		spun_ns = elapsed_ns_since(start, &now);
+		if (r || reaped)
+			break;
+
+		/* internal events are only seen by waiting */
+		if (usbi_atomic_load(&ctx->event.pending))
+			break;
+	} while (spun_ns < window_ns);
+
+	bp->period_spin_ns += spun_ns;
+	(void)usbi_atomic_inc(&stats->busy_polls);
+	usbi_mutex_lock(&ctx->event_data_lock);
+	stats->busy_poll_ns += (uint64_t)spun_ns;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (r)
+		return r;
+
+	if (reaped) {
+		(void)usbi_atomic_inc(&stats->busy_poll_hits);
+		record_wait(ctx, spun_ns);
+		bp->cur_window_us = window_us;
+		return 1;
+	}
+
+	/* shrink the window while spinning finds nothing, down to a sixteenth
+	 * of the configured window */
+	bp->cur_window_us = MAX(bp->cur_window_us / 2, MAX(window_us / 16, 1U));
+	return 0;
+}
+
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
 static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 {
 	struct usbi_reported_events reported_events;
+	struct timespec wait_start, wait_end;
 	int r, timeout_ms;
 
 	/* prevent attempts to recursively handle events (e.g. calling into
@@ -2222,22 +3020,22 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
 		usbi_dbg(ctx, "event sources modified, reallocating event data");
 
-		/* free anything removed since we last ran */
-		cleanup_removed_event_sources(ctx);
-
 		r = usbi_alloc_event_data(ctx);
 		if (r) {
 			usbi_mutex_unlock(&ctx->event_data_lock);
 			return r;
 		}
 
+		/* free anything removed since we last ran, now that the event data
+		 * no longer refers to it */
+		cleanup_removed_event_sources(ctx);
+
 		/* reset the flag now that we have the updated list */
 		ctx->event_flags &= ~USBI_EVENT_EVENT_SOURCES_MODIFIED;
 
 		/* if no further pending events, clear the event so that we do
 		 * not immediately return from the wait function */
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
+		usbi_clear_event_if_idle(ctx);
 	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
@@ -2251,6 +3049,22 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 	usbi_start_event_handling(ctx);
 
+	usbi_get_monotonic_time(&wait_start);
+
+	r = busy_poll(ctx, timeout_ms, &wait_start);
+	if (r) {
+		if (r > 0)
+			r = LIBUSB_SUCCESS;
+		goto done;
+	}
+
+	/* the time spent spinning counts against the timeout */
+	if (ctx->busy_poll.window_us && timeout_ms > 0) {
+		int64_t spun_ms = elapsed_ns_since(&wait_start, &wait_end) / 1000000;
+
+		timeout_ms = (int)MAX(timeout_ms - spun_ms, (int64_t)0);
+	}
+
 	r = usbi_wait_for_events(ctx, &reported_events, timeout_ms);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_TIMEOUT) {
@@ -2281,6 +3095,8 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (!reported_events.num_ready)
 		goto done;
 
+	record_wait(ctx, elapsed_ns_since(&wait_start, &wait_end));
+	(void)usbi_atomic_inc(&ctx->event_stats.wakeups);
 	r = usbi_backend.handle_events(ctx, reported_events.event_data,
 		reported_events.event_data_count, reported_events.num_ready);
 	if (r)
@@ -2589,17 +3405,9 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 
 	/* find next transfer which hasn't already been processed as timed out */
-	for_each_transfer(ctx, itransfer) {
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if we've reached transfers of infinite timeout, we're done looking */
-		if (!TIMESPEC_IS_SET(&itransfer->timeout))
-			break;
-
+	itransfer = next_timeout_transfer(ctx);
+	if (itransfer)
 		next_timeout = itransfer->timeout;
-		break;
-	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 	if (!TIMESPEC_IS_SET(&next_timeout)) {
@@ -2621,6 +3429,77 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	return 1;
 }
 
+/* Called by the backend once per wakeup with the number of completions it
+ * reaped and the number of devices that exhausted their reap budget. Called
+ * from the event handling thread and from the completion threads of device
+ * handles, so every update is atomic. */
+void usbi_record_reaps(struct libusb_context *ctx, unsigned int reaps,
+	unsigned int budget_exhausted)
+{
+	struct usbi_event_stats *stats = &ctx->event_stats;
+	long max_reaps;
+
+	if (!reaps && !budget_exhausted)
+		return;
+
+	(void)usbi_atomic_add(&stats->reaps, (long)reaps);
+	if (budget_exhausted)
+		(void)usbi_atomic_add(&stats->budget_exhausted, (long)budget_exhausted);
+
+	max_reaps = usbi_atomic_load(&stats->max_reaps);
+	while ((long)reaps > max_reaps) {
+		if (usbi_atomic_cas(&stats->max_reaps, &max_reaps, (long)reaps))
+			break;
+	}
+}
+
+/** \ingroup libusb_poll
+ * Retrieve event handling statistics of a context. The statistics help to
+ * tune \ref LIBUSB_OPTION_REAP_BUDGET: the average number of completions
+ * handled per wakeup is reaps divided by wakeups, and a growing
+ * budget_exhausted count indicates that the budget is too small for the
+ * completion rate of a device. A high ratio of signals_suppressed to
+ * signals_issued shows that internal events arrive in bursts that cost a
+ * single wakeup each. The busy polling counters and the histogram of wait
+ * times help to size \ref LIBUSB_OPTION_BUSY_POLL.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param ctx the context to query, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stats is NULL or there is no context
+ */
+int API_EXPORTED libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats)
+{
+	struct usbi_event_stats *event_stats;
+	int i;
+
+	ctx = usbi_get_context(ctx);
+	if (!ctx || !stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	event_stats = &ctx->event_stats;
+	stats->wakeups = (uint64_t)usbi_atomic_load(&event_stats->wakeups);
+	stats->reaps = (uint64_t)usbi_atomic_load(&event_stats->reaps);
+	stats->budget_exhausted = (uint64_t)usbi_atomic_load(&event_stats->budget_exhausted);
+	stats->max_reaps_per_wakeup = (uint32_t)usbi_atomic_load(&event_stats->max_reaps);
+	stats->reap_budget = usbi_get_reap_budget(ctx);
+	stats->signals_issued = (uint64_t)usbi_atomic_load(&ctx->event.signals_issued);
+	stats->signals_suppressed = (uint64_t)usbi_atomic_load(&ctx->event.signals_suppressed);
+	stats->busy_polls = (uint64_t)usbi_atomic_load(&event_stats->busy_polls);
+	stats->busy_poll_hits = (uint64_t)usbi_atomic_load(&event_stats->busy_poll_hits);
+	usbi_mutex_lock(&ctx->event_data_lock);
+	stats->busy_poll_ns = event_stats->busy_poll_ns;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	for (i = 0; i < LIBUSB_EVENT_WAIT_BUCKETS; i++)
+		stats->wait_histogram[i] = (uint64_t)usbi_atomic_load(&event_stats->wait_histogram[i]);
+	stats->timer_updates = (uint64_t)usbi_atomic_load(&event_stats->timer_updates);
+
+	return LIBUSB_SUCCESS;
+}
+
 /** \ingroup libusb_poll
  * Register notification functions for file descriptor additions/removals.
  * These functions will be invoked for every new or removed file descriptor
@@ -2660,6 +3539,53 @@ void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
 #endif
 }
 
+/** \ingroup libusb_asyncio
+ * Set the executor that runs the callbacks of transfers flagged with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_DEFER_CALLBACK
+ * "LIBUSB_TRANSFER_DEFER_CALLBACK".
+ *
+ * When such a transfer completes, the event handling thread only queues
+ * its callback and goes on reaping. The queued callbacks of an endpoint are
+ * run by a task that libusb hands to the executor, which may run it on any
+ * thread. A task runs the callbacks of its endpoint in completion order,
+ * and libusb never hands out a second task for an endpoint while the first
+ * is still with the executor, so callbacks of one endpoint never overlap
+ * while those of different endpoints may run in parallel.
+ *
+ * libusb_close() waits until the deferred callbacks of the handle have
+ * run, so they must not close the device handle of their transfer, and the
+ * executor must not need the thread that closes the handle to run them.
+ * Callbacks of transfers that complete while the handle is being closed
+ * run in the event handling thread. Deferred callbacks may do synchronous
+ * I/O, except while their handle is closed from event handling context,
+ * for example from another transfer callback, as libusb_close() then waits
+ * for them with the event handling lock held.
+ * Threads waiting in libusb_handle_events_completed() are woken after each
+ * task.
+ *
+ * The executor must not be changed while deferred transfers are in flight.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param executor the executor, or NULL to run all callbacks in the event
+ * handling thread
+ * \param user_data user data passed to the executor
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if there is no context
+ */
+int API_EXPORTED libusb_set_executor(libusb_context *ctx,
+	libusb_executor_fn executor, void *user_data)
+{
+	ctx = usbi_get_context(ctx);
+	if (!ctx)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx->executor_user_data = user_data;
+	ctx->executor = executor;
+	return LIBUSB_SUCCESS;
+}
+
 /*
  * Interrupt the iteration of the event handling thread, so that it picks
  * up the event source change. Callers of this function must hold the event_data_lock.
@@ -2678,10 +3604,12 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 
 /* Add an event source to the list of event sources to be monitored.
  * poll_events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle, short poll_events)
+ * POLLIN and/or POLLOUT. user_data is an opaque pointer for the backend, it is
+ * handed back with ready events where the OS event abstraction supports it. */
+int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle, short poll_events,
+	void *user_data)
 {
-	struct usbi_event_source *ievent_source = malloc(sizeof(*ievent_source));
+	struct usbi_event_source *ievent_source = calloc(1, sizeof(*ievent_source));
 
 	if (!ievent_source)
 		return LIBUSB_ERROR_NO_MEM;
@@ -2689,6 +3617,7 @@ int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle
 	usbi_dbg(ctx, "add " USBI_OS_HANDLE_FORMAT_STRING " events %d", os_handle, poll_events);
 	ievent_source->data.os_handle = os_handle;
 	ievent_source->data.poll_events = poll_events;
+	ievent_source->user_data = user_data;
 	usbi_mutex_lock(&ctx->event_data_lock);
 	list_add_tail(&ievent_source->list, &ctx->event_sources);
 	usbi_event_source_notification(ctx);
@@ -2723,6 +3652,9 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 		return;
 	}
 
+	/* the event source itself is freed by the next event handler, as a
+	 * concurrent one may still refer to it */
+	usbi_remove_event_data(ctx, ievent_source);
 	list_del(&ievent_source->list);
 	list_add_tail(&ievent_source->list, &ctx->removed_event_sources);
 	usbi_event_source_notification(ctx);
@@ -2865,3 +3797,384 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 		usbi_handle_transfer_completion(to_cancel, LIBUSB_TRANSFER_NO_DEVICE);
 	}
 }
+
+/* Streams
+ *
+ * A stream owns num_buffers + 1 transfers. All but one are queued at any
+ * time; the remaining one is the spare. When a transfer completes, the
+ * spare is submitted in its place before the user callback runs, so the
+ * endpoint never goes without queued transfers while the callback
+ * processes the data. The completed transfer then becomes the new spare.
+ * Transfer callbacks may run in a completion thread or through an executor
+ * as well as in the event handling thread, so the spare is guarded by the
+ * stream lock. The lock is never held while a transfer is submitted. */
+
+struct libusb_stream {
+	struct libusb_device_handle *dev_handle;
+	libusb_stream_cb_fn callback;
+	void *user_data;
+
+	usbi_mutex_t lock;
+	struct libusb_transfer *spare;
+	usbi_atomic_t active;
+
+	/* Set by libusb_stream_close(), read from transfer callbacks */
+	usbi_atomic_t stopping;
+
+	/* Set when libusb_stream_open() failed with transfers queued. Their
+	 * callbacks are not passed on, and the last of them frees the stream */
+	usbi_atomic_t orphaned;
+
+	/* Set once no transfer is queued any more */
+	int done;
+
+	usbi_atomic_t transfers;
+	usbi_atomic_t overflows;
+	usbi_atomic_t errors;
+	usbi_atomic_t submit_errors;
+
+	int num_transfers;
+	struct libusb_transfer *transfer[LIBUSB_FLEXIBLE_ARRAY];
+};
+
+static void stream_count_status(struct libusb_stream *stream,
+	struct libusb_transfer *transfer)
+{
+	int i;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		/* isochronous transfers report errors per packet */
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			enum libusb_transfer_status status = transfer->iso_packet_desc[i].status;
+
+			if (status == LIBUSB_TRANSFER_OVERFLOW)
+				(void)usbi_atomic_inc(&stream->overflows);
+			else if (status != LIBUSB_TRANSFER_COMPLETED)
+				(void)usbi_atomic_inc(&stream->errors);
+		}
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		(void)usbi_atomic_inc(&stream->overflows);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	default:
+		(void)usbi_atomic_inc(&stream->errors);
+	}
+}
+
+static void stream_free(struct libusb_stream *stream);
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_stream *stream = transfer->user_data;
+	struct libusb_transfer *next;
+	int stopping = usbi_atomic_load(&stream->stopping);
+	int resubmit, ended = 0;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_OVERFLOW:
+	case LIBUSB_TRANSFER_ERROR:
+		resubmit = !stopping;
+		break;
+	default:
+		/* stalls, disconnection and cancellation end the stream */
+		resubmit = 0;
+	}
+
+	usbi_mutex_lock(&stream->lock);
+	next = resubmit ? stream->spare : NULL;
+	stream->spare = NULL;
+	usbi_mutex_unlock(&stream->lock);
+
+	if (next) {
+		int r = libusb_submit_transfer(next);
+
+		if (r < 0) {
+			usbi_warn(HANDLE_CTX(stream->dev_handle),
+				"failed to resubmit stream transfer: %s",
+				libusb_error_name(r));
+			(void)usbi_atomic_inc(&stream->submit_errors);
+			usbi_mutex_lock(&stream->lock);
+			stream->spare = next;
+			usbi_mutex_unlock(&stream->lock);
+			ended = 1;
+		} else if (usbi_atomic_load(&stream->stopping)) {
+			/* libusb_stream_close() may have missed this transfer */
+			libusb_cancel_transfer(next);
+		}
+	} else {
+		ended = 1;
+	}
+
+	stream_count_status(stream, transfer);
+	if (!usbi_atomic_load(&stream->orphaned) &&
+	    (transfer->status != LIBUSB_TRANSFER_CANCELLED || !stopping)) {
+		(void)usbi_atomic_inc(&stream->transfers);
+		stream->callback(stream, transfer, stream->user_data);
+	}
+
+	usbi_mutex_lock(&stream->lock);
+	if (!stream->spare)
+		stream->spare = transfer;
+	usbi_mutex_unlock(&stream->lock);
+
+	/* the stream may be freed once the last transfer has ended, so this
+	 * is the last use of it */
+	if (ended && usbi_atomic_dec(&stream->active) == 0) {
+		if (usbi_atomic_load(&stream->orphaned))
+			stream_free(stream);
+		else
+			stream->done = 1;
+	}
+}
+
+static void stream_free(struct libusb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		struct libusb_transfer *transfer = stream->transfer[i];
+
+		if (!transfer)
+			continue;
+		libusb_free_transfer_buffer(stream->dev_handle, transfer->buffer);
+		libusb_free_transfer(transfer);
+	}
+	usbi_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/** \ingroup libusb_asyncio
+ * Open a continuous stream of transfers on an endpoint.
+ *
+ * libusb allocates num_buffers transfers of buffer_size bytes each, plus one
+ * spare, and keeps num_buffers of them queued on the endpoint until the
+ * stream is closed. Whenever a transfer completes, the spare is submitted
+ * in its place before the callback is invoked with the completed transfer,
+ * so there is no gap in the queue while the application processes data and
+ * no need for it to resubmit transfers itself. Buffers come from
+ * libusb_alloc_transfer_buffer().
+ *
+ * For OUT endpoints, the buffers are zeroed when the stream is opened, so
+ * the transfers queued initially send zeros. The callback may fill the
+ * buffer of the transfer it is passed with new data; it is sent the next
+ * time the transfer is submitted.
+ *
+ * For isochronous endpoints, each transfer carries as many packets of the
+ * maximum isochronous packet size of the endpoint as fit in buffer_size.
+ *
+ * The callback is invoked for every completed transfer, including those
+ * that failed. Transfers completing with
+ * \ref LIBUSB_TRANSFER_STALL "LIBUSB_TRANSFER_STALL",
+ * \ref LIBUSB_TRANSFER_NO_DEVICE "LIBUSB_TRANSFER_NO_DEVICE" or
+ * \ref LIBUSB_TRANSFER_CANCELLED "LIBUSB_TRANSFER_CANCELLED" are not
+ * replaced, so the stream winds down on those errors. Transfers cancelled
+ * by libusb_stream_close() are not passed to the callback.
+ *
+ * If only some of the transfers could be submitted, those that were are
+ * cancelled and the stream is freed once they have completed, without
+ * passing them to the callback.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint address of the endpoint to stream on
+ * \param type the \ref libusb_transfer_type of the endpoint: bulk,
+ * interrupt or isochronous
+ * \param num_buffers number of transfers to keep queued
+ * \param buffer_size size of each transfer buffer in bytes
+ * \param callback function invoked for each completed transfer
+ * \param user_data user data to pass to the callback
+ * \param stream output location for the new stream. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if an argument is invalid
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if the transfers could not be
+ * submitted
+ */
+int API_EXPORTED libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int num_buffers,
+	int buffer_size, libusb_stream_cb_fn callback, void *user_data,
+	libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	int iso_packets = 0, packet_size = 0;
+	int i, r, submitted;
+	int *results;
+
+	if (!dev_handle || !callback || !stream || num_buffers <= 0 ||
+	    buffer_size <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		packet_size = libusb_get_max_iso_packet_size(dev_handle->dev, endpoint);
+		if (packet_size < 0)
+			return packet_size;
+		if (packet_size == 0 || buffer_size < packet_size)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		iso_packets = buffer_size / packet_size;
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	_stream = calloc(1, sizeof(*_stream) +
+		(size_t)(num_buffers + 1) * sizeof(_stream->transfer[0]));
+	results = calloc((size_t)num_buffers, sizeof(*results));
+	if (!_stream || !results) {
+		free(_stream);
+		free(results);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	usbi_mutex_init(&_stream->lock);
+	_stream->dev_handle = dev_handle;
+	_stream->callback = callback;
+	_stream->user_data = user_data;
+	_stream->num_transfers = num_buffers + 1;
+
+	for (i = 0; i < _stream->num_transfers; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(iso_packets);
+		unsigned char *buffer;
+
+		if (!transfer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err;
+		}
+		_stream->transfer[i] = transfer;
+
+		buffer = libusb_alloc_transfer_buffer(dev_handle, (size_t)buffer_size);
+		if (!buffer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto err;
+		}
+		/* never send whatever the allocation happened to contain */
+		if (!(endpoint & LIBUSB_ENDPOINT_IN))
+			memset(buffer, 0, (size_t)buffer_size);
+
+		libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+			buffer_size, stream_transfer_cb, _stream, 0);
+		transfer->type = type;
+		if (iso_packets) {
+			transfer->num_iso_packets = iso_packets;
+			transfer->length = iso_packets * packet_size;
+			libusb_set_iso_packet_lengths(transfer, (unsigned int)packet_size);
+		}
+	}
+
+	_stream->spare = _stream->transfer[num_buffers];
+	usbi_atomic_store(&_stream->active, num_buffers);
+
+	submitted = libusb_submit_transfers(_stream->transfer, num_buffers, results);
+	if (submitted < num_buffers) {
+		r = submitted < 0 ? submitted : LIBUSB_ERROR_OTHER;
+		if (submitted <= 0)
+			goto err;
+
+		/* This may be event handling context, where the queued transfers
+		 * cannot be waited for. Cancel them and leave freeing the stream
+		 * to the last of them, or to this function if they have all
+		 * ended already. */
+		usbi_atomic_store(&_stream->orphaned, 1);
+		usbi_atomic_store(&_stream->stopping, 1);
+		for (i = 0; i < _stream->num_transfers; i++)
+			libusb_cancel_transfer(_stream->transfer[i]);
+
+		for (i = 0; i < num_buffers; i++) {
+			if (results[i] >= 0)
+				continue;
+			if (r == LIBUSB_ERROR_OTHER)
+				r = results[i];
+			if (usbi_atomic_dec(&_stream->active) == 0)
+				stream_free(_stream);
+		}
+		free(results);
+		return r;
+	}
+
+	free(results);
+	*stream = _stream;
+	return 0;
+
+err:
+	free(results);
+	stream_free(_stream);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Close a stream opened with libusb_stream_open(). All queued transfers
+ * are cancelled, and this function handles events until they have
+ * completed before freeing the stream and its buffers.
+ *
+ * This function must not be called from a stream callback or any other
+ * event handling context. The stream must be closed before its device
+ * handle.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param stream the stream to close. If NULL, no action is taken.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if called from event handling context
+ */
+int API_EXPORTED libusb_stream_close(libusb_stream *stream)
+{
+	struct libusb_context *ctx;
+	int i, r;
+
+	if (!stream)
+		return 0;
+
+	ctx = HANDLE_CTX(stream->dev_handle);
+	if (usbi_handling_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	usbi_atomic_store(&stream->stopping, 1);
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_cancel_transfer(stream->transfer[i]);
+
+	/* the transfers must not be freed while any is queued */
+	while (!stream->done) {
+		r = libusb_handle_events_completed(ctx, &stream->done);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				libusb_error_name(r));
+	}
+
+	stream_free(stream);
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Retrieve statistics of a stream. This may be called while the stream is
+ * running, including from its callback.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param stream a stream opened with libusb_stream_open()
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if an argument is NULL
+ */
+int API_EXPORTED libusb_stream_get_stats(libusb_stream *stream,
+	struct libusb_stream_stats *stats)
+{
+	if (!stream || !stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	stats->transfers = (uint64_t)usbi_atomic_load(&stream->transfers);
+	stats->overflows = (uint64_t)usbi_atomic_load(&stream->overflows);
+	stats->errors = (uint64_t)usbi_atomic_load(&stream->errors);
+	stats->submit_errors = (uint64_t)usbi_atomic_load(&stream->submit_errors);
+	stats->active = (uint32_t)usbi_atomic_load(&stream->active);
+	return 0;
+}
@@ -1079,6 +1079,39 @@ struct libusb_ssplus_usb_device_capability_descriptor {
 	struct libusb_ssplus_sublink_attribute sublinkSpeedAttributes[];
 };
 
+/** \ingroup libusb_desc
+ * Cursor over the raw descriptors of a configuration, as returned by
+ * libusb_get_raw_config_descriptor(). Initialize it with
+ * libusb_descriptor_iterator_init() and advance it with
+ * libusb_descriptor_iterator_next(). Iterating does not allocate or copy.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ */
+struct libusb_descriptor_iterator {
+	/** The descriptor bytes being iterated */
+	const unsigned char *data;
+
+	/** Length of data in bytes */
+	int length;
+
+	/** Offset of the next descriptor in data */
+	int offset;
+
+	/** Index of the current interface in
+	 * \ref libusb_config_descriptor::interface "interface", or -1 before the
+	 * first interface descriptor */
+	int interface_index;
+
+	/** Index of the current alternate setting in
+	 * \ref libusb_interface::altsetting "altsetting", or -1 before the first
+	 * interface descriptor */
+	int altsetting_index;
+
+	/** bInterfaceNumber of the current interface, or -1 before the first
+	 * interface descriptor */
+	int interface_number;
+};
+
 /** \ingroup libusb_desc
  * A structure representing the Container ID descriptor.
  * This descriptor is documented in section 9.6.2.3 of the USB 3.0 specification.
@@ -1174,6 +1207,7 @@ struct libusb_control_setup {
 struct libusb_context;
 struct libusb_device;
 struct libusb_device_handle;
+struct libusb_sync_session;
 
 /** \ingroup libusb_lib
  * Structure providing the version of the libusb runtime
@@ -1246,6 +1280,17 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup libusb_syncio
+ * Structure representing a reusable context for synchronous I/O on one
+ * device handle. This is an opaque type for which you are only ever provided
+ * with a pointer, originating from libusb_sync_session_open().
+ *
+ * A session keeps its transfer and control buffer between calls, so
+ * repeated synchronous transfers do not allocate memory. When finished with
+ * a session, you should call libusb_sync_session_close().
+ */
+typedef struct libusb_sync_session libusb_sync_session;
+
 /** \ingroup libusb_dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1420,7 +1465,15 @@ enum libusb_transfer_flags {
 	 *
 	 * Available since libusb-1.0.9.
 	 */
-	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3)
+	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3),
+
+	/** Run the transfer callback on the executor of the context instead of
+	 * in the event handling thread, see libusb_set_executor(). Without an
+	 * executor this flag has no effect.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_TRANSFER_DEFER_CALLBACK = (1U << 4)
 };
 
 /** \ingroup libusb_asyncio
@@ -1449,6 +1502,32 @@ struct libusb_transfer;
  */
 typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
 
+/** \ingroup libusb_asyncio
+ * Function that runs a task handed to an executor. The executor calls it
+ * exactly once with the task it was given.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param task the task passed to the executor
+ */
+typedef void (LIBUSB_CALL *libusb_task_fn)(void *task);
+
+/** \ingroup libusb_asyncio
+ * Executor function type, see libusb_set_executor(). libusb calls it from
+ * the event handling thread with a task that runs deferred transfer
+ * callbacks. The executor must arrange for run(task) to be called, on any
+ * thread, and should return without waiting for it.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param ctx the context the task belongs to
+ * \param run function to call with the task
+ * \param task the task
+ * \param user_data user data passed to libusb_set_executor()
+ */
+typedef void (LIBUSB_CALL *libusb_executor_fn)(libusb_context *ctx,
+	libusb_task_fn run, void *task, void *user_data);
+
 /** \ingroup libusb_asyncio
  * The generic USB transfer structure. The user populates this structure and
  * then submits it in order to request a transfer. After the transfer has
@@ -1516,6 +1595,133 @@ struct libusb_transfer {
 	struct libusb_iso_packet_descriptor iso_packet_desc[LIBUSB_FLEXIBLE_ARRAY];
 };
 
+/** \ingroup libusb_asyncio
+ * Statistics of the per-context transfer pool, as returned by
+ * libusb_get_transfer_pool_stats().
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ */
+struct libusb_transfer_pool_stats {
+	/** Number of allocations served from the pool */
+	uint64_t hits;
+
+	/** Number of pooled allocations that fell back to the system allocator */
+	uint64_t misses;
+
+	/** Number of pooled transfers released to the system allocator because
+	 * the pool was full */
+	uint64_t overflows;
+
+	/** Number of transfers currently retained by the pool */
+	uint32_t retained;
+
+	/** Maximum number of transfers the pool may retain, 0 if disabled */
+	uint32_t limit;
+};
+
+/** \ingroup libusb_poll
+ * Number of buckets of libusb_event_stats::wait_histogram
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ */
+#define LIBUSB_EVENT_WAIT_BUCKETS	16
+
+/** \ingroup libusb_poll
+ * Event handling statistics of a context, as returned by
+ * libusb_get_event_stats().
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ */
+struct libusb_event_stats {
+	/** Number of times event handling woke up with device activity */
+	uint64_t wakeups;
+
+	/** Number of completed requests reaped from devices */
+	uint64_t reaps;
+
+	/** Number of times a device still had requests in flight after
+	 * \ref LIBUSB_OPTION_REAP_BUDGET requests were reaped */
+	uint64_t budget_exhausted;
+
+	/** Largest number of requests reaped in a single wakeup */
+	uint32_t max_reaps_per_wakeup;
+
+	/** Current per-device reap budget */
+	uint32_t reap_budget;
+
+	/** Number of internal wakeups of the event handler that were signalled,
+	 * by completions, hotplug messages or libusb_interrupt_event_handler() */
+	uint64_t signals_issued;
+
+	/** Number of internal wakeups that were skipped because the event
+	 * handler had already been signalled and had not run yet */
+	uint64_t signals_suppressed;
+
+	/** Number of times the event handler spun before waiting, see
+	 * \ref LIBUSB_OPTION_BUSY_POLL */
+	uint64_t busy_polls;
+
+	/** Number of spins that found completions */
+	uint64_t busy_poll_hits;
+
+	/** Total time spent spinning, in nanoseconds */
+	uint64_t busy_poll_ns;
+
+	/** Time the event handler waited for device activity, spinning or
+	 * blocking, as a log2 histogram. Bucket 0 counts waits under 1
+	 * microsecond, bucket n waits from 2^(n-1) up to 2^n microseconds, and
+	 * the last bucket all longer waits. */
+	uint64_t wait_histogram[LIBUSB_EVENT_WAIT_BUCKETS];
+
+	/** Number of times the timer used for transfer timeouts was armed or
+	 * disarmed. Always 0 on platforms without such a timer. */
+	uint64_t timer_updates;
+};
+
+/** \ingroup libusb_asyncio
+ * Structure representing a continuous stream of transfers on one endpoint.
+ * This is an opaque type for which you are only ever provided with a
+ * pointer, originating from libusb_stream_open().
+ */
+typedef struct libusb_stream libusb_stream;
+
+/** \ingroup libusb_asyncio
+ * Stream callback function type, see libusb_stream_open().
+ *
+ * The transfer is only valid for the duration of the callback. It must not
+ * be resubmitted, freed or modified by the callback.
+ * \param stream the stream the transfer belongs to
+ * \param transfer the completed transfer. Its status, actual length and
+ * isochronous packet descriptors describe the data received or sent.
+ * \param user_data the user data passed to libusb_stream_open()
+ */
+typedef void (LIBUSB_CALL *libusb_stream_cb_fn)(libusb_stream *stream,
+	struct libusb_transfer *transfer, void *user_data);
+
+/** \ingroup libusb_asyncio
+ * Statistics of a stream, as returned by libusb_stream_get_stats().
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ */
+struct libusb_stream_stats {
+	/** Number of transfers delivered to the callback */
+	uint64_t transfers;
+
+	/** Number of transfers, or isochronous packets, that completed with
+	 * \ref LIBUSB_TRANSFER_OVERFLOW "LIBUSB_TRANSFER_OVERFLOW" */
+	uint64_t overflows;
+
+	/** Number of transfers that completed with any other error */
+	uint64_t errors;
+
+	/** Number of times a transfer could not be resubmitted. Each failure
+	 * leaves one transfer fewer queued. */
+	uint64_t submit_errors;
+
+	/** Number of transfers currently queued */
+	uint32_t active;
+};
+
 /** \ingroup libusb_misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1644,7 +1850,98 @@ enum libusb_option {
 	 */
 	LIBUSB_OPTION_LOG_CB = 3,
 
-	LIBUSB_OPTION_MAX = 4
+	/** Enable the per-context transfer pool.
+	 *
+	 * This option must be provided an argument of type int giving the
+	 * maximum number of transfers the pool may retain. Transfers allocated
+	 * with libusb_alloc_pooled_transfer() are returned to the pool by
+	 * libusb_free_transfer() instead of being released to the system
+	 * allocator, as long as fewer than this number are already retained.
+	 * Subsequent allocations with a compatible number of isochronous packet
+	 * descriptors are then served from the pool.
+	 *
+	 * A value of 0 (the default) disables the pool and releases any
+	 * transfers it currently retains.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_OPTION_TRANSFER_POOL = 4,
+
+	/** Set the maximum number of completed requests reaped per device each
+	 * time event handling wakes up.
+	 *
+	 * This option must be provided an argument of type int. Completions
+	 * that exceed the budget are left pending until the next iteration of
+	 * event handling, so that one busy device cannot starve the others.
+	 * Raise it for devices with high completion rates. A value of 0
+	 * restores the default of 25.
+	 *
+	 * Only used on platforms that reap completions from the event sources
+	 * directly (Linux). Use libusb_get_event_stats() to tune it.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_OPTION_REAP_BUDGET = 5,
+
+	/** Set the minimum size of buffers allocated from device memory by
+	 * libusb_alloc_transfer_buffer().
+	 *
+	 * This option must be provided an argument of type int giving the
+	 * size in bytes. Smaller buffers are allocated from the heap, where
+	 * the copy made by the kernel is cheaper than tying up device memory.
+	 * A value of 0 disables the use of device memory. The default is 64
+	 * KiB.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_OPTION_DEV_MEM_THRESHOLD = 6,
+
+	/** Spin before blocking in event handling.
+	 *
+	 * This option must be provided an argument of type int giving a time
+	 * in microseconds. Before waiting for events, the event handler keeps
+	 * reaping the devices of the context for up to this long, which saves
+	 * the wakeup latency of a blocking wait at the cost of CPU time. The
+	 * window shrinks while spinning finds nothing and is restored as soon
+	 * as it does. A value of 0, the default, disables spinning.
+	 *
+	 * Spinning is only supported on Linux and is ignored elsewhere. See
+	 * libusb_get_event_stats() for its statistics.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_OPTION_BUSY_POLL = 7,
+
+	/** Limit the CPU time spent spinning by \ref LIBUSB_OPTION_BUSY_POLL.
+	 *
+	 * This option must be provided an argument of type int giving the
+	 * percentage of wall clock time, from 1 to 100, that the event handler
+	 * may spend spinning. Once the limit is reached, the event handler
+	 * blocks until the end of the current second. A value of 0 restores the
+	 * default of 100.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_OPTION_BUSY_POLL_CPU_LIMIT = 8,
+
+	/** Let transfer timeouts expire late to save timer updates.
+	 *
+	 * This option must be provided an argument of type int giving a time
+	 * in milliseconds, typically 1 to 10. Transfers whose timeouts fall
+	 * within this window share one timer expiry, and the timer is only
+	 * rearmed for a new transfer if its timeout is earlier than the current
+	 * expiry by more than the slack. A transfer may therefore time out up
+	 * to this much later than requested. A value of 0, the default, makes
+	 * transfers time out as close to their deadline as possible.
+	 *
+	 * The slack only applies on platforms where libusb uses a timer for
+	 * transfer timeouts, such as Linux, and is ignored elsewhere.
+	 *
+	 * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+	 */
+	LIBUSB_OPTION_TIMER_SLACK = 9,
+
+	LIBUSB_OPTION_MAX = 10
 };
 
 /** \ingroup libusb_desc
@@ -1731,6 +2028,18 @@ int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config);
 void LIBUSB_CALL libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config);
+int LIBUSB_CALL libusb_get_raw_active_config_descriptor(libusb_device *dev,
+	const unsigned char **data);
+int LIBUSB_CALL libusb_get_raw_config_descriptor(libusb_device *dev,
+	uint8_t config_index, const unsigned char **data);
+void LIBUSB_CALL libusb_descriptor_iterator_init(
+	struct libusb_descriptor_iterator *iter, const unsigned char *data,
+	int length);
+int LIBUSB_CALL libusb_descriptor_iterator_next(
+	struct libusb_descriptor_iterator *iter, const unsigned char **desc);
+int LIBUSB_CALL libusb_descriptor_iterator_find(
+	struct libusb_descriptor_iterator *iter, uint8_t descriptor_type,
+	const unsigned char **desc);
 int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
 	libusb_context *ctx,
 	const struct libusb_endpoint_descriptor *endpoint,
@@ -1794,6 +2103,9 @@ int LIBUSB_CALL libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, li
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
 libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_start_completion_thread(libusb_device_handle *dev_handle,
+	int cpu);
+int LIBUSB_CALL libusb_stop_completion_thread(libusb_device_handle *dev_handle);
 
 int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev_handle,
 	int configuration);
@@ -1820,6 +2132,10 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 	size_t length);
 int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length);
+unsigned char * LIBUSB_CALL libusb_alloc_transfer_buffer(
+	libusb_device_handle *dev_handle, size_t length);
+int LIBUSB_CALL libusb_free_transfer_buffer(libusb_device_handle *dev_handle,
+	unsigned char *buffer);
 
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	int interface_number);
@@ -1912,7 +2228,20 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 }
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_pooled_transfer(
+	libusb_context *ctx, int iso_packets);
+int LIBUSB_CALL libusb_get_transfer_pool_stats(libusb_context *ctx,
+	struct libusb_transfer_pool_stats *stats);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results);
+int LIBUSB_CALL libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int num_buffers,
+	int buffer_size, libusb_stream_cb_fn callback, void *user_data,
+	libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_close(libusb_stream *stream);
+int LIBUSB_CALL libusb_stream_get_stats(libusb_stream *stream,
+	struct libusb_stream_stats *stats);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
@@ -2187,6 +2516,19 @@ int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *transferred, unsigned int timeout);
 
+int LIBUSB_CALL libusb_sync_session_open(libusb_device_handle *dev_handle,
+	libusb_sync_session **session);
+void LIBUSB_CALL libusb_sync_session_close(libusb_sync_session *session);
+int LIBUSB_CALL libusb_sync_session_control_transfer(libusb_sync_session *session,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout);
+int LIBUSB_CALL libusb_sync_session_bulk_transfer(libusb_sync_session *session,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout);
+int LIBUSB_CALL libusb_sync_session_interrupt_transfer(libusb_sync_session *session,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout);
+
 /** \ingroup libusb_desc
  * Retrieve a descriptor from the default control pipe.
  * This is a convenience function which formulates the appropriate control
@@ -2255,6 +2597,8 @@ int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats);
 
 /** \ingroup libusb_poll
  * File descriptor for polling
@@ -2300,6 +2644,8 @@ void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds);
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
+int LIBUSB_CALL libusb_set_executor(libusb_context *ctx,
+	libusb_executor_fn executor, void *user_data);
 
 /** \ingroup libusb_hotplug
  * Callback handle.
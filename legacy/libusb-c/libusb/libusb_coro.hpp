@@ -0,0 +1,286 @@
+/*
+ * Header-only C++20 coroutine binding for the libusb asynchronous API
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_CORO_HPP
+#define LIBUSB_CORO_HPP
+
+#if !defined(__cplusplus) || __cplusplus < 202002L
+#error "libusb_coro.hpp requires C++20"
+#endif
+
+#include <chrono>
+#include <climits>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <span>
+
+#include "libusb.h"
+
+/*
+ * Each awaitable transfer is backed by a transfer from
+ * libusb_alloc_pooled_transfer(). The awaiter lives in the suspended
+ * coroutine frame, and the coroutine is resumed directly from the transfer
+ * callback, i.e. on whichever thread is handling events for the context.
+ * Transfers are only taken from a pool without allocating when
+ * LIBUSB_OPTION_TRANSFER_POOL is set on the context; otherwise each awaited
+ * transfer is allocated and freed as with libusb_alloc_transfer().
+ *
+ * Usage:
+ *
+ *	libusb::detached_task reader(libusb::device dev)
+ *	{
+ *		unsigned char buf[512];
+ *		for (;;) {
+ *			libusb::transfer_result r = co_await dev.bulk_in(0x81, buf);
+ *			if (!r)
+ *				co_return;
+ *			consume(buf, r.actual_length);
+ *		}
+ *	}
+ *
+ * Events are handled as usual, either with libusb_handle_events() on a
+ * dedicated thread or by driving libusb::event_source from an existing
+ * poll()/epoll event loop.
+ *
+ * A coroutine that is suspended on a transfer must not be destroyed until
+ * the transfer has completed.
+ *
+ * Awaiting a temporary, as in the loop above, leaves nothing through which
+ * the transfer can be reached. To be able to cancel it, bind the awaiter
+ * to a named variable, make it known to whoever cancels, and await it:
+ *
+ *	libusb::transfer_awaiter read = dev.bulk_in(0x81, buf);
+ *	pending = &read;
+ *	libusb::transfer_result r = co_await read;
+ *	pending = nullptr;
+ *
+ * libusb_cancel_transfer(pending->transfer()) then cancels the transfer and
+ * the coroutine resumes with LIBUSB_TRANSFER_CANCELLED. The transfer is
+ * freed by its callback, so cancel from the thread that handles events,
+ * e.g. from another transfer callback, and only while pending is set.
+ */
+
+namespace libusb {
+
+/* Outcome of an awaited transfer. status holds a libusb_transfer_status
+ * value once the transfer has completed, or a negative libusb_error code
+ * if the transfer could not be allocated or submitted. */
+struct transfer_result {
+	int status = LIBUSB_TRANSFER_ERROR;
+	int actual_length = 0;
+
+	bool submitted() const noexcept { return status >= 0; }
+	explicit operator bool() const noexcept { return status == LIBUSB_TRANSFER_COMPLETED; }
+};
+
+/* Awaitable for a single bulk or interrupt transfer */
+class transfer_awaiter {
+public:
+	transfer_awaiter(libusb_context *ctx, libusb_device_handle *dev_handle,
+		unsigned char type, unsigned char endpoint,
+		std::span<unsigned char> buffer, unsigned int timeout) noexcept
+		: ctx_(ctx), dev_handle_(dev_handle), type_(type),
+		  endpoint_(endpoint), buffer_(buffer), timeout_(timeout)
+	{
+	}
+
+	transfer_awaiter(const transfer_awaiter &) = delete;
+	transfer_awaiter &operator=(const transfer_awaiter &) = delete;
+
+	bool await_ready() const noexcept { return false; }
+
+	/* Submits the transfer. Returning false resumes the coroutine at once
+	 * with the allocation or submission error in the result. */
+	bool await_suspend(std::coroutine_handle<> waiter) noexcept
+	{
+		int r;
+
+		if (buffer_.size() > static_cast<std::size_t>(INT_MAX)) {
+			result_.status = LIBUSB_ERROR_INVALID_PARAM;
+			return false;
+		}
+
+		transfer_ = libusb_alloc_pooled_transfer(ctx_, 0);
+		if (!transfer_) {
+			result_.status = LIBUSB_ERROR_NO_MEM;
+			return false;
+		}
+
+		libusb_fill_bulk_transfer(transfer_, dev_handle_, endpoint_,
+			buffer_.data(), static_cast<int>(buffer_.size()),
+			&transfer_awaiter::callback, this, timeout_);
+		transfer_->type = type_;
+
+		waiter_ = waiter;
+		r = libusb_submit_transfer(transfer_);
+		if (r < 0) {
+			libusb_free_transfer(transfer_);
+			transfer_ = nullptr;
+			result_.status = r;
+			return false;
+		}
+
+		return true;
+	}
+
+	transfer_result await_resume() const noexcept { return result_; }
+
+	/* The in-flight transfer, e.g. for libusb_cancel_transfer(), or NULL
+	 * when nothing is in flight */
+	libusb_transfer *transfer() const noexcept { return transfer_; }
+
+private:
+	static void LIBUSB_CALL callback(libusb_transfer *transfer)
+	{
+		transfer_awaiter *self = static_cast<transfer_awaiter *>(transfer->user_data);
+
+		self->result_.status = transfer->status;
+		self->result_.actual_length = transfer->actual_length;
+		self->transfer_ = nullptr;
+		libusb_free_transfer(transfer);
+
+		/* the awaiter may be destroyed once the coroutine resumes */
+		self->waiter_.resume();
+	}
+
+	libusb_context *ctx_;
+	libusb_device_handle *dev_handle_;
+	unsigned char type_;
+	unsigned char endpoint_;
+	std::span<unsigned char> buffer_;
+	unsigned int timeout_;
+	libusb_transfer *transfer_ = nullptr;
+	std::coroutine_handle<> waiter_;
+	transfer_result result_;
+};
+
+/* Non-owning view of an open device handle that produces awaitable
+ * transfers. The caller keeps the handle open for as long as any transfer
+ * created from it is in flight. */
+class device {
+public:
+	device() noexcept = default;
+
+	/* ctx must be the context the handle was opened in (NULL for the
+	 * default context); it selects the transfer pool. */
+	device(libusb_context *ctx, libusb_device_handle *dev_handle) noexcept
+		: ctx_(ctx), dev_handle_(dev_handle)
+	{
+	}
+
+	libusb_device_handle *native_handle() const noexcept { return dev_handle_; }
+
+	transfer_awaiter bulk_in(unsigned char endpoint,
+		std::span<unsigned char> buffer, unsigned int timeout = 0) const noexcept
+	{
+		return transfer_awaiter(ctx_, dev_handle_, LIBUSB_TRANSFER_TYPE_BULK,
+			static_cast<unsigned char>(endpoint | LIBUSB_ENDPOINT_IN), buffer, timeout);
+	}
+
+	transfer_awaiter bulk_out(unsigned char endpoint,
+		std::span<unsigned char> buffer, unsigned int timeout = 0) const noexcept
+	{
+		return transfer_awaiter(ctx_, dev_handle_, LIBUSB_TRANSFER_TYPE_BULK,
+			static_cast<unsigned char>(endpoint & ~LIBUSB_ENDPOINT_IN), buffer, timeout);
+	}
+
+	transfer_awaiter interrupt_in(unsigned char endpoint,
+		std::span<unsigned char> buffer, unsigned int timeout = 0) const noexcept
+	{
+		return transfer_awaiter(ctx_, dev_handle_, LIBUSB_TRANSFER_TYPE_INTERRUPT,
+			static_cast<unsigned char>(endpoint | LIBUSB_ENDPOINT_IN), buffer, timeout);
+	}
+
+	transfer_awaiter interrupt_out(unsigned char endpoint,
+		std::span<unsigned char> buffer, unsigned int timeout = 0) const noexcept
+	{
+		return transfer_awaiter(ctx_, dev_handle_, LIBUSB_TRANSFER_TYPE_INTERRUPT,
+			static_cast<unsigned char>(endpoint & ~LIBUSB_ENDPOINT_IN), buffer, timeout);
+	}
+
+private:
+	libusb_context *ctx_ = nullptr;
+	libusb_device_handle *dev_handle_ = nullptr;
+};
+
+/* Eagerly started, self-destroying coroutine type for top-level transfer
+ * loops. Exceptions escaping the coroutine terminate the program because
+ * there is no one to rethrow them to. */
+struct detached_task {
+	struct promise_type {
+		detached_task get_return_object() const noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+/* Adapter for driving libusb from an external poll()-style event loop.
+ * Register the descriptors from for_each_pollfd() (and keep them current
+ * with libusb_set_pollfd_notifiers()), wait at most timeout(), then call
+ * dispatch() when any descriptor is ready or the timeout expires.
+ * Awaiting coroutines are resumed from within dispatch(). */
+class event_source {
+public:
+	explicit event_source(libusb_context *ctx = nullptr) noexcept : ctx_(ctx) {}
+
+	/* Calls fn(int fd, short events) for each descriptor libusb needs
+	 * watched. Returns false if the platform cannot expose them. */
+	template <typename Fn>
+	bool for_each_pollfd(Fn &&fn) const
+	{
+		const libusb_pollfd **pollfds = libusb_get_pollfds(ctx_);
+		const libusb_pollfd **p;
+
+		if (!pollfds)
+			return false;
+		for (p = pollfds; *p; p++)
+			fn((*p)->fd, (*p)->events);
+		libusb_free_pollfds(pollfds);
+		return true;
+	}
+
+	/* Time until libusb must be called even without descriptor activity,
+	 * or no value if no transfer has a pending timeout */
+	std::optional<std::chrono::microseconds> timeout() const noexcept
+	{
+		struct timeval tv;
+
+		if (libusb_get_next_timeout(ctx_, &tv) != 1)
+			return std::nullopt;
+		return std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+	}
+
+	/* Handles pending events without blocking */
+	int dispatch() const noexcept
+	{
+		struct timeval zero = { 0, 0 };
+
+		return libusb_handle_events_timeout_completed(ctx_, &zero, nullptr);
+	}
+
+private:
+	libusb_context *ctx_;
+};
+
+} /* namespace libusb */
+
+#endif /* LIBUSB_CORO_HPP */
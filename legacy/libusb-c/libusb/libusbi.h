@@ -44,6 +44,16 @@
 #define static_assert(cond, msg) _Static_assert(cond, msg)
 #endif
 
+/* Storage class for thread-local variables. Left undefined if the compiler
+ * provides none, in which case callers must fall back to shared storage. */
+#if defined(_MSC_VER)
+#define USBI_THREAD_LOCAL	__declspec(thread)
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define USBI_THREAD_LOCAL	_Thread_local
+#elif defined(__GNUC__)
+#define USBI_THREAD_LOCAL	__thread
+#endif
+
 #ifdef NDEBUG
 #define ASSERT_EQ(expression, value)	(void)expression
 #define ASSERT_NE(expression, value)	(void)expression
@@ -92,6 +102,17 @@
  *   usbi_atomic_store() - Atomically write a new value value to a variable
  *   usbi_atomic_inc() - Atomically increment a variable's value and return the new value
  *   usbi_atomic_dec() - Atomically decrement a variable's value and return the new value
+ *   usbi_atomic_add() - Atomically add to a variable's value and return the new value
+ *   usbi_atomic_cas() - Atomically replace a variable's value if it still holds the
+ *                       expected value, otherwise update the expected value.
+ *                       Returns non-zero on success.
+ *
+ * The following atomic operations are defined for pointers:
+ *   usbi_atomic_ptr_load() - Atomically read a pointer
+ *   usbi_atomic_ptr_exchange() - Atomically replace a pointer and return the old value
+ *   usbi_atomic_ptr_cas() - Atomically replace a pointer if it still holds the
+ *                           expected value, otherwise update the expected value.
+ *                           Returns non-zero on success.
  *
  * All of these operations are ordered with each other, thus the effects of
  * any one operation is guaranteed to be seen by any other operation.
@@ -102,6 +123,28 @@ typedef volatile LONG usbi_atomic_t;
 #define usbi_atomic_store(a, v)	(*(a)) = (v)
 #define usbi_atomic_inc(a)	InterlockedIncrement((a))
 #define usbi_atomic_dec(a)	InterlockedDecrement((a))
+#define usbi_atomic_add(a, v)	(InterlockedExchangeAdd((a), (v)) + (v))
+static inline int usbi_atomic_cas(usbi_atomic_t *a, long *expected, long desired)
+{
+	long prev = InterlockedCompareExchange(a, desired, *expected);
+
+	if (prev == *expected)
+		return 1;
+	*expected = prev;
+	return 0;
+}
+typedef PVOID volatile usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	(*(a))
+#define usbi_atomic_ptr_exchange(a, v)	InterlockedExchangePointer((a), (v))
+static inline int usbi_atomic_ptr_cas(usbi_atomic_ptr_t *a, void **expected, void *desired)
+{
+	void *prev = InterlockedCompareExchangePointer(a, desired, *expected);
+
+	if (prev == *expected)
+		return 1;
+	*expected = prev;
+	return 0;
+}
 #else
 #if defined(__HAIKU__) && defined(__GNUC__) && !defined(__clang__)
 /* The Haiku port of libusb has some C++ files and GCC does not define
@@ -113,6 +156,12 @@ typedef long usbi_atomic_t;
 #define usbi_atomic_store(a, v)        __atomic_store_n((a), (v), __ATOMIC_SEQ_CST)
 #define usbi_atomic_inc(a)     __atomic_add_fetch((a), 1, __ATOMIC_SEQ_CST)
 #define usbi_atomic_dec(a)     __atomic_sub_fetch((a), 1, __ATOMIC_SEQ_CST)
+#define usbi_atomic_add(a, v)  __atomic_add_fetch((a), (v), __ATOMIC_SEQ_CST)
+#define usbi_atomic_cas(a, e, v)       __atomic_compare_exchange_n((a), (e), (v), 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+typedef void *usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)        __atomic_load_n((a), __ATOMIC_SEQ_CST)
+#define usbi_atomic_ptr_exchange(a, v) __atomic_exchange_n((a), (v), __ATOMIC_SEQ_CST)
+#define usbi_atomic_ptr_cas(a, e, v)   __atomic_compare_exchange_n((a), (e), (v), 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 #else
 #include <stdatomic.h>
 typedef atomic_long usbi_atomic_t;
@@ -120,6 +169,12 @@ typedef atomic_long usbi_atomic_t;
 #define usbi_atomic_store(a, v)	atomic_store((a), (v))
 #define usbi_atomic_inc(a)	(atomic_fetch_add((a), 1) + 1)
 #define usbi_atomic_dec(a)	(atomic_fetch_add((a), -1) - 1)
+#define usbi_atomic_add(a, v)	(atomic_fetch_add((a), (v)) + (v))
+#define usbi_atomic_cas(a, e, v)	atomic_compare_exchange_weak((a), (e), (v))
+typedef _Atomic(void *) usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	atomic_load((a))
+#define usbi_atomic_ptr_exchange(a, v)	atomic_exchange((a), (v))
+#define usbi_atomic_ptr_cas(a, e, v)	atomic_compare_exchange_weak((a), (e), (v))
 #endif
 #endif
 
@@ -353,6 +408,61 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 #define IS_XFERIN(xfer)		(0 != ((xfer)->endpoint & LIBUSB_ENDPOINT_IN))
 #define IS_XFEROUT(xfer)	(!IS_XFERIN(xfer))
 
+/* Number of size classes in the per-context transfer pool. Class 0 holds
+ * transfers without isochronous packet descriptors, class n holds transfers
+ * with up to (USBI_TRANSFER_POOL_MIN_ISO << (2 * (n - 1))) descriptors. */
+#define USBI_TRANSFER_POOL_CLASSES	6
+#define USBI_TRANSFER_POOL_MIN_ISO	8
+
+struct usbi_transfer_pool {
+	/* Singly linked free-lists of struct usbi_transfer, one per size class */
+	usbi_atomic_ptr_t free_lists[USBI_TRANSFER_POOL_CLASSES];
+
+	/* Maximum number of transfers retained, 0 if the pool is disabled */
+	usbi_atomic_t limit;
+	usbi_atomic_t retained;
+
+	usbi_atomic_t hits;
+	usbi_atomic_t misses;
+	usbi_atomic_t overflows;
+};
+
+#define USBI_DEFAULT_REAP_BUDGET	25
+#define USBI_DEFAULT_DEV_MEM_THRESHOLD	(64 * 1024)
+
+struct usbi_event_stats {
+	usbi_atomic_t wakeups;
+	usbi_atomic_t reaps;
+	usbi_atomic_t budget_exhausted;
+	usbi_atomic_t max_reaps;
+	usbi_atomic_t busy_polls;
+	usbi_atomic_t busy_poll_hits;
+	/* Protected by event_data_lock, as a long would wrap within seconds
+	 * on platforms where it has 32 bits */
+	uint64_t busy_poll_ns;
+	usbi_atomic_t wait_histogram[LIBUSB_EVENT_WAIT_BUCKETS];
+	usbi_atomic_t timer_updates;
+};
+
+/* Busy polling state of a context, see LIBUSB_OPTION_BUSY_POLL */
+struct usbi_busy_poll {
+	/* Spin window and CPU limit in percent as set by the options, 0 for
+	 * the defaults */
+	unsigned int window_us;
+	unsigned int cpu_limit;
+
+	/* The remaining fields are only accessed by the thread holding the
+	 * event handling lock */
+
+	/* Current window, shrunk while spinning finds nothing */
+	unsigned int cur_window_us;
+
+	/* Start of the current second and the time spent spinning in it. The
+	 * period starts with the first busy poll */
+	struct timespec period_start;
+	int64_t period_spin_ns;
+};
+
 struct libusb_context {
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 	enum libusb_log_level debug;
@@ -365,10 +475,18 @@ struct libusb_context {
 
 #ifdef HAVE_OS_TIMER
 	/* used for timeout handling, if supported by OS.
-	 * this timer is maintained to trigger on the next pending timeout */
+	 * this timer is maintained to trigger no later than the next pending
+	 * timeout. timer_expiry is the expiration it is armed for, and is
+	 * cleared once it has fired. Both are protected by
+	 * flying_transfers_lock. */
 	usbi_timer_t timer;
+	struct timespec timer_expiry;
+	int timer_armed;
 #endif
 
+	/* See LIBUSB_OPTION_TIMER_SLACK, in milliseconds */
+	unsigned int timer_slack;
+
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
@@ -388,11 +506,13 @@ struct libusb_context {
 	/* Note paths taking both this and usbi_transfer->lock must always
 	 * take this lock first */
 	usbi_mutex_t flying_transfers_lock;
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
+	/* this is a list of in-flight transfer handles, in submission order. */
 	struct list_head flying_transfers;
+	/* a binary min-heap of the in-flight transfers with a finite timeout,
+	 * ordered by timeout expiration. Also protected by flying_transfers_lock. */
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
 
 #if !defined(PLATFORM_WINDOWS)
 	/* user callbacks for pollfd changes */
@@ -404,8 +524,11 @@ struct libusb_context {
 	/* ensures that only one thread is handling events at any one time */
 	usbi_mutex_t events_lock;
 
-	/* used to see if there is an active thread doing event handling */
-	int event_handler_active;
+	/* used to see if there is an active thread doing event handling. It
+	 * is only changed with atomic read-modify-write operations, so that a
+	 * completion thread that reads it the same way after running callbacks
+	 * either sees the handler or has its completions seen by it */
+	usbi_atomic_t event_handler_active;
 
 	/* A thread-local storage key to track which thread is performing event
 	 * handling */
@@ -442,9 +565,37 @@ struct libusb_context {
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
+	/* Transfers passed to usbi_signal_transfer_completion(), most recent
+	 * first. Pushed without locks by any thread, taken as a whole by the
+	 * event handler. */
+	usbi_atomic_ptr_t completed_queue;
+
+	/* Completed transfers taken from completed_queue, in completion order,
+	 * that the backend has yet to handle. Only accessed by the thread
+	 * holding the event handling lock. */
 	struct list_head completed_transfers;
 
+	/* Recycled transfers, see libusb_alloc_pooled_transfer() */
+	struct usbi_transfer_pool transfer_pool;
+
+	/* Maximum number of completions reaped per device and wakeup, 0 for
+	 * USBI_DEFAULT_REAP_BUDGET. See LIBUSB_OPTION_REAP_BUDGET. */
+	unsigned int reap_budget;
+
+	/* Minimum buffer size served from device memory by
+	 * libusb_alloc_transfer_buffer(), 0 to disable.
+	 * See LIBUSB_OPTION_DEV_MEM_THRESHOLD. */
+	unsigned int dev_mem_threshold;
+
+	/* See libusb_get_event_stats() */
+	struct usbi_event_stats event_stats;
+
+	struct usbi_busy_poll busy_poll;
+
+	/* See libusb_set_executor() */
+	libusb_executor_fn executor;
+	void *executor_user_data;
+
 	struct list_head list;
 };
 
@@ -484,9 +635,6 @@ enum usbi_event_flags {
 	/* One or more hotplug messages are pending */
 	USBI_EVENT_HOTPLUG_MSG_PENDING = 1U << 3,
 
-	/* One or more completed transfers are pending */
-	USBI_EVENT_TRANSFER_COMPLETED = 1U << 4,
-
 	/* A device is in the process of being closed */
 	USBI_EVENT_DEVICE_CLOSE = 1U << 5,
 };
@@ -525,13 +673,100 @@ struct libusb_device {
 	usbi_atomic_t attached;
 
 	char * device_strings_utf8[LIBUSB_DEVICE_STRING_COUNT];
+
+	/* Parsed configuration descriptors shared by all callers, the active
+	 * one and an array of bNumConfigurations entries by index. The
+	 * generation is bumped whenever they are dropped, so that descriptors
+	 * parsed from data read before are not cached. All are protected by
+	 * config_cache_lock. */
+	usbi_mutex_t config_cache_lock;
+	struct libusb_config_descriptor *active_config;
+	struct libusb_config_descriptor **configs;
+	uint8_t num_configs;
+	unsigned int config_cache_gen;
+
+	/* Endpoints of the active configuration for the max packet size
+	 * queries, built on first use and dropped along with the parsed
+	 * descriptors. Protected by config_cache_lock. */
+	struct usbi_endpoint_table *endpoint_table;
+};
+
+/* An endpoint of the active configuration, with the fields of its endpoint
+ * and SuperSpeed endpoint companion descriptors that the max packet size
+ * queries need */
+struct usbi_endpoint_info {
+	uint8_t interface_index;
+	uint8_t altsetting_index;
+	uint8_t bEndpointAddress;
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t has_ss_companion;
+	uint8_t ss_max_burst;
+	uint8_t ss_attributes;
+	uint16_t ss_bytes_per_interval;
+};
+
+/* Endpoint slots by address: the endpoint number, plus 16 for IN */
+#define USBI_ENDPOINT_SLOTS	32
+
+static inline unsigned int usbi_endpoint_slot(unsigned char endpoint)
+{
+	return (endpoint & 0x0fU) | ((endpoint & LIBUSB_ENDPOINT_IN) >> 3);
+}
+
+/* The endpoints of a configuration grouped by slot, in descriptor order
+ * within each slot. The endpoints of slot s are
+ * endpoint[first[s]] up to endpoint[first[s + 1]]. */
+struct usbi_endpoint_table {
+	uint8_t bConfigurationValue;
+	uint16_t first[USBI_ENDPOINT_SLOTS + 1];
+	struct usbi_endpoint_info endpoint[LIBUSB_FLEXIBLE_ARRAY];
+};
+
+/* Number of unused device memory buffers retained per device handle */
+#define USBI_DEV_MEM_POOL_RETAIN	8
+
+struct usbi_dev_mem_buffer {
+	struct list_head list;
+	unsigned char *buffer;
+	size_t length;
+};
+
+/* Number of endpoint addresses, including the direction bit */
+#define USBI_MAX_ENDPOINTS	32
+
+/* Completed transfers of one endpoint whose callbacks wait for the
+ * executor, see libusb_set_executor() */
+struct usbi_deferred_queue {
+	struct libusb_device_handle *dev_handle;
+	struct list_head transfers;
+
+	/* set while a task that drains the queue is with the executor */
+	int scheduled;
 };
 
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces, the device memory pool and the
+	 * deferred callback queues */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* Deferred callback queues, one per endpoint address, allocated on
+	 * first use. deferred_cond is signalled when a queue is no longer
+	 * scheduled */
+	struct usbi_deferred_queue *deferred;
+	usbi_cond_t deferred_cond;
+
+	/* set once libusb_close() waits for the deferred callbacks */
+	int deferred_closing;
+
+	/* Device memory buffers handed out by libusb_alloc_transfer_buffer()
+	 * and those retained for reuse */
+	struct list_head dev_mem_used;
+	struct list_head dev_mem_free;
+	unsigned int dev_mem_free_count;
+	int dev_mem_unavailable;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
@@ -599,16 +834,27 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct list_head completed_list;
+	struct usbi_transfer *completed_next;
 	struct timespec timeout;
 	int transferred;
 	uint32_t stream_id;
 	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
 	uint32_t timeout_flags; /* Protected by the flying_transfers_lock */
+	/* Position in the context's timeout heap plus one, 0 if not in the heap.
+	 * Protected by the flying_transfers_lock */
+	unsigned int timeout_heap_index;
 
 	/* The device reference is held until destruction for logging
 	 * even after dev_handle is set to NULL.  */
 	struct libusb_device *dev;
 
+	/* Context and size class of the pool this transfer is returned to when
+	 * freed (pool_class is -1 if the transfer was not allocated from a pool),
+	 * and the next free transfer while it sits in the pool */
+	struct libusb_context *pool_ctx;
+	int pool_class;
+	struct usbi_transfer *pool_next;
+
 	void *priv;
 };
 
@@ -810,6 +1056,15 @@ void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+void usbi_transfer_pool_set_limit(struct libusb_context *ctx, int limit);
+
+static inline unsigned int usbi_get_reap_budget(struct libusb_context *ctx)
+{
+	return ctx->reap_budget ? ctx->reap_budget : USBI_DEFAULT_REAP_BUDGET;
+}
+
+void usbi_record_reaps(struct libusb_context *ctx, unsigned int reaps,
+	unsigned int budget_exhausted);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
@@ -817,6 +1072,8 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *dev_handle);
+void usbi_remove_closed_transfer(struct usbi_transfer *itransfer);
+void usbi_wait_deferred_callbacks(struct libusb_device_handle *dev_handle);
 
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
@@ -836,11 +1093,20 @@ struct usbi_event_source_data {
 
 struct usbi_event_source {
 	struct usbi_event_source_data data;
+	/* Backend-private pointer associated with the event source, e.g. the
+	 * device handle that owns it. Reported back with ready events where the
+	 * event abstraction supports it (see HAVE_EPOLL). */
+	void *user_data;
+	/* Set once the event source has been registered with the OS event
+	 * abstraction. Only accessed during event handling. */
+	unsigned int registered;
 	struct list_head list;
 };
 
+void usbi_clear_event_if_idle(struct libusb_context *ctx);
+
 int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle,
-	short poll_events);
+	short poll_events, void *user_data);
 void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle);
 
 struct usbi_option {
@@ -891,6 +1157,18 @@ struct usbi_reported_events {
 };
 
 int usbi_alloc_event_data(struct libusb_context *ctx);
+void usbi_free_event_data(struct libusb_context *ctx);
+#ifdef HAVE_EPOLL
+void usbi_remove_event_data(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source);
+#else
+static inline void usbi_remove_event_data(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	UNUSED(ctx);
+	UNUSED(ievent_source);
+}
+#endif
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms);
 
@@ -901,6 +1179,11 @@ static inline void *usbi_get_context_priv(struct libusb_context *ctx)
 	return (unsigned char *)ctx + PTR_ALIGN(sizeof(*ctx));
 }
 
+void usbi_clear_config_cache(struct libusb_device *dev);
+void usbi_check_config_cache(struct libusb_device *dev, uint8_t active_value);
+int usbi_get_active_config_data(struct libusb_device *dev,
+	const unsigned char **data, unsigned char **copy);
+
 static inline void *usbi_get_device_priv(struct libusb_device *dev)
 {
 	return (unsigned char *)dev + PTR_ALIGN(sizeof(*dev));
@@ -1195,6 +1478,18 @@ struct usbi_os_backend {
 	int (*get_config_descriptor_by_value)(struct libusb_device *device,
 		uint8_t bConfigurationValue, void **buffer);
 
+	/* Get the raw descriptors of a configuration without copying them.
+	 * config_index is as for get_config_descriptor, or -1 for the active
+	 * configuration. Optional, only implement this if the backend keeps
+	 * the descriptors in memory for the lifetime of the device.
+	 *
+	 * Returns a pointer to the raw-descriptor in *buffer, in bus-endian
+	 * format (LE), and its length on success, or a LIBUSB_ERROR code on
+	 * failure. Return LIBUSB_ERROR_NOT_FOUND if the device is unconfigured.
+	 */
+	int (*get_raw_config_descriptor)(struct libusb_device *device,
+		int config_index, const void **buffer);
+
 	/* Get the bConfigurationValue for the active configuration for a device.
 	 * Optional. This should only be implemented if you can retrieve it from
 	 * cache (don't generate I/O).
@@ -1461,6 +1756,46 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Free any private data that the backend keeps in a transfer across
+	 * submissions. Optional.
+	 *
+	 * Called when the transfer is freed by libusb_free_transfer(), before
+	 * its memory is released or returned to the transfer pool. The transfer
+	 * is never in flight at this point.
+	 */
+	void (*free_transfer_priv)(struct usbi_transfer *itransfer);
+
+	/* Start a thread that handles the completions of a device handle in
+	 * place of the event handling of its context. Optional.
+	 *
+	 * The backend removes the event sources of the handle from the context
+	 * and waits on them in the new thread, which it pins to the given CPU
+	 * unless cpu is -1. Called with the event handling lock held.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_BUSY if a completion thread is already running
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - LIBUSB_ERROR_INVALID_PARAM if the CPU does not exist
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*start_completion_thread)(struct libusb_device_handle *dev_handle,
+		int cpu);
+
+	/* Stop the thread started by start_completion_thread and give the event
+	 * sources of the device handle back to the context. Optional.
+	 *
+	 * Called with the event handling lock held, and by libusb_close()
+	 * before the handle is closed.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if no completion thread is running
+	 * - LIBUSB_ERROR_BUSY if called from the completion thread itself
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*stop_completion_thread)(struct libusb_device_handle *dev_handle);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1474,9 +1809,10 @@ struct usbi_os_backend {
 	 * data for monitoring event sources (size count). This data is to be
 	 * (re)allocated as necessary when event sources are modified.
 	 * The num_ready parameter indicates the number of event sources that
-	 * have reported events. This should be enough information for you to
-	 * determine which actions need to be taken on the currently active
-	 * transfers.
+	 * have reported events. The layout of the data is defined by the OS
+	 * event abstraction, see events_posix.h. This should be enough
+	 * information for you to determine which actions need to be taken on
+	 * the currently active transfers.
 	 *
 	 * For any cancelled transfers, call usbi_handle_transfer_cancellation().
 	 * For completed transfers, call usbi_handle_transfer_completion().
@@ -1497,6 +1833,17 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		void *event_data, unsigned int count, unsigned int num_ready);
 
+	/* Reap the completions of all open devices without waiting. Optional.
+	 *
+	 * Called repeatedly by the event handler while it spins before
+	 * waiting, see LIBUSB_OPTION_BUSY_POLL, so it must be cheap when
+	 * nothing has completed. Handle completions as in handle_events and
+	 * add the number of completions handled to *reaped.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*busy_poll)(struct libusb_context *ctx, unsigned int *reaped);
+
 	/* Handle transfer completion. Optional.
 	 *
 	 * Provide this function when there are no event sources available that
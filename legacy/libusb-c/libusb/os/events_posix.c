@@ -22,6 +22,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
 #endif
@@ -71,6 +72,10 @@ typedef unsigned int usbi_nfds_t;
 
 int usbi_create_event(usbi_event_t *event)
 {
+	usbi_atomic_store(&event->pending, 0);
+	usbi_atomic_store(&event->signals_issued, 0);
+	usbi_atomic_store(&event->signals_suppressed, 0);
+
 #ifdef HAVE_EVENTFD
 	event->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	if (event->eventfd == -1) {
@@ -148,11 +153,21 @@ void usbi_destroy_event(usbi_event_t *event)
 #endif
 }
 
+/* The event stays signalled until it is cleared, so only the first signal
+ * since the last clear writes to it. The flag is reset only after the event
+ * has been read, so a signal suppressed in between is never lost: whoever
+ * clears the event checks for pending work afterwards. */
 void usbi_signal_event(usbi_event_t *event)
 {
 	uint64_t dummy = 1;
 	ssize_t r;
 
+	if (usbi_atomic_inc(&event->pending) > 1) {
+		(void)usbi_atomic_inc(&event->signals_suppressed);
+		return;
+	}
+	(void)usbi_atomic_inc(&event->signals_issued);
+
 	r = write(EVENT_WRITE_FD(event), &dummy, sizeof(dummy));
 	if (r != sizeof(dummy))
 		usbi_warn(NULL, "event write failed");
@@ -167,12 +182,15 @@ void usbi_clear_event(usbi_event_t *event)
 	uint64_t dummy;
 	ssize_t r;
 
+	/* a signaller may have raised the flag without having written yet,
+	 * in which case the eventfd has nothing to read */
 	r = read(EVENT_READ_FD(event), &dummy, sizeof(dummy));
-	if (r != sizeof(dummy))
+	if (r != sizeof(dummy) && errno != EAGAIN)
 		usbi_warn(NULL, "event read failed");
 #ifdef __EMSCRIPTEN__
 	event->has_event = 0;
 #endif
+	usbi_atomic_store(&event->pending, 0);
 }
 
 #ifdef HAVE_TIMERFD
@@ -218,6 +236,188 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 }
 #endif
 
+#ifdef HAVE_EPOLL
+struct usbi_epoll_data {
+	int epoll_fd;
+	struct epoll_event *events;
+	unsigned int max_events;
+};
+
+/* The epoll set is kept in sync with the list of event sources incrementally,
+ * so unlike with poll() nothing needs to be rebuilt when a device is opened or
+ * closed. Called with the event_data_lock held. */
+int usbi_alloc_event_data(struct libusb_context *ctx)
+{
+	struct usbi_epoll_data *epoll_data = ctx->event_data;
+	struct usbi_event_source *ievent_source;
+	unsigned int cnt = 0;
+
+	if (!epoll_data) {
+		epoll_data = calloc(1, sizeof(*epoll_data));
+		if (!epoll_data)
+			return LIBUSB_ERROR_NO_MEM;
+
+		epoll_data->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_data->epoll_fd == -1) {
+			usbi_err(ctx, "failed to create epoll instance, errno=%d", errno);
+			free(epoll_data);
+			return LIBUSB_ERROR_OTHER;
+		}
+
+		ctx->event_data = epoll_data;
+	}
+
+	for_each_event_source(ctx, ievent_source) {
+		cnt++;
+		if (!ievent_source->registered) {
+			struct epoll_event event;
+
+			memset(&event, 0, sizeof(event));
+			event.events = (uint32_t)(unsigned short)ievent_source->data.poll_events;
+			event.data.ptr = ievent_source;
+			if (epoll_ctl(epoll_data->epoll_fd, EPOLL_CTL_ADD, ievent_source->data.os_handle, &event) == -1) {
+				usbi_err(ctx, "failed to add fd %d to epoll set, errno=%d",
+					 ievent_source->data.os_handle, errno);
+				return LIBUSB_ERROR_OTHER;
+			}
+			ievent_source->registered = 1;
+		}
+	}
+
+	if (cnt > epoll_data->max_events) {
+		epoll_data->events = usbi_reallocf(epoll_data->events, cnt * sizeof(*epoll_data->events));
+		if (!epoll_data->events) {
+			epoll_data->max_events = 0;
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		epoll_data->max_events = cnt;
+	}
+
+	ctx->event_data_cnt = cnt;
+	return 0;
+}
+
+/* Unregisters an event source as soon as it is removed, while its fd is still
+ * open. If the fd were only closed, the kernel would keep the registration
+ * as long as the file is open elsewhere (a dup, a forked child, or a wrapped
+ * fd the application closes later), and report events for an event source
+ * that has since been freed. Called with the event_data_lock held. */
+void usbi_remove_event_data(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct usbi_epoll_data *epoll_data = ctx->event_data;
+
+	if (!epoll_data || !ievent_source->registered)
+		return;
+
+	if (epoll_ctl(epoll_data->epoll_fd, EPOLL_CTL_DEL, ievent_source->data.os_handle, NULL) == -1)
+		usbi_warn(ctx, "failed to remove fd %d from epoll set, errno=%d",
+			  ievent_source->data.os_handle, errno);
+	ievent_source->registered = 0;
+}
+
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	struct usbi_epoll_data *epoll_data = ctx->event_data;
+
+	if (!epoll_data)
+		return;
+
+	if (close(epoll_data->epoll_fd) == -1)
+		usbi_warn(ctx, "failed to close epoll fd, errno=%d", errno);
+	free(epoll_data->events);
+	free(epoll_data);
+	ctx->event_data = NULL;
+}
+
+static int event_source_removed(struct libusb_context *ctx,
+	struct usbi_event_source *event_source)
+{
+	struct usbi_event_source *ievent_source;
+
+	for_each_removed_event_source(ctx, ievent_source) {
+		if (ievent_source == event_source)
+			return 1;
+	}
+
+	return 0;
+}
+
+int usbi_wait_for_events(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_epoll_data *epoll_data = ctx->event_data;
+	struct epoll_event *events = epoll_data->events;
+	int i, n, num_ready;
+
+	usbi_dbg(ctx, "epoll_wait() %u fds with timeout in %dms", ctx->event_data_cnt, timeout_ms);
+	num_ready = epoll_wait(epoll_data->epoll_fd, events, (int)ctx->event_data_cnt, timeout_ms);
+	usbi_dbg(ctx, "epoll_wait() returned %d", num_ready);
+	if (num_ready == 0) {
+		if (usbi_using_timer(ctx))
+			goto done;
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_ready == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "epoll_wait() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	reported_events->event_triggered = 0;
+#ifdef HAVE_OS_TIMER
+	reported_events->timer_triggered = 0;
+#endif
+
+	/* pick out the library's internal event sources and move the remaining
+	 * ones to the front of the array for the backend */
+	for (i = 0, n = 0; i < num_ready; i++) {
+		struct usbi_event_source *ievent_source = events[i].data.ptr;
+
+		if (ievent_source->data.os_handle == USBI_EVENT_OS_HANDLE(&ctx->event)) {
+			reported_events->event_triggered = 1;
+			continue;
+		}
+#ifdef HAVE_OS_TIMER
+		if (usbi_using_timer(ctx) &&
+		    ievent_source->data.os_handle == USBI_TIMER_OS_HANDLE(&ctx->timer)) {
+			reported_events->timer_triggered = 1;
+			continue;
+		}
+#endif
+		events[n++] = events[i];
+	}
+	num_ready = n;
+
+	if (!num_ready)
+		goto done;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
+		for (i = 0, n = 0; i < num_ready; i++) {
+			if (event_source_removed(ctx, events[i].data.ptr)) {
+				/* event source was removed after the epoll set was last
+				 * updated. drop the event as it is no longer relevant. */
+				usbi_dbg(ctx, "fd %d was removed, ignoring raised events",
+					 ((struct usbi_event_source *)events[i].data.ptr)->data.os_handle);
+				continue;
+			}
+			events[n++] = events[i];
+		}
+		num_ready = n;
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (num_ready) {
+		reported_events->event_data = events;
+		reported_events->event_data_count = (unsigned int)num_ready;
+	}
+
+done:
+	reported_events->num_ready = (unsigned int)num_ready;
+	return LIBUSB_SUCCESS;
+}
+#else
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
 	struct usbi_event_source *ievent_source;
@@ -247,6 +447,12 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	return 0;
 }
 
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	free(ctx->event_data);
+	ctx->event_data = NULL;
+}
+
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms)
 {
@@ -338,3 +544,4 @@ done:
 	reported_events->num_ready = num_ready;
 	return LIBUSB_SUCCESS;
 }
+#endif
@@ -22,6 +22,9 @@
 #define LIBUSB_EVENTS_POSIX_H
 
 #include <poll.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 typedef int usbi_os_handle_t;
 #define USBI_OS_HANDLE_FORMAT_STRING	"fd %d"
@@ -29,20 +32,28 @@ typedef int usbi_os_handle_t;
 #ifdef HAVE_EVENTFD
 typedef struct usbi_event {
 	int eventfd;
+	/* coalescing of usbi_signal_event(), see events_posix.c */
+	usbi_atomic_t pending;
+	usbi_atomic_t signals_issued;
+	usbi_atomic_t signals_suppressed;
 } usbi_event_t;
 #define USBI_EVENT_OS_HANDLE(e)	((e)->eventfd)
 #define USBI_EVENT_POLL_EVENTS	POLLIN
-#define USBI_INVALID_EVENT	{ -1 }
+#define USBI_INVALID_EVENT	{ -1, 0, 0, 0 }
 #else
 typedef struct usbi_event {
 	int pipefd[2];
+	/* coalescing of usbi_signal_event(), see events_posix.c */
+	usbi_atomic_t pending;
+	usbi_atomic_t signals_issued;
+	usbi_atomic_t signals_suppressed;
 #ifdef __EMSCRIPTEN__
 	_Atomic int has_event;
 #endif
 } usbi_event_t;
 #define USBI_EVENT_OS_HANDLE(e)	((e)->pipefd[0])
 #define USBI_EVENT_POLL_EVENTS	POLLIN
-#define USBI_INVALID_EVENT	{ { -1, -1 } }
+#define USBI_INVALID_EVENT	{ { -1, -1 }, 0, 0, 0 }
 #endif
 
 #ifdef HAVE_TIMERFD
@@ -59,4 +70,10 @@ static inline int usbi_timer_valid(usbi_timer_t *timer)
 }
 #endif
 
+/* With HAVE_EPOLL, the event data handed to the backend's handle_events() is
+ * an array of struct epoll_event, one per ready event source. Each entry's
+ * data.ptr is the struct usbi_event_source, and its user_data is the pointer
+ * given to usbi_add_event_source(). Otherwise it is an array of struct pollfd
+ * covering all of the backend's event sources. */
+
 #endif
@@ -25,6 +25,10 @@
 
 int usbi_create_event(usbi_event_t *event)
 {
+	usbi_atomic_store(&event->pending, 0);
+	usbi_atomic_store(&event->signals_issued, 0);
+	usbi_atomic_store(&event->signals_suppressed, 0);
+
 	event->hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	if (event->hEvent == NULL) {
 		usbi_err(NULL, "CreateEvent failed: %s", windows_error_str(0));
@@ -40,8 +44,16 @@ void usbi_destroy_event(usbi_event_t *event)
 		usbi_warn(NULL, "CloseHandle failed: %s", windows_error_str(0));
 }
 
+/* Only the first signal since the last clear sets the event, see
+ * events_posix.c */
 void usbi_signal_event(usbi_event_t *event)
 {
+	if (usbi_atomic_inc(&event->pending) > 1) {
+		(void)usbi_atomic_inc(&event->signals_suppressed);
+		return;
+	}
+	(void)usbi_atomic_inc(&event->signals_issued);
+
 	if (!SetEvent(event->hEvent))
 		usbi_warn(NULL, "SetEvent failed: %s", windows_error_str(0));
 }
@@ -50,6 +62,7 @@ void usbi_clear_event(usbi_event_t *event)
 {
 	if (!ResetEvent(event->hEvent))
 		usbi_warn(NULL, "ResetEvent failed: %s", windows_error_str(0));
+	usbi_atomic_store(&event->pending, 0);
 }
 
 #ifdef HAVE_OS_TIMER
@@ -164,6 +177,12 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	return 0;
 }
 
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	free(ctx->event_data);
+	ctx->event_data = NULL;
+}
+
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms)
 {
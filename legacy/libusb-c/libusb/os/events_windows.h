@@ -26,10 +26,14 @@ typedef HANDLE usbi_os_handle_t;
 
 typedef struct usbi_event {
 	HANDLE hEvent;
+	/* coalescing of usbi_signal_event(), see events_windows.c */
+	usbi_atomic_t pending;
+	usbi_atomic_t signals_issued;
+	usbi_atomic_t signals_suppressed;
 } usbi_event_t;
 #define USBI_EVENT_OS_HANDLE(e)	((e)->hEvent)
 #define USBI_EVENT_POLL_EVENTS	0
-#define USBI_INVALID_EVENT	{ INVALID_HANDLE_VALUE }
+#define USBI_INVALID_EVENT	{ INVALID_HANDLE_VALUE, 0, 0, 0 }
 
 #define HAVE_OS_TIMER 1
 typedef struct usbi_timer {
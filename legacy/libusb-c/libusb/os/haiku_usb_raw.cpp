@@ -194,6 +194,7 @@ const struct usbi_os_backend usbi_backend = {
 	/*.get_active_config_descriptor =*/ haiku_get_active_config_descriptor,
 	/*.get_config_descriptor =*/ haiku_get_config_descriptor,
 	/*.get_config_descriptor_by_value =*/ NULL,
+	/*.get_raw_config_descriptor =*/ NULL,
 
 	/*.get_configuration =*/ NULL,
 	/*.set_configuration =*/ haiku_set_configuration,
@@ -220,8 +221,12 @@ const struct usbi_os_backend usbi_backend = {
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
 	/*.clear_transfer_priv =*/ NULL,
+	/*.free_transfer_priv =*/ NULL,
+	/*.start_completion_thread =*/ NULL,
+	/*.stop_completion_thread =*/ NULL,
 
 	/*.handle_events =*/ NULL,
+	/*.busy_poll =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
 
 	/*.context_priv_size =*/ 0,
@@ -30,6 +30,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -121,6 +122,12 @@ struct config_descriptor {
 struct linux_context_priv {
 	/* no enumeration or hot-plug detection */
 	int no_device_discovery;
+#ifndef HAVE_EPOLL
+	/* open device handles indexed by usbfs fd, used to find the handle for
+	 * a ready pollfd. Protected by the context's open_devs_lock. */
+	struct libusb_device_handle **fd_handles;
+	unsigned int fd_handles_len;
+#endif
 };
 
 struct linux_device_priv {
@@ -136,6 +143,15 @@ struct linux_device_handle_priv {
 	int fd_removed;
 	int fd_keep;
 	uint32_t caps;
+	/* URBs submitted and not yet reaped. Raised before submission, so it
+	 * never falls below the number of URBs the kernel holds for this fd. */
+	usbi_atomic_t urbs_in_flight;
+	/* completion thread, see op_start_completion_thread() */
+	int completion_running;
+	int completion_cpu;
+	int completion_disconnected;
+	pthread_t completion_thread;
+	usbi_event_t completion_stop;
 };
 
 enum reap_action {
@@ -154,6 +170,15 @@ enum reap_action {
 	ERROR,
 };
 
+/* An iso URB along with its position in the transfer, so that completions
+ * can be matched to the URB without a search */
+struct iso_urb {
+	int index;
+
+	/* must be last, as it is followed by the iso packet descriptors */
+	struct usbfs_urb urb;
+};
+
 struct linux_transfer_priv {
 	union {
 		struct usbfs_urb *urbs;
@@ -167,6 +192,12 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* iso URBs of the last completed submission, kept for reuse by the
+	 * next submission with the same number of packets */
+	struct usbfs_urb **iso_urb_cache;
+	int iso_cache_urbs;
+	int iso_cache_packets;
 };
 
 static int dev_has_config0(struct libusb_device *dev)
@@ -434,6 +465,12 @@ static void op_exit(struct libusb_context *ctx)
 {
 	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 
+#ifndef HAVE_EPOLL
+	free(cpriv->fd_handles);
+	cpriv->fd_handles = NULL;
+	cpriv->fd_handles_len = 0;
+#endif
+
 	if (cpriv->no_device_discovery) {
 		return;
 	}
@@ -840,14 +877,24 @@ static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 	return LIBUSB_ERROR_NOT_FOUND;
 }
 
-static int op_get_active_config_descriptor(struct libusb_device *dev,
-	void *buffer, size_t len)
+static int op_get_raw_config_descriptor(struct libusb_device *dev,
+	int config_index, const void **buffer)
 {
 	struct linux_device_priv *priv = usbi_get_device_priv(dev);
+	struct config_descriptor *config;
 	void *config_desc;
 	int active_config;
 	int r;
 
+	if (config_index >= 0) {
+		if (config_index >= dev->device_descriptor.bNumConfigurations)
+			return LIBUSB_ERROR_NOT_FOUND;
+
+		config = &priv->config_descriptors[config_index];
+		*buffer = config->desc;
+		return (int)config->actual_len;
+	}
+
 	if (priv->sysfs_dir) {
 		r = sysfs_get_active_config(dev, &active_config);
 		if (r < 0)
@@ -866,6 +913,20 @@ static int op_get_active_config_descriptor(struct libusb_device *dev,
 	if (r < 0)
 		return r;
 
+	*buffer = config_desc;
+	return r;
+}
+
+static int op_get_active_config_descriptor(struct libusb_device *dev,
+	void *buffer, size_t len)
+{
+	const void *config_desc;
+	int r;
+
+	r = op_get_raw_config_descriptor(dev, -1, &config_desc);
+	if (r < 0)
+		return r;
+
 	len = MIN(len, (size_t)r);
 	memcpy(buffer, config_desc, len);
 	return len;
@@ -874,15 +935,15 @@ static int op_get_active_config_descriptor(struct libusb_device *dev,
 static int op_get_config_descriptor(struct libusb_device *dev,
 	uint8_t config_index, void *buffer, size_t len)
 {
-	struct linux_device_priv *priv = usbi_get_device_priv(dev);
-	struct config_descriptor *config;
+	const void *config_desc;
+	int r;
 
-	if (config_index >= dev->device_descriptor.bNumConfigurations)
-		return LIBUSB_ERROR_NOT_FOUND;
+	r = op_get_raw_config_descriptor(dev, config_index, &config_desc);
+	if (r < 0)
+		return r;
 
-	config = &priv->config_descriptors[config_index];
-	len = MIN(len, config->actual_len);
-	memcpy(buffer, config->desc, len);
+	len = MIN(len, (size_t)r);
+	memcpy(buffer, config_desc, len);
 	return len;
 }
 
@@ -1384,6 +1445,65 @@ static int linux_default_scan_devices(struct libusb_context *ctx)
 }
 #endif
 
+#ifndef HAVE_EPOLL
+static int fd_index_add(struct libusb_device_handle *handle, int fd)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if ((unsigned int)fd >= cpriv->fd_handles_len) {
+		struct libusb_device_handle **fd_handles;
+		unsigned int len = cpriv->fd_handles_len ? cpriv->fd_handles_len : 64;
+
+		while ((unsigned int)fd >= len)
+			len *= 2;
+
+		fd_handles = realloc(cpriv->fd_handles, len * sizeof(*fd_handles));
+		if (!fd_handles) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		memset(fd_handles + cpriv->fd_handles_len, 0,
+		       (len - cpriv->fd_handles_len) * sizeof(*fd_handles));
+		cpriv->fd_handles = fd_handles;
+		cpriv->fd_handles_len = len;
+	}
+
+	cpriv->fd_handles[fd] = handle;
+out:
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return r;
+}
+
+static void fd_index_remove(struct libusb_device_handle *handle, int fd)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if ((unsigned int)fd < cpriv->fd_handles_len && cpriv->fd_handles[fd] == handle)
+		cpriv->fd_handles[fd] = NULL;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+}
+#else
+/* with epoll the handle is found through the event source */
+static int fd_index_add(struct libusb_device_handle *handle, int fd)
+{
+	UNUSED(handle);
+	UNUSED(fd);
+	return LIBUSB_SUCCESS;
+}
+
+static void fd_index_remove(struct libusb_device_handle *handle, int fd)
+{
+	UNUSED(handle);
+	UNUSED(fd);
+}
+#endif
+
 static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
@@ -1400,7 +1520,15 @@ static int initialize_handle(struct libusb_device_handle *handle, int fd)
 		hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	r = fd_index_add(handle, fd);
+	if (r < 0)
+		return r;
+
+	r = usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT, handle);
+	if (r < 0)
+		fd_index_remove(handle, fd);
+
+	return r;
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1487,6 +1615,7 @@ static void op_close(struct libusb_device_handle *dev_handle)
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
 		usbi_remove_event_source(HANDLE_CTX(dev_handle), hpriv->fd);
+	fd_index_remove(dev_handle, hpriv->fd);
 	if (!hpriv->fd_keep)
 		close(hpriv->fd);
 }
@@ -1741,7 +1870,11 @@ static void *op_dev_mem_alloc(struct libusb_device_handle *handle, size_t len)
 
 	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, hpriv->fd, 0);
 	if (buffer == MAP_FAILED) {
-		usbi_err(HANDLE_CTX(handle), "alloc dev mem failed, errno=%d", errno);
+		int err = errno;
+
+		usbi_err(HANDLE_CTX(handle), "alloc dev mem failed, errno=%d", err);
+		/* the caller tells permanent from transient failures by errno */
+		errno = err;
 		return NULL;
 	}
 	return buffer;
@@ -1949,19 +2082,58 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+static int submit_urb(struct linux_device_handle_priv *hpriv, struct usbfs_urb *urb)
+{
+	int r, saved_errno;
+
+	(void)usbi_atomic_inc(&hpriv->urbs_in_flight);
+	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	if (r < 0) {
+		saved_errno = errno;
+		(void)usbi_atomic_dec(&hpriv->urbs_in_flight);
+		errno = saved_errno;
+	}
+
+	return r;
+}
+
+static void free_iso_urb_array(struct usbfs_urb **urbs, int num_urbs)
 {
 	int i;
 
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+	for (i = 0; i < num_urbs; i++) {
+		struct usbfs_urb *urb = urbs[i];
 
 		if (!urb)
 			break;
-		free(urb);
+		free(container_of(urb, struct iso_urb, urb));
 	}
 
-	free(tpriv->iso_urbs);
+	free(urbs);
+}
+
+static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+{
+	free_iso_urb_array(tpriv->iso_urbs, tpriv->num_urbs);
+	tpriv->iso_urbs = NULL;
+}
+
+static void free_iso_urb_cache(struct linux_transfer_priv *tpriv)
+{
+	if (!tpriv->iso_urb_cache)
+		return;
+
+	free_iso_urb_array(tpriv->iso_urb_cache, tpriv->iso_cache_urbs);
+	tpriv->iso_urb_cache = NULL;
+}
+
+/* Keeps the URBs of a completed iso transfer for the next submission */
+static void retire_iso_urbs(struct linux_transfer_priv *tpriv, int num_packets)
+{
+	free_iso_urb_cache(tpriv);
+	tpriv->iso_urb_cache = tpriv->iso_urbs;
+	tpriv->iso_cache_urbs = tpriv->num_urbs;
+	tpriv->iso_cache_packets = num_packets;
 	tpriv->iso_urbs = NULL;
 }
 
@@ -2079,7 +2251,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		    (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET))
 			urb->flags |= USBFS_URB_ZERO_PACKET;
 
-		r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+		r = submit_urb(hpriv, urb);
 		if (r == 0)
 			continue;
 
@@ -2152,6 +2324,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	unsigned int packet_len;
 	unsigned int total_len = 0;
 	unsigned char *urb_buffer = transfer->buffer;
+	int reuse = 0;
 
 	if (num_packets < 1)
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -2182,9 +2355,18 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
 
-	urbs = calloc(num_urbs, sizeof(*urbs));
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
+	/* the URB layout only depends on the number of packets, so the URBs
+	 * of the previous submission can be reused if that is unchanged */
+	if (tpriv->iso_urb_cache && tpriv->iso_cache_packets == num_packets) {
+		urbs = tpriv->iso_urb_cache;
+		tpriv->iso_urb_cache = NULL;
+		reuse = 1;
+	} else {
+		free_iso_urb_cache(tpriv);
+		urbs = calloc(num_urbs, sizeof(*urbs));
+		if (!urbs)
+			return LIBUSB_ERROR_NO_MEM;
+	}
 
 	tpriv->iso_urbs = urbs;
 	tpriv->num_urbs = num_urbs;
@@ -2202,12 +2384,22 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		alloc_size = sizeof(*urb)
 			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
+		if (reuse) {
+			/* clear the results of the previous submission */
+			urb = urbs[i];
+			memset(urb, 0, alloc_size);
+		} else {
+			struct iso_urb *iso_urb;
+
+			iso_urb = calloc(1, offsetof(struct iso_urb, urb) + alloc_size);
+			if (!iso_urb) {
+				free_iso_urbs(tpriv);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			iso_urb->index = i;
+			urb = &iso_urb->urb;
+			urbs[i] = urb;
 		}
-		urbs[i] = urb;
 
 		/* populate packet lengths */
 		for (k = 0; k < num_packets_in_urb; j++, k++) {
@@ -2230,7 +2422,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r = submit_urb(hpriv, urbs[i]);
 
 		if (r == 0)
 			continue;
@@ -2310,7 +2502,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer = transfer->buffer;
 	urb->buffer_length = transfer->length;
 
-	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	r = submit_urb(hpriv, urb);
 	if (r < 0) {
 		free(urb);
 		tpriv->urbs = NULL;
@@ -2398,6 +2590,11 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	}
 }
 
+static void op_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	free_iso_urb_cache(usbi_get_transfer_priv(itransfer));
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
@@ -2535,25 +2732,65 @@ completed:
 		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
 }
 
+/* Whether the usbfs iso packet descriptor can be copied over the libusb one,
+ * which holds for all ABIs where enums are the size of an int */
+#define ISO_PACKET_DESC_LAYOUT_MATCHES \
+	(sizeof(struct usbfs_iso_packet_desc) == sizeof(struct libusb_iso_packet_descriptor) && \
+	 offsetof(struct usbfs_iso_packet_desc, length) == \
+		offsetof(struct libusb_iso_packet_descriptor, length) && \
+	 offsetof(struct usbfs_iso_packet_desc, actual_length) == \
+		offsetof(struct libusb_iso_packet_descriptor, actual_length) && \
+	 offsetof(struct usbfs_iso_packet_desc, status) == \
+		offsetof(struct libusb_iso_packet_descriptor, status))
+
+static enum libusb_transfer_status iso_packet_status(struct libusb_transfer *transfer,
+	int i, int status)
+{
+	switch (status) {
+	case 0:
+		return LIBUSB_TRANSFER_COMPLETED;
+	case -ENOENT: /* cancelled */
+	case -ECONNRESET:
+		return LIBUSB_TRANSFER_COMPLETED;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - device removed", i);
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	case -EPIPE:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - detected endpoint stall", i);
+		return LIBUSB_TRANSFER_STALL;
+	case -EOVERFLOW:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - overflow error", i);
+		return LIBUSB_TRANSFER_OVERFLOW;
+	case -ETIME:
+	case -EPROTO:
+	case -EILSEQ:
+	case -ECOMM:
+	case -ENOSR:
+	case -EXDEV:
+		usbi_dbg(TRANSFER_CTX(transfer), "packet %d - low-level USB error %d", i, status);
+		return LIBUSB_TRANSFER_ERROR;
+	default:
+		usbi_warn(TRANSFER_CTX(transfer), "packet %d - unrecognised urb status %d",
+			  i, status);
+		return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
 static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct libusb_iso_packet_descriptor *lib_desc;
 	int num_urbs = tpriv->num_urbs;
-	int urb_idx = 0;
+	int urb_idx = container_of(urb, struct iso_urb, urb)->index + 1;
 	int i;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
 	usbi_mutex_lock(&itransfer->lock);
-	for (i = 0; i < num_urbs; i++) {
-		if (urb == tpriv->iso_urbs[i]) {
-			urb_idx = i + 1;
-			break;
-		}
-	}
-	if (urb_idx == 0) {
+	if (urb_idx > num_urbs || tpriv->iso_urbs[urb_idx - 1] != urb) {
 		usbi_err(TRANSFER_CTX(transfer), "could not locate urb!");
 		usbi_mutex_unlock(&itransfer->lock);
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -2562,49 +2799,27 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg(TRANSFER_CTX(transfer), "handling completion status %d of iso urb %d/%d", urb->status,
 		 urb_idx, num_urbs);
 
-	/* copy isochronous results back in */
-
-	for (i = 0; i < urb->number_of_packets; i++) {
-		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
-		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
+	/* copy isochronous results back in. where the descriptor layouts
+	 * match, lengths are copied in one go and only the statuses of packets
+	 * that did not complete cleanly need translating */
+	lib_desc = &transfer->iso_packet_desc[tpriv->iso_packet_offset];
+	tpriv->iso_packet_offset += urb->number_of_packets;
+
+	if (ISO_PACKET_DESC_LAYOUT_MATCHES) {
+		memcpy(lib_desc, urb->iso_frame_desc,
+			(size_t)urb->number_of_packets * sizeof(*lib_desc));
+		for (i = 0; i < urb->number_of_packets; i++) {
+			if (urb->iso_frame_desc[i].status)
+				lib_desc[i].status = iso_packet_status(transfer, i,
+					(int)urb->iso_frame_desc[i].status);
+		}
+	} else {
+		for (i = 0; i < urb->number_of_packets; i++) {
+			struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
 
-		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
-		switch (urb_desc->status) {
-		case 0:
-			break;
-		case -ENOENT: /* cancelled */
-		case -ECONNRESET:
-			break;
-		case -ENODEV:
-		case -ESHUTDOWN:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - device removed", i);
-			lib_desc->status = LIBUSB_TRANSFER_NO_DEVICE;
-			break;
-		case -EPIPE:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - detected endpoint stall", i);
-			lib_desc->status = LIBUSB_TRANSFER_STALL;
-			break;
-		case -EOVERFLOW:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - overflow error", i);
-			lib_desc->status = LIBUSB_TRANSFER_OVERFLOW;
-			break;
-		case -ETIME:
-		case -EPROTO:
-		case -EILSEQ:
-		case -ECOMM:
-		case -ENOSR:
-		case -EXDEV:
-			usbi_dbg(TRANSFER_CTX(transfer), "packet %d - low-level USB error %d", i, urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		default:
-			usbi_warn(TRANSFER_CTX(transfer), "packet %d - unrecognised urb status %d",
-				  i, urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
+			lib_desc[i].status = iso_packet_status(transfer, i, (int)urb_desc->status);
+			lib_desc[i].actual_length = urb_desc->actual_length;
 		}
-		lib_desc->actual_length = urb_desc->actual_length;
 	}
 
 	tpriv->num_retired++;
@@ -2645,7 +2860,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we've reaped all urbs then we're done */
 	if (tpriv->num_retired == num_urbs) {
 		usbi_dbg(TRANSFER_CTX(transfer), "all URBs in transfer reaped --> complete!");
-		free_iso_urbs(tpriv);
+		retire_iso_urbs(tpriv, transfer->num_iso_packets);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
@@ -2716,27 +2931,11 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
+static int handle_reaped_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
 {
-	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
-	int r;
-	struct usbfs_urb *urb = NULL;
-	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
-
-	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
-	if (r < 0) {
-		if (errno == EAGAIN)
-			return 1;
-		if (errno == ENODEV)
-			return LIBUSB_ERROR_NO_DEVICE;
-
-		usbi_err(HANDLE_CTX(handle), "reap failed, errno=%d", errno);
-		return LIBUSB_ERROR_IO;
-	}
-
-	itransfer = urb->usercontext;
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_transfer *itransfer = urb->usercontext;
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	usbi_dbg(HANDLE_CTX(handle), "urb type=%u status=%d transferred=%d", urb->type, urb->status, urb->actual_length);
 
@@ -2755,77 +2954,345 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+#define REAP_BATCH_SIZE	32
+
+/* Reap up to budget completed URBs. The URBs are drained from the kernel in
+ * batches before any of their completions are handled. Returns 1 if no more
+ * URBs are ready, 0 if the budget was exhausted while URBs are still in
+ * flight, or a LIBUSB_ERROR code on failure. The number of URBs reaped is
+ * added to *reaped. */
+static int reap_for_handle(struct libusb_device_handle *handle,
+	unsigned int budget, unsigned int *reaped)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_urb *urbs[REAP_BATCH_SIZE];
+
+	while (budget) {
+		unsigned int batch = MIN(budget, REAP_BATCH_SIZE);
+		unsigned int i, n;
+		int reap_errno = 0;
+		int r = 0;
+
+		for (n = 0; n < batch; n++) {
+			/* once every submitted URB has been reaped, the kernel has
+			 * nothing left, so save the ioctl that would say so */
+			if (usbi_atomic_load(&hpriv->urbs_in_flight) <= 0) {
+				reap_errno = EAGAIN;
+				break;
+			}
+			if (ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urbs[n]) < 0) {
+				reap_errno = errno;
+				break;
+			}
+			(void)usbi_atomic_dec(&hpriv->urbs_in_flight);
+		}
+
+		budget -= n;
+		*reaped += n;
+
+		/* every reaped URB must be handled, even after a failure */
+		for (i = 0; i < n; i++) {
+			int ret = handle_reaped_urb(handle, urbs[i]);
+
+			if (ret < 0 && !r)
+				r = ret;
+		}
+
+		if (r < 0)
+			return r;
+
+		if (reap_errno) {
+			if (reap_errno == EAGAIN)
+				return 1;
+			if (reap_errno == ENODEV)
+				return LIBUSB_ERROR_NO_DEVICE;
+
+			usbi_err(HANDLE_CTX(handle), "reap failed, errno=%d", reap_errno);
+			return LIBUSB_ERROR_IO;
+		}
+	}
+
+	/* a budget used up by the last URB in flight left nothing pending */
+	return usbi_atomic_load(&hpriv->urbs_in_flight) <= 0;
+}
+
+static void handle_disconnect_for_handle(struct libusb_device_handle *handle,
+	unsigned int *reaped)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+	/* device will still be marked as attached if hotplug monitor thread
+	 * hasn't processed remove event yet */
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	if (usbi_atomic_load(&handle->dev->attached))
+		linux_device_disconnected(handle->dev->bus_number,
+					  handle->dev->device_address);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+	if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT)
+		reap_for_handle(handle, UINT_MAX, reaped);
+
+	usbi_handle_disconnect(handle);
+}
+
+/* Returns 0 to continue handling events, or a LIBUSB_ERROR code on failure.
+ * The number of URBs reaped is added to *reaped and the number of times the
+ * reap budget was exhausted to *exhausted. */
+static int handle_events_for_handle(struct libusb_device_handle *handle, short revents,
+	unsigned int *reaped, unsigned int *exhausted)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	int r;
+
+	if (revents & POLLERR) {
+		/* remove the fd from the pollfd set so that it doesn't continuously
+		 * trigger an event, and flag that it has been removed so op_close()
+		 * doesn't try to remove it a second time */
+		usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
+		hpriv->fd_removed = 1;
+
+		handle_disconnect_for_handle(handle, reaped);
+		return 0;
+	}
+
+	r = reap_for_handle(handle, usbi_get_reap_budget(HANDLE_CTX(handle)), reaped);
+	if (r == 0)
+		(*exhausted)++;
+	else if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
+		r = 0;
+
+	return r;
+}
+
+/* Waits on the fd of a handle in place of the event handling of the
+ * context. The fd has been removed from the context, so no other thread
+ * reaps its URBs until op_stop_completion_thread() puts it back. */
+static void *completion_thread_main(void *arg)
+{
+	struct libusb_device_handle *handle = arg;
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct pollfd fds[2];
+
+	if (hpriv->completion_cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(hpriv->completion_cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			usbi_warn(ctx, "failed to pin completion thread to cpu %d, errno=%d",
+				  hpriv->completion_cpu, errno);
+	}
+
+	fds[0].fd = hpriv->fd;
+	fds[0].events = POLLOUT;
+	fds[1].fd = USBI_EVENT_OS_HANDLE(&hpriv->completion_stop);
+	fds[1].events = USBI_EVENT_POLL_EVENTS;
+
+	/* callbacks run here as they would in the event handling thread, so
+	 * blocking calls made from them fail with LIBUSB_ERROR_BUSY */
+	usbi_start_event_handling(ctx);
+
+	for (;;) {
+		unsigned int reaped = 0;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			usbi_err(ctx, "completion thread poll failed, errno=%d", errno);
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (fds[0].revents & POLLERR) {
+			/* the fd stays out of the context, as it would after
+			 * handle_events_for_handle() saw the disconnect */
+			handle_disconnect_for_handle(handle, &reaped);
+			hpriv->completion_disconnected = 1;
+			libusb_interrupt_event_handler(ctx);
+			break;
+		}
+
+		if (!fds[0].revents)
+			continue;
+
+		/* the thread serves a single handle, so there is no one to
+		 * share a reap budget with */
+		reap_for_handle(handle, UINT_MAX, &reaped);
+		usbi_record_reaps(ctx, reaped, 0);
+
+		/* an event handler may wait for these completions in
+		 * libusb_handle_events_completed(), and its waiters are woken
+		 * when it returns. Without one there is nobody to wake */
+		if (reaped && usbi_atomic_add(&ctx->event_handler_active, 0) > 0)
+			libusb_interrupt_event_handler(ctx);
+	}
+
+	usbi_end_event_handling(ctx);
+	return NULL;
+}
+
+static int op_start_completion_thread(struct libusb_device_handle *handle, int cpu)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	int r;
+
+	if (hpriv->completion_running)
+		return LIBUSB_ERROR_BUSY;
+	if (hpriv->fd_removed)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if (cpu >= CPU_SETSIZE)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = usbi_create_event(&hpriv->completion_stop);
+	if (r)
+		return r;
+
+	usbi_remove_event_source(ctx, hpriv->fd);
+	hpriv->fd_removed = 1;
+	hpriv->completion_cpu = cpu;
+	hpriv->completion_disconnected = 0;
+
+	r = pthread_create(&hpriv->completion_thread, NULL, completion_thread_main, handle);
+	if (r) {
+		usbi_err(ctx, "failed to create completion thread, error=%d", r);
+		if (!usbi_add_event_source(ctx, hpriv->fd, POLLOUT, handle))
+			hpriv->fd_removed = 0;
+		usbi_destroy_event(&hpriv->completion_stop);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	hpriv->completion_running = 1;
+	return 0;
+}
+
+static int op_stop_completion_thread(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	int r;
+
+	if (!hpriv->completion_running)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (pthread_equal(pthread_self(), hpriv->completion_thread))
+		return LIBUSB_ERROR_BUSY;
+
+	usbi_signal_event(&hpriv->completion_stop);
+	pthread_join(hpriv->completion_thread, NULL);
+	usbi_destroy_event(&hpriv->completion_stop);
+	hpriv->completion_running = 0;
+
+	if (hpriv->completion_disconnected)
+		return 0;
+
+	r = usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT, handle);
+	if (r)
+		return r;
+
+	hpriv->fd_removed = 0;
+	return 0;
+}
+
+static int op_busy_poll(struct libusb_context *ctx, unsigned int *reaped)
+{
+	unsigned int budget = usbi_get_reap_budget(ctx);
+	unsigned int n = 0, exhausted = 0;
+	struct libusb_device_handle *handle;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	for_each_open_device(ctx, handle) {
+		struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+		/* handles whose fd is not waited on by the context are left to
+		 * their completion thread or to the disconnect handling */
+		if (hpriv->fd_removed || usbi_atomic_load(&hpriv->urbs_in_flight) <= 0)
+			continue;
+
+		r = reap_for_handle(handle, budget, &n);
+		if (r == 0)
+			exhausted++;
+		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
+			r = 0;
+		if (r < 0)
+			break;
+		r = 0;
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	usbi_record_reaps(ctx, n, exhausted);
+	*reaped += n;
+	return r;
+}
+
+#ifdef HAVE_EPOLL
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int count, unsigned int num_ready)
 {
+	struct epoll_event *events = event_data;
+	unsigned int reaped = 0, exhausted = 0;
+	unsigned int n;
+	int r = 0;
+
+	UNUSED(num_ready);
+
+	/* every event carries the event source, which in turn carries the
+	 * handle that registered it, so no lookup is needed. the handles cannot
+	 * be closed while events are being handled. */
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	for (n = 0; n < count; n++) {
+		struct usbi_event_source *ievent_source = events[n].data.ptr;
+
+		r = handle_events_for_handle(ievent_source->user_data,
+			(short)events[n].events, &reaped, &exhausted);
+		if (r)
+			break;
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	usbi_record_reaps(ctx, reaped, exhausted);
+	return r;
+}
+#else
+static int op_handle_events(struct libusb_context *ctx,
+	void *event_data, unsigned int count, unsigned int num_ready)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 	struct pollfd *fds = event_data;
+	unsigned int reaped = 0, exhausted = 0;
 	unsigned int n;
-	int r;
+	int r = 0;
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (n = 0; n < count && num_ready > 0; n++) {
 		struct pollfd *pollfd = &fds[n];
-		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
-		int reap_count;
+		struct libusb_device_handle *handle = NULL;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		for_each_open_device(ctx, handle) {
-			hpriv = usbi_get_device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
+		if ((unsigned int)pollfd->fd < cpriv->fd_handles_len)
+			handle = cpriv->fd_handles[pollfd->fd];
 
-		if (!hpriv || hpriv->fd != pollfd->fd) {
+		if (!handle) {
 			usbi_err(ctx, "cannot find handle for fd %d",
 				 pollfd->fd);
 			continue;
 		}
 
-		if (pollfd->revents & POLLERR) {
-			/* remove the fd from the pollfd set so that it doesn't continuously
-			 * trigger an event, and flag that it has been removed so op_close()
-			 * doesn't try to remove it a second time */
-			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
-			hpriv->fd_removed = 1;
-
-			/* device will still be marked as attached if hotplug monitor thread
-			 * hasn't processed remove event yet */
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			if (usbi_atomic_load(&handle->dev->attached))
-				linux_device_disconnected(handle->dev->bus_number,
-							  handle->dev->device_address);
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
-
-			if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT) {
-				do {
-					r = reap_for_handle(handle);
-				} while (r == 0);
-			}
-
-			usbi_handle_disconnect(handle);
-			continue;
-		}
-
-		reap_count = 0;
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0 && ++reap_count <= 25);
-
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
-			goto out;
+		r = handle_events_for_handle(handle, pollfd->revents, &reaped, &exhausted);
+		if (r)
+			break;
 	}
-
-	r = 0;
-out:
 	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	usbi_record_reaps(ctx, reaped, exhausted);
 	return r;
 }
+#endif
 
 const struct usbi_os_backend usbi_backend = {
 	.name = "Linux usbfs",
@@ -2838,6 +3305,7 @@ const struct usbi_os_backend usbi_backend = {
 	.get_active_config_descriptor = op_get_active_config_descriptor,
 	.get_config_descriptor = op_get_config_descriptor,
 	.get_config_descriptor_by_value = op_get_config_descriptor_by_value,
+	.get_raw_config_descriptor = op_get_raw_config_descriptor,
 
 	.wrap_sys_device = op_wrap_sys_device,
 	.open = op_open,
@@ -2866,8 +3334,12 @@ const struct usbi_os_backend usbi_backend = {
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.free_transfer_priv = op_free_transfer_priv,
+	.start_completion_thread = op_start_completion_thread,
+	.stop_completion_thread = op_stop_completion_thread,
 
 	.handle_events = op_handle_events,
+	.busy_poll = op_busy_poll,
 
 	.context_priv_size = sizeof(struct linux_context_priv),
 	.device_priv_size = sizeof(struct linux_device_priv),
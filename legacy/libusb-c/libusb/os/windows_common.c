@@ -963,6 +963,7 @@ const struct usbi_os_backend usbi_backend = {
 	windows_get_active_config_descriptor,
 	windows_get_config_descriptor,
 	windows_get_config_descriptor_by_value,
+	NULL,	/* get_raw_config_descriptor */
 	windows_get_configuration,
 	windows_set_configuration,
 	windows_claim_interface,
@@ -984,7 +985,11 @@ const struct usbi_os_backend usbi_backend = {
 	windows_submit_transfer,
 	windows_cancel_transfer,
 	NULL,	/* clear_transfer_priv */
+	NULL,	/* free_transfer_priv */
+	NULL,	/* start_completion_thread */
+	NULL,	/* stop_completion_thread */
 	NULL,	/* handle_events */
+	NULL,	/* busy_poll */
 	windows_handle_transfer_completion,
 	sizeof(struct windows_context_priv),
 	sizeof(union windows_device_priv),
@@ -69,6 +69,97 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
+/* Small control transfers use a per-thread buffer for the setup packet and
+ * data stage instead of allocating one on every call. The busy flag guards
+ * against nested use, e.g. from a transfer callback of another context that
+ * runs while this thread waits for completion. */
+#define SYNC_BUFFER_SIZE	256
+
+#ifdef USBI_THREAD_LOCAL
+static USBI_THREAD_LOCAL unsigned char sync_buffer[SYNC_BUFFER_SIZE];
+static USBI_THREAD_LOCAL int sync_buffer_busy;
+#endif
+
+static unsigned char *sync_buffer_get(size_t size)
+{
+#ifdef USBI_THREAD_LOCAL
+	if (size <= sizeof(sync_buffer) && !sync_buffer_busy) {
+		sync_buffer_busy = 1;
+		return sync_buffer;
+	}
+#endif
+	return malloc(size);
+}
+
+static void sync_buffer_put(unsigned char *buffer)
+{
+#ifdef USBI_THREAD_LOCAL
+	if (buffer == sync_buffer) {
+		sync_buffer_busy = 0;
+		return;
+	}
+#endif
+	free(buffer);
+}
+
+/* Maps the status of a completed transfer to a libusb error code, or 0 if
+ * the transfer completed successfully */
+static int sync_transfer_result(struct libusb_context *ctx,
+	struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(ctx, "unrecognised status code %d", transfer->status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+/* Runs a control transfer on the given transfer and buffer, which must hold
+ * at least LIBUSB_CONTROL_SETUP_SIZE + wLength bytes. Both remain owned by
+ * the caller. */
+static int do_sync_control_transfer(libusb_device_handle *dev_handle,
+	struct libusb_transfer *transfer, unsigned char *buffer,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	int completed = 0;
+	int r;
+
+	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
+		wLength);
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+
+	libusb_fill_control_transfer(transfer, dev_handle, buffer,
+		sync_transfer_cb, &completed, timeout);
+	transfer->flags = 0;
+	r = libusb_submit_transfer(transfer);
+	if (r < 0)
+		return r;
+
+	sync_transfer_wait_for_completion(transfer);
+
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+		memcpy(data, libusb_control_transfer_get_data(transfer),
+			(size_t)transfer->actual_length);
+
+	r = sync_transfer_result(HANDLE_CTX(dev_handle), transfer);
+	return r ? r : transfer->actual_length;
+}
+
 /** \ingroup libusb_syncio
  * Perform a USB control transfer.
  *
@@ -106,96 +197,47 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 {
 	struct libusb_transfer *transfer;
 	unsigned char *buffer;
-	int completed = 0;
 	int r;
 
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
+	transfer = libusb_alloc_pooled_transfer(HANDLE_CTX(dev_handle), 0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
-	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	buffer = sync_buffer_get(LIBUSB_CONTROL_SETUP_SIZE + wLength);
 	if (!buffer) {
 		libusb_free_transfer(transfer);
 		return LIBUSB_ERROR_NO_MEM;
 	}
 
-	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
-		wLength);
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
-		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
-
-	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		libusb_free_transfer(transfer);
-		return r;
-	}
-
-	sync_transfer_wait_for_completion(transfer);
-
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
-		memcpy(data, libusb_control_transfer_get_data(transfer),
-			(size_t)transfer->actual_length);
-
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
+	r = do_sync_control_transfer(dev_handle, transfer, buffer, bmRequestType,
+		bRequest, wValue, wIndex, data, wLength, timeout);
 
 	libusb_free_transfer(transfer);
+	sync_buffer_put(buffer);
 	return r;
 }
 
+/* Runs a bulk or interrupt transfer on the given transfer, which remains
+ * owned by the caller */
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
-	unsigned char endpoint, unsigned char *buffer, int length,
-	int *transferred, unsigned int timeout, unsigned char type)
+	struct libusb_transfer *transfer, unsigned char endpoint,
+	unsigned char *buffer, int length, int *transferred,
+	unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer;
 	int completed = 0;
 	int r;
 
-	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
-		return LIBUSB_ERROR_BUSY;
-
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
-
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
 		sync_transfer_cb, &completed, timeout);
 	transfer->type = type;
+	transfer->flags = 0;
 
 	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		libusb_free_transfer(transfer);
+	if (r < 0)
 		return r;
-	}
 
 	sync_transfer_wait_for_completion(transfer);
 
@@ -204,31 +246,25 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		*transferred = transfer->actual_length;
 	}
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = 0;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
+	return sync_transfer_result(HANDLE_CTX(dev_handle), transfer);
+}
+
+static int sync_bulk_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *buffer, int length,
+	int *transferred, unsigned int timeout, unsigned char type)
+{
+	struct libusb_transfer *transfer;
+	int r;
+
+	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	transfer = libusb_alloc_pooled_transfer(HANDLE_CTX(dev_handle), 0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = do_sync_bulk_transfer(dev_handle, transfer, endpoint, buffer, length,
+		transferred, timeout, type);
 
 	libusb_free_transfer(transfer);
 	return r;
@@ -283,7 +319,7 @@ int API_EXPORTED libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *transferred, unsigned int timeout)
 {
-	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
+	return sync_bulk_transfer(dev_handle, endpoint, data, length,
 		transferred, timeout, LIBUSB_TRANSFER_TYPE_BULK);
 }
 
@@ -337,6 +373,196 @@ int API_EXPORTED libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *transferred, unsigned int timeout)
 {
-	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
+	return sync_bulk_transfer(dev_handle, endpoint, data, length,
 		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
 }
+
+struct libusb_sync_session {
+	struct libusb_device_handle *dev_handle;
+
+	/* Reused for every transfer of the session */
+	struct libusb_transfer *transfer;
+
+	/* Holds the setup packet and data stage of control transfers. Grows to
+	 * the largest control transfer seen so far. */
+	unsigned char *buffer;
+	size_t buffer_size;
+};
+
+/** \ingroup libusb_syncio
+ * Open a synchronous I/O session on a device handle.
+ *
+ * A session owns a transfer and a control transfer buffer that are reused
+ * by every libusb_sync_session_control_transfer(),
+ * libusb_sync_session_bulk_transfer() and
+ * libusb_sync_session_interrupt_transfer() call, so that once the buffer
+ * has grown to the largest control transfer issued no further memory is
+ * allocated. This benefits workloads that issue many small transfers, such
+ * as polling device registers.
+ *
+ * A session must not be used by more than one thread at a time, and must be
+ * closed with libusb_sync_session_close() before its device handle is
+ * closed.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param session output location for the new session. Only populated if
+ * the return code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if an argument is NULL
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_sync_session_open(libusb_device_handle *dev_handle,
+	libusb_sync_session **session)
+{
+	struct libusb_sync_session *_session;
+
+	if (!dev_handle || !session)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_session = calloc(1, sizeof(*_session));
+	if (!_session)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_session->transfer = libusb_alloc_transfer(0);
+	if (!_session->transfer) {
+		free(_session);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_session->dev_handle = dev_handle;
+	*session = _session;
+	return 0;
+}
+
+/** \ingroup libusb_syncio
+ * Close a session opened with libusb_sync_session_open() and free its
+ * resources.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param session the session to close. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_sync_session_close(libusb_sync_session *session)
+{
+	if (!session)
+		return;
+
+	libusb_free_transfer(session->transfer);
+	free(session->buffer);
+	free(session);
+}
+
+/** \ingroup libusb_syncio
+ * Perform a USB control transfer on a session. This behaves like
+ * libusb_control_transfer() on the device handle of the session, but reuses
+ * the transfer and buffer of the session.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param session a session opened with libusb_sync_session_open()
+ * \param bmRequestType the request type field for the setup packet
+ * \param bRequest the request field for the setup packet
+ * \param wValue the value field for the setup packet
+ * \param wIndex the index field for the setup packet
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on direction bits within bmRequestType)
+ * \param wLength the length field for the setup packet. The data buffer should
+ * be at least this size.
+ * \param timeout timeout (in milliseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ * \returns on success, the number of bytes actually transferred
+ * \returns \ref LIBUSB_ERROR_NO_MEM if the session buffer could not be grown
+ * \returns any error code returned by libusb_control_transfer()
+ */
+int API_EXPORTED libusb_sync_session_control_transfer(libusb_sync_session *session,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	size_t size = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+
+	if (usbi_handling_events(HANDLE_CTX(session->dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	if (size > session->buffer_size) {
+		unsigned char *buffer = realloc(session->buffer, size);
+
+		if (!buffer)
+			return LIBUSB_ERROR_NO_MEM;
+		session->buffer = buffer;
+		session->buffer_size = size;
+	}
+
+	return do_sync_control_transfer(session->dev_handle, session->transfer,
+		session->buffer, bmRequestType, bRequest, wValue, wIndex, data,
+		wLength, timeout);
+}
+
+/** \ingroup libusb_syncio
+ * Perform a USB bulk transfer on a session. This behaves like
+ * libusb_bulk_transfer() on the device handle of the session, but reuses
+ * the transfer of the session.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param session a session opened with libusb_sync_session_open()
+ * \param endpoint the address of a valid endpoint to communicate with
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on endpoint)
+ * \param length for bulk writes, the number of bytes from data to be sent. for
+ * bulk reads, the maximum number of bytes to receive into the data buffer.
+ * \param transferred output location for the number of bytes actually
+ * transferred, or NULL
+ * \param timeout timeout (in milliseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ * \returns 0 on success (and populates <tt>transferred</tt>)
+ * \returns any error code returned by libusb_bulk_transfer()
+ */
+int API_EXPORTED libusb_sync_session_bulk_transfer(libusb_sync_session *session,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	if (usbi_handling_events(HANDLE_CTX(session->dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	return do_sync_bulk_transfer(session->dev_handle, session->transfer,
+		endpoint, data, length, transferred, timeout,
+		LIBUSB_TRANSFER_TYPE_BULK);
+}
+
+/** \ingroup libusb_syncio
+ * Perform a USB interrupt transfer on a session. This behaves like
+ * libusb_interrupt_transfer() on the device handle of the session, but
+ * reuses the transfer of the session.
+ *
+ * Since version 1.0.30, \ref LIBUSB_API_VERSION >= 0x0100010C
+ *
+ * \param session a session opened with libusb_sync_session_open()
+ * \param endpoint the address of a valid endpoint to communicate with
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on endpoint)
+ * \param length for interrupt writes, the number of bytes from data to be
+ * sent. for interrupt reads, the maximum number of bytes to receive into the
+ * data buffer.
+ * \param transferred output location for the number of bytes actually
+ * transferred, or NULL
+ * \param timeout timeout (in milliseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ * \returns 0 on success (and populates <tt>transferred</tt>)
+ * \returns any error code returned by libusb_interrupt_transfer()
+ */
+int API_EXPORTED libusb_sync_session_interrupt_transfer(libusb_sync_session *session,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	if (usbi_handling_events(HANDLE_CTX(session->dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	return do_sync_bulk_transfer(session->dev_handle, session->transfer,
+		endpoint, data, length, transferred, timeout,
+		LIBUSB_TRANSFER_TYPE_INTERRUPT);
+}
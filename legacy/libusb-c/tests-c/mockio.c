@@ -0,0 +1,2289 @@
+/*
+ * libusb tests of the core I/O paths against a mock OS backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusbi.h"
+#include "libusb_testlib.h"
+
+/* This program provides its own usbi_backend, which takes the place of the
+ * platform backend when linking against the static library. Devices are
+ * created with libusb_wrap_sys_device(), submitted transfers stay in flight
+ * until they are cancelled or time out. */
+
+static int mock_wrap_sys_device(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, intptr_t sys_dev)
+{
+	struct libusb_device *dev;
+
+	dev = usbi_alloc_device(ctx, (unsigned long)sys_dev);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	dev->bus_number = 1;
+	dev->device_address = (uint8_t)sys_dev;
+	dev->device_descriptor.bNumConfigurations = 2;
+	usbi_atomic_store(&dev->attached, 1);
+	handle->dev = dev;
+
+	return LIBUSB_SUCCESS;
+}
+
+/* A composite configuration: an interface association, interface 0 with a
+ * class-specific descriptor and two altsettings, and interface 1 whose
+ * endpoint has a SuperSpeed endpoint companion */
+static const uint8_t mock_config[] = {
+	0x09, LIBUSB_DT_CONFIG, 0x53, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
+	0x08, LIBUSB_DT_INTERFACE_ASSOCIATION, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+	0x09, LIBUSB_DT_INTERFACE, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x05, 0x24, 0x01, 0x02, 0x03,
+	0x07, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_INTERRUPT, 0x08, 0x00, 0x04,
+	0x09, LIBUSB_DT_INTERFACE, 0x00, 0x01, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_INTERRUPT, 0x40, 0x00, 0x04,
+	0x09, LIBUSB_DT_INTERFACE, 0x01, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x82, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x04, 0x00,
+	0x06, LIBUSB_DT_SS_ENDPOINT_COMPANION, 0x0f, 0x00, 0x00, 0x10,
+	0x07, LIBUSB_DT_ENDPOINT, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x04, 0x00,
+};
+
+/* A second configuration with a single interface, whose bulk endpoint has a
+ * smaller max packet size */
+static const uint8_t mock_config2[] = {
+	0x09, LIBUSB_DT_CONFIG, 0x19, 0x00, 0x01, 0x02, 0x00, 0x80, 0x32,
+	0x09, LIBUSB_DT_INTERFACE, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x82, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0x00,
+};
+
+/* bConfigurationValue of the active configuration, 0 if unconfigured */
+static uint8_t mock_active_config = 1;
+
+static int mock_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, void *buffer, size_t len)
+{
+	const uint8_t *desc;
+	size_t desc_len;
+
+	UNUSED(dev);
+	switch (config_index) {
+	case 0:
+		desc = mock_config;
+		desc_len = sizeof(mock_config);
+		break;
+	case 1:
+		desc = mock_config2;
+		desc_len = sizeof(mock_config2);
+		break;
+	default:
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	len = MIN(len, desc_len);
+	memcpy(buffer, desc, len);
+	return (int)len;
+}
+
+static int mock_get_active_config_descriptor(struct libusb_device *dev,
+	void *buffer, size_t len)
+{
+	if (!mock_active_config)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return mock_get_config_descriptor(dev, mock_active_config - 1, buffer, len);
+}
+
+static int mock_get_configuration(struct libusb_device_handle *handle,
+	uint8_t *config)
+{
+	UNUSED(handle);
+	*config = mock_active_config;
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_get_raw_config_descriptor(struct libusb_device *dev,
+	int config_index, const void **buffer)
+{
+	UNUSED(dev);
+	if (config_index < 0) {
+		if (!mock_active_config)
+			return LIBUSB_ERROR_NOT_FOUND;
+		config_index = mock_active_config - 1;
+	}
+
+	switch (config_index) {
+	case 0:
+		*buffer = mock_config;
+		return (int)sizeof(mock_config);
+	case 1:
+		*buffer = mock_config2;
+		return (int)sizeof(mock_config2);
+	default:
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+}
+
+static int mock_set_configuration(struct libusb_device_handle *handle, int config)
+{
+	UNUSED(handle);
+	if (config < -1 || config > 2)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	mock_active_config = config < 0 ? 0 : (uint8_t)config;
+	return LIBUSB_SUCCESS;
+}
+
+static void mock_close(struct libusb_device_handle *handle)
+{
+	UNUSED(handle);
+}
+
+static int dev_mem_allocs;
+
+static void *mock_dev_mem_alloc(struct libusb_device_handle *handle, size_t len)
+{
+	UNUSED(handle);
+	dev_mem_allocs++;
+	return malloc(len);
+}
+
+static int mock_dev_mem_free(struct libusb_device_handle *handle, void *buffer,
+	size_t len)
+{
+	UNUSED(handle);
+	UNUSED(len);
+	dev_mem_allocs--;
+	free(buffer);
+	return LIBUSB_SUCCESS;
+}
+
+/* When set, transfers complete as soon as they are submitted */
+static int complete_on_submit;
+static struct libusb_transfer *last_submitted;
+/* Buffer of the last submitted transfer, which may be gone by now */
+static unsigned char *last_buffer;
+/* When non-zero, transfers to this endpoint are rejected on submission */
+static unsigned char reject_endpoint;
+/* When set, transfers are rejected on submission once submissions_left
+ * more have been accepted */
+static int limit_submissions;
+static int submissions_left;
+
+/* Per-transfer backend data */
+struct mock_transfer_priv {
+	/* Set once completion has been signalled */
+	int signalled;
+};
+
+static int mock_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct mock_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	if (reject_endpoint &&
+	    USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->endpoint == reject_endpoint)
+		return LIBUSB_ERROR_IO;
+	if (limit_submissions) {
+		if (!submissions_left)
+			return LIBUSB_ERROR_IO;
+		submissions_left--;
+	}
+
+	last_submitted = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	last_buffer = last_submitted->buffer;
+	tpriv->signalled = complete_on_submit;
+	if (complete_on_submit)
+		usbi_signal_transfer_completion(itransfer);
+	return LIBUSB_SUCCESS;
+}
+
+static int mock_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct mock_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	if (tpriv->signalled)
+		return LIBUSB_ERROR_NOT_FOUND;
+	tpriv->signalled = 1;
+	usbi_signal_transfer_completion(itransfer);
+	return LIBUSB_SUCCESS;
+}
+
+static void mock_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+}
+
+static int transfer_privs_freed;
+
+static void mock_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+	transfer_privs_freed++;
+}
+
+static int mock_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	if (itransfer->state_flags & USBI_TRANSFER_CANCELLING)
+		return usbi_handle_transfer_cancellation(itransfer);
+
+	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_COMPLETED);
+}
+
+/* When nonzero, the number of busy polls after which the last submitted
+ * transfer completes */
+static int busy_poll_countdown;
+
+static int mock_busy_poll(struct libusb_context *ctx, unsigned int *reaped)
+{
+	struct usbi_transfer *itransfer;
+	struct mock_transfer_priv *tpriv;
+
+	UNUSED(ctx);
+
+	if (!busy_poll_countdown || --busy_poll_countdown)
+		return LIBUSB_SUCCESS;
+
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(last_submitted);
+	tpriv = usbi_get_transfer_priv(itransfer);
+	tpriv->signalled = 1;
+	(*reaped)++;
+	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_COMPLETED);
+}
+
+const struct usbi_os_backend usbi_backend = {
+	.name = "Mock backend",
+	.wrap_sys_device = mock_wrap_sys_device,
+	.get_active_config_descriptor = mock_get_active_config_descriptor,
+	.get_config_descriptor = mock_get_config_descriptor,
+	.get_configuration = mock_get_configuration,
+	.get_raw_config_descriptor = mock_get_raw_config_descriptor,
+	.set_configuration = mock_set_configuration,
+	.close = mock_close,
+	.dev_mem_alloc = mock_dev_mem_alloc,
+	.dev_mem_free = mock_dev_mem_free,
+	.submit_transfer = mock_submit_transfer,
+	.cancel_transfer = mock_cancel_transfer,
+	.clear_transfer_priv = mock_clear_transfer_priv,
+	.free_transfer_priv = mock_free_transfer_priv,
+	.busy_poll = mock_busy_poll,
+	.handle_transfer_completion = mock_handle_transfer_completion,
+	.transfer_priv_size = sizeof(struct mock_transfer_priv),
+};
+
+static void LIBUSB_CALL count_cb(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+
+	(*completed)++;
+}
+
+static long elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	TIMESPEC_SUB(&now, start, &now);
+	return (long)now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/* Submits n transfers with distinct timeouts in a shuffled order, so that
+ * insertions land all over the timeout heap. The shuffle uses a fixed seed
+ * to keep runs comparable. Returns the average submission time in
+ * nanoseconds, or -1 on failure. */
+static long submit_many(int n)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer **transfers;
+	struct timespec start;
+	unsigned int *timeouts;
+	unsigned int seed = 12345, tmp;
+	long ns = -1;
+	int completed = 0;
+	int i, j, r;
+
+	timeouts = malloc((size_t)n * sizeof(*timeouts));
+	if (!timeouts)
+		return -1;
+	for (i = 0; i < n; i++)
+		timeouts[i] = 60000 + (unsigned int)i;
+	for (i = n - 1; i > 0; i--) {
+		seed = seed * 1103515245U + 12345U;
+		j = (int)((seed >> 8) % (unsigned int)(i + 1));
+		tmp = timeouts[i];
+		timeouts[i] = timeouts[j];
+		timeouts[j] = tmp;
+	}
+
+	transfers = calloc((size_t)n, sizeof(*transfers));
+	if (!transfers) {
+		free(timeouts);
+		return -1;
+	}
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		goto out;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			goto out;
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, count_cb, &completed, timeouts[i]);
+	}
+
+	usbi_get_monotonic_time(&start);
+	for (i = 0; i < n; i++) {
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", i, r);
+			goto out;
+		}
+	}
+	ns = elapsed_ns(&start) / n;
+
+	if (ctx->timeout_heap_len != (unsigned int)n) {
+		libusb_testlib_logf("Expected %d transfers in the timeout heap, found %u",
+			n, ctx->timeout_heap_len);
+		ns = -1;
+	}
+
+	for (i = 0; i < n; i++)
+		libusb_cancel_transfer(transfers[i]);
+	while (completed < n) {
+		r = libusb_handle_events_completed(ctx, NULL);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			ns = -1;
+			break;
+		}
+	}
+
+	if (ctx->timeout_heap_len) {
+		libusb_testlib_logf("Timeout heap not empty after cancellation");
+		ns = -1;
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		libusb_free_transfer(transfers[i]);
+	free(transfers);
+	free(timeouts);
+	if (handle)
+		libusb_close(handle);
+	if (ctx)
+		libusb_exit(ctx);
+	return ns;
+}
+
+/* Returns the best average submission time of a few runs of submit_many(),
+ * or -1 on failure. */
+static long submit_many_best(int n)
+{
+	long ns, best = -1;
+	int run;
+
+	for (run = 0; run < 3; run++) {
+		ns = submit_many(n);
+		if (ns < 0)
+			return -1;
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+
+	return best;
+}
+
+/** Benchmark submitting 1000 and 10000 concurrent transfers with timeouts.
+ * With a timeout heap a submission costs O(log n), so ten times as many
+ * transfers in flight must not make a submission more than a few times
+ * slower, where a sorted list would grow linearly. */
+static libusb_testlib_result test_submit_scaling(void)
+{
+	long ns_small, ns_large;
+
+	ns_small = submit_many_best(1000);
+	ns_large = submit_many_best(10000);
+	if (ns_small < 0 || ns_large < 0)
+		return TEST_STATUS_FAILURE;
+
+	libusb_testlib_logf("submit: %ld ns/transfer with 1000 in flight, %ld ns/transfer with 10000 in flight",
+		ns_small, ns_large);
+
+	if (ns_large > 4 * ns_small) {
+		libusb_testlib_logf("Submission cost grows with the transfers in flight");
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static void LIBUSB_CALL order_cb(struct libusb_transfer *transfer)
+{
+	int *order = transfer->user_data;
+
+	*order = (*order * 10) + (int)transfer->timeout / 10;
+}
+
+/** Test that timeouts submitted out of order expire in order, and that
+ * transfers with an infinite timeout do not expire. */
+static libusb_testlib_result test_timeout_order(void)
+{
+	static const unsigned int timeouts[] = { 30, 10, 0, 20 };
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfers[4] = { NULL };
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int order = 0;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	for (i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			goto out;
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, order_cb, &order, timeouts[i]);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", i, r);
+			goto out;
+		}
+	}
+
+	if (ctx->timeout_heap_len != 3) {
+		libusb_testlib_logf("Expected 3 transfers in the timeout heap, found %u",
+			ctx->timeout_heap_len);
+		goto out;
+	}
+
+	while (order < 123) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+
+	if (order != 123) {
+		libusb_testlib_logf("Timeouts expired out of order: %d", order);
+		goto out;
+	}
+
+	for (i = 0; i < 4; i++) {
+		if (timeouts[i] && transfers[i]->status != LIBUSB_TRANSFER_TIMED_OUT) {
+			libusb_testlib_logf("Transfer %d has status %d", i, transfers[i]->status);
+			goto out;
+		}
+	}
+
+	/* the transfer without a timeout is still in flight */
+	r = libusb_cancel_transfer(transfers[2]);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to cancel transfer: %d", r);
+		goto out;
+	}
+	while (order == 123) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS)
+			goto out;
+	}
+
+	if (transfers[2]->status == LIBUSB_TRANSFER_CANCELLED)
+		result = TEST_STATUS_SUCCESS;
+
+out:
+	for (i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that transfers still in flight when their handle is closed are
+ * dropped from the timeout heap. */
+static libusb_testlib_result test_close_in_flight(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval tv = { 0, 50000 };
+	int completed = 0;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		goto out;
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_IN, NULL, 0,
+		count_cb, &completed, 10);
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to submit transfer: %d", r);
+		goto out;
+	}
+
+	libusb_close(handle);
+	handle = NULL;
+	if (ctx->timeout_heap_len != 0) {
+		libusb_testlib_logf("Closed transfer left in the timeout heap");
+		goto out;
+	}
+
+	r = libusb_handle_events_timeout(ctx, &tv);
+	if (r != LIBUSB_SUCCESS || completed) {
+		libusb_testlib_logf("Closed transfer was processed after its handle closed");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that a batch submission reports per-transfer results and arms the
+ * timer for the earliest timeout of the batch. */
+static libusb_testlib_result test_submit_batch(void)
+{
+	static const unsigned int timeouts[] = { 30, 10, 0, 20 };
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfers[5] = { NULL };
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int results[5];
+	int order = 0;
+	int completed = 0;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	for (i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			goto out;
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, order_cb, &order, timeouts[i]);
+	}
+
+	/* the last entry repeats the first one and must be rejected */
+	transfers[4] = transfers[0];
+	r = libusb_submit_transfers(transfers, 5, results);
+	transfers[4] = NULL;
+	if (r != 4 || results[0] || results[1] || results[2] || results[3] ||
+	    results[4] != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("Unexpected batch result %d (%d %d %d %d %d)", r,
+			results[0], results[1], results[2], results[3], results[4]);
+		goto out;
+	}
+
+	if (ctx->timeout_heap_len != 3) {
+		libusb_testlib_logf("Expected 3 transfers in the timeout heap, found %u",
+			ctx->timeout_heap_len);
+		goto out;
+	}
+
+	r = libusb_submit_transfers(transfers, 1, results);
+	if (r != 0 || results[0] != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("Resubmitting an active transfer returned %d", results[0]);
+		goto out;
+	}
+
+	while (order < 123) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+
+	if (order != 123) {
+		libusb_testlib_logf("Timeouts expired out of order: %d", order);
+		goto out;
+	}
+
+	r = libusb_cancel_transfer(transfers[2]);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to cancel transfer: %d", r);
+		goto out;
+	}
+	while (order == 123) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS)
+			goto out;
+	}
+
+	/* a transfer the backend rejects leaves the batch off the flying list
+	 * while the transfers after it are still queued */
+	for (i = 0; i < 3; i++) {
+		transfers[i]->callback = count_cb;
+		transfers[i]->user_data = &completed;
+		transfers[i]->timeout = 0;
+	}
+	transfers[1]->endpoint = LIBUSB_ENDPOINT_IN | 2;
+	reject_endpoint = LIBUSB_ENDPOINT_IN | 2;
+	r = libusb_submit_transfers(transfers, 3, results);
+	reject_endpoint = 0;
+	if (r != 2 || results[0] || results[1] != LIBUSB_ERROR_IO || results[2]) {
+		libusb_testlib_logf("Unexpected batch result %d (%d %d %d)", r,
+			results[0], results[1], results[2]);
+		goto out;
+	}
+
+	if (LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[1])->list.next) {
+		libusb_testlib_logf("Rejected transfer left on the flying list");
+		goto out;
+	}
+
+	if (libusb_cancel_transfer(transfers[0]) != LIBUSB_SUCCESS ||
+	    libusb_cancel_transfer(transfers[2]) != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to cancel the batch");
+		goto out;
+	}
+	while (completed < 2) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS)
+			goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	for (i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that large transfer buffers come from device memory and are reused,
+ * and that small ones come from the heap. */
+static libusb_testlib_result test_transfer_buffers(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	unsigned char *small, *large, *reused;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_DEV_MEM_THRESHOLD, 4096);
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+
+	small = libusb_alloc_transfer_buffer(handle, 100);
+	large = libusb_alloc_transfer_buffer(handle, 10000);
+	if (!small || !large || dev_mem_allocs != 1) {
+		libusb_testlib_logf("Expected one device memory allocation, found %d", dev_mem_allocs);
+		goto out;
+	}
+	libusb_free_transfer_buffer(handle, small);
+	libusb_free_transfer_buffer(handle, large);
+
+	/* a slightly smaller buffer fits in the retained one */
+	reused = libusb_alloc_transfer_buffer(handle, 9000);
+	if (reused != large || dev_mem_allocs != 1) {
+		libusb_testlib_logf("Device memory was not reused");
+		goto out;
+	}
+	libusb_free_transfer_buffer(handle, reused);
+
+	/* with device memory disabled, everything comes from the heap */
+	r = libusb_set_option(ctx, LIBUSB_OPTION_DEV_MEM_THRESHOLD, 0);
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+	large = libusb_alloc_transfer_buffer(handle, 10000);
+	if (!large || large == reused) {
+		libusb_testlib_logf("Device memory used while disabled");
+		goto out;
+	}
+	libusb_free_transfer_buffer(handle, large);
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (handle)
+		libusb_close(handle);
+	if (dev_mem_allocs) {
+		libusb_testlib_logf("%d device memory buffers leaked", dev_mem_allocs);
+		result = TEST_STATUS_FAILURE;
+	}
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that a sync session reuses its transfer and buffer, and that small
+ * plain control transfers do not allocate a buffer per call. */
+static libusb_testlib_result test_sync_session(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_sync_session *session = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfer;
+	unsigned char data[512];
+	unsigned char *buffer;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	r = libusb_sync_session_open(handle, &session);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to open sync session: %d", r);
+		goto out;
+	}
+
+	complete_on_submit = 1;
+
+	r = libusb_sync_session_control_transfer(session, LIBUSB_ENDPOINT_OUT,
+		0, 0, 0, data, 4, 1000);
+	if (r != 0) {
+		libusb_testlib_logf("Session control transfer failed: %d", r);
+		goto out;
+	}
+	transfer = last_submitted;
+	buffer = transfer->buffer;
+
+	for (i = 0; i < 100; i++) {
+		r = libusb_sync_session_control_transfer(session, LIBUSB_ENDPOINT_OUT,
+			0, 0, 0, data, (uint16_t)(i % 4), 1000);
+		if (r == 0)
+			r = libusb_sync_session_bulk_transfer(session, 0x01, data,
+				sizeof(data), NULL, 1000);
+		if (r != 0) {
+			libusb_testlib_logf("Session transfer %d failed: %d", i, r);
+			goto out;
+		}
+		if (last_submitted != transfer) {
+			libusb_testlib_logf("Session transfer %d was not reused", i);
+			goto out;
+		}
+	}
+
+	r = libusb_sync_session_control_transfer(session, LIBUSB_ENDPOINT_OUT,
+		0, 0, 0, data, 2, 1000);
+	if (r != 0 || transfer->buffer != buffer) {
+		libusb_testlib_logf("Session control buffer was not reused");
+		goto out;
+	}
+
+	/* small plain control transfers share one buffer per thread */
+	r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT, 0, 0, 0, data,
+		4, 1000);
+	buffer = last_buffer;
+	if (r == 0)
+		r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, 0, 0, 0, data,
+			8, 1000);
+	if (r != 0) {
+		libusb_testlib_logf("Control transfer failed: %d", r);
+		goto out;
+	}
+#ifdef USBI_THREAD_LOCAL
+	if (last_buffer != buffer) {
+		libusb_testlib_logf("Control transfer buffer was not reused");
+		goto out;
+	}
+#endif
+
+	/* large ones still work */
+	r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT, 0, 0, 0, data,
+		sizeof(data), 1000);
+	if (r != 0) {
+		libusb_testlib_logf("Large control transfer failed: %d", r);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	complete_on_submit = 0;
+	libusb_sync_session_close(session);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that the backend can release retained transfer data whenever a
+ * transfer is freed, including when it goes back to the transfer pool. */
+static libusb_testlib_result test_free_transfer_priv(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfer;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_TRANSFER_POOL, 4);
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+
+	transfer_privs_freed = 0;
+	libusb_free_transfer(libusb_alloc_transfer(0));
+	if (transfer_privs_freed != 1) {
+		libusb_testlib_logf("Transfer data not released on free");
+		goto out;
+	}
+
+	transfer = libusb_alloc_pooled_transfer(ctx, 8);
+	libusb_free_transfer(transfer);
+	if (!transfer || transfer_privs_freed != 2) {
+		libusb_testlib_logf("Transfer data not released before pooling");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_exit(ctx);
+	return result;
+}
+
+#define COMPLETION_THREADS 4
+#define COMPLETION_TRANSFERS 256
+
+static void *submit_thread(void *arg)
+{
+	struct libusb_transfer **transfers = arg;
+	int i;
+
+	for (i = 0; i < COMPLETION_TRANSFERS; i++) {
+		if (libusb_submit_transfer(transfers[i]) != LIBUSB_SUCCESS)
+			return transfers[i];
+	}
+
+	return NULL;
+}
+
+/** Test that completions signalled together are handled in order by a
+ * single run of the event handler, and that completions signalled from
+ * several threads at once are all handled. */
+static libusb_testlib_result test_completion_queue(void)
+{
+	static struct libusb_transfer *transfers[COMPLETION_THREADS][COMPLETION_TRANSFERS];
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	pthread_t threads[COMPLETION_THREADS];
+	int started = 0, completed = 0, order = 0;
+	int i, j, r;
+
+	memset(transfers, 0, sizeof(transfers));
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	for (i = 0; i < COMPLETION_THREADS; i++) {
+		for (j = 0; j < COMPLETION_TRANSFERS; j++) {
+			transfers[i][j] = libusb_alloc_transfer(0);
+			if (!transfers[i][j])
+				goto out;
+			libusb_fill_bulk_transfer(transfers[i][j], handle, LIBUSB_ENDPOINT_IN,
+				NULL, 0, count_cb, &completed, 0);
+		}
+	}
+
+	complete_on_submit = 1;
+
+	/* the timeout identifies the transfer to order_cb */
+	for (j = 0; j < 5; j++) {
+		libusb_fill_bulk_transfer(transfers[0][j], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, order_cb, &order, 10 * ((unsigned int)j + 1));
+		r = libusb_submit_transfer(transfers[0][j]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", j, r);
+			goto out;
+		}
+	}
+
+	r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || order != 12345) {
+		libusb_testlib_logf("Completions handled out of order: %d", order);
+		goto out;
+	}
+
+	for (j = 0; j < 5; j++)
+		libusb_fill_bulk_transfer(transfers[0][j], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, count_cb, &completed, 0);
+
+	for (started = 0; started < COMPLETION_THREADS; started++) {
+		if (pthread_create(&threads[started], NULL, submit_thread, transfers[started])) {
+			libusb_testlib_logf("Failed to create thread");
+			goto out;
+		}
+	}
+
+	while (completed < COMPLETION_THREADS * COMPLETION_TRANSFERS) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	for (i = 0; i < started; i++) {
+		if (pthread_join(threads[i], NULL) == 0)
+			continue;
+		result = TEST_STATUS_FAILURE;
+	}
+	complete_on_submit = 0;
+	for (i = 0; i < COMPLETION_THREADS; i++) {
+		for (j = 0; j < COMPLETION_TRANSFERS; j++)
+			libusb_free_transfer(transfers[i][j]);
+	}
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that internal events raised while the event handler is already
+ * signalled do not signal it again. */
+static libusb_testlib_result test_signal_coalescing(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfer = NULL;
+	struct libusb_event_stats before, after;
+	int completed = 0;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		goto out;
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_IN,
+		NULL, 0, count_cb, &completed, 0);
+
+	/* let the event handler pick up the new device first */
+	r = libusb_handle_events_timeout(ctx, &(struct timeval) { 0, 0 });
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+
+	libusb_get_event_stats(ctx, &before);
+
+	/* the completion signals the event handler, the interruption finds it
+	 * signalled already */
+	complete_on_submit = 1;
+	r = libusb_submit_transfer(transfer);
+	complete_on_submit = 0;
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to submit transfer: %d", r);
+		goto out;
+	}
+	libusb_interrupt_event_handler(ctx);
+
+	libusb_get_event_stats(ctx, &after);
+	if (after.signals_issued - before.signals_issued != 1 ||
+	    after.signals_suppressed - before.signals_suppressed != 1) {
+		libusb_testlib_logf("Expected 1 signal issued and 1 suppressed, got %llu and %llu",
+			(unsigned long long)(after.signals_issued - before.signals_issued),
+			(unsigned long long)(after.signals_suppressed - before.signals_suppressed));
+		goto out;
+	}
+
+	while (!completed) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+
+	/* once the event handler has run, the next event signals it again */
+	libusb_interrupt_event_handler(ctx);
+	libusb_get_event_stats(ctx, &before);
+	if (before.signals_issued - after.signals_issued != 1) {
+		libusb_testlib_logf("Event handler not signalled after it ran");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that busy polling handles completions without waiting, and that
+ * fruitless spinning falls back to waiting. */
+static libusb_testlib_result test_busy_poll(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfer = NULL;
+	struct libusb_event_stats stats;
+	struct timeval tv = { 1, 0 };
+	uint64_t waits = 0;
+	int completed = 0;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL, -1) != LIBUSB_ERROR_INVALID_PARAM ||
+	    libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL_CPU_LIMIT, 101) != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Invalid busy poll options accepted");
+		goto out;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	/* let the event handler pick up the new device first */
+	r = libusb_handle_events_timeout(ctx, &(struct timeval) { 0, 0 });
+	if (r != LIBUSB_SUCCESS)
+		goto out;
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		goto out;
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_IN,
+		NULL, 0, count_cb, &completed, 0);
+
+	/* the window is far longer than the spin needs, the timeout is
+	 * longer still, so the completion can only come from spinning */
+	r = libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL, 100000);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to submit transfer: %d", r);
+		goto out;
+	}
+
+	busy_poll_countdown = 3;
+	r = libusb_handle_events_timeout_completed(ctx, &tv, &completed);
+	if (r != LIBUSB_SUCCESS || !completed || busy_poll_countdown) {
+		libusb_testlib_logf("Completion not handled by spinning");
+		goto out;
+	}
+
+	libusb_get_event_stats(ctx, &stats);
+	for (i = 0; i < LIBUSB_EVENT_WAIT_BUCKETS; i++)
+		waits += stats.wait_histogram[i];
+	if (stats.busy_polls != 1 || stats.busy_poll_hits != 1 ||
+	    !stats.busy_poll_ns || waits != 1) {
+		libusb_testlib_logf("Unexpected busy poll statistics");
+		goto out;
+	}
+
+	/* with nothing to reap, spinning gives up after the window and the
+	 * event handler waits for the rest of the timeout */
+	r = libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL, 1000);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events_timeout(ctx, &(struct timeval) { 0, 10000 });
+	libusb_get_event_stats(ctx, &stats);
+	if (r != LIBUSB_SUCCESS || stats.busy_polls != 2 || stats.busy_poll_hits != 1) {
+		libusb_testlib_logf("Fruitless spinning did not fall back to waiting");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	busy_poll_countdown = 0;
+	libusb_free_transfer(transfer);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+#define EXECUTOR_MAX_TASKS 8
+
+struct executor_state {
+	int num_tasks;
+	int num_run;
+	libusb_task_fn run[EXECUTOR_MAX_TASKS];
+	void *task[EXECUTOR_MAX_TASKS];
+};
+
+static void run_tasks(struct executor_state *state)
+{
+	while (state->num_run < MIN(state->num_tasks, EXECUTOR_MAX_TASKS)) {
+		state->run[state->num_run](state->task[state->num_run]);
+		state->num_run++;
+	}
+}
+
+/* Runs a single task in a thread of its own after a delay */
+struct delayed_task {
+	pthread_t thread;
+	libusb_task_fn run;
+	void *task;
+};
+
+static void *delayed_task_main(void *arg)
+{
+	struct delayed_task *delayed = arg;
+	struct timespec delay = { 0, 20000000 };
+
+	nanosleep(&delay, NULL);
+	delayed->run(delayed->task);
+	return NULL;
+}
+
+static void LIBUSB_CALL thread_executor(libusb_context *ctx, libusb_task_fn run,
+	void *task, void *user_data)
+{
+	struct delayed_task *delayed = user_data;
+
+	UNUSED(ctx);
+
+	delayed->run = run;
+	delayed->task = task;
+	if (pthread_create(&delayed->thread, NULL, delayed_task_main, delayed))
+		run(task);
+}
+
+static void LIBUSB_CALL queue_executor(libusb_context *ctx, libusb_task_fn run,
+	void *task, void *user_data)
+{
+	struct executor_state *state = user_data;
+
+	UNUSED(ctx);
+
+	if (state->num_tasks < EXECUTOR_MAX_TASKS) {
+		state->run[state->num_tasks] = run;
+		state->task[state->num_tasks] = task;
+	}
+	state->num_tasks++;
+}
+
+static void LIBUSB_CALL endpoint_order_cb(struct libusb_transfer *transfer)
+{
+	int *order = transfer->user_data;
+
+	*order = (*order * 10) + (int)transfer->timeout;
+}
+
+/** Test that deferred callbacks are handed to the executor with one task
+ * per endpoint, and that a task runs them in completion order. */
+static libusb_testlib_result test_executor(void)
+{
+	static const unsigned char endpoints[] = { 0x81, 0x81, 0x02, 0x81, 0x81 };
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfers[5] = { NULL };
+	struct executor_state state = { 0 };
+	struct delayed_task delayed = { 0 };
+	int in_order = 0, out_order = 0;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	libusb_set_executor(ctx, queue_executor, &state);
+	complete_on_submit = 1;
+
+	/* the timeout identifies the transfer to endpoint_order_cb */
+	for (i = 0; i < 5; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			goto out;
+		libusb_fill_bulk_transfer(transfers[i], handle, endpoints[i], NULL, 0,
+			endpoint_order_cb, (endpoints[i] & LIBUSB_ENDPOINT_IN) ? &in_order : &out_order,
+			(unsigned int)i + 1);
+		transfers[i]->flags = LIBUSB_TRANSFER_DEFER_CALLBACK;
+	}
+
+	for (i = 0; i < 4; i++) {
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", i, r);
+			goto out;
+		}
+	}
+
+	r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || in_order || out_order) {
+		libusb_testlib_logf("Deferred callbacks ran in the event handler");
+		goto out;
+	}
+	if (state.num_tasks != 2) {
+		libusb_testlib_logf("Expected 2 tasks, got %d", state.num_tasks);
+		goto out;
+	}
+
+	/* a completion on an endpoint whose task has yet to run joins it */
+	r = libusb_submit_transfer(transfers[4]);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || state.num_tasks != 2) {
+		libusb_testlib_logf("Completion on a scheduled endpoint was given a new task");
+		goto out;
+	}
+
+	run_tasks(&state);
+	if (in_order != 1245 || out_order != 3) {
+		libusb_testlib_logf("Deferred callbacks ran out of order: %d %d",
+			in_order, out_order);
+		goto out;
+	}
+
+	/* once its task has run, the endpoint gets a new one */
+	r = libusb_submit_transfer(transfers[2]);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || state.num_tasks != 3) {
+		libusb_testlib_logf("Idle endpoint was not given a new task");
+		goto out;
+	}
+	run_tasks(&state);
+
+	/* without the flag, callbacks run in the event handler */
+	transfers[2]->flags = 0;
+	r = libusb_submit_transfer(transfers[2]);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || state.num_tasks != 3 || out_order != 333) {
+		libusb_testlib_logf("Callback without the flag was deferred");
+		goto out;
+	}
+
+	/* closing the handle waits for a task that is still with the executor */
+	libusb_set_executor(ctx, thread_executor, &delayed);
+	transfers[2]->flags = LIBUSB_TRANSFER_DEFER_CALLBACK;
+	out_order = 0;
+	r = libusb_submit_transfer(transfers[2]);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || !delayed.run) {
+		libusb_testlib_logf("Deferred callback was not handed to the executor");
+		goto out;
+	}
+	libusb_close(handle);
+	handle = NULL;
+	pthread_join(delayed.thread, NULL);
+	if (out_order != 3) {
+		libusb_testlib_logf("Handle closed before its deferred callback ran");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	complete_on_submit = 0;
+	/* tasks still queued would keep libusb_close() waiting */
+	run_tasks(&state);
+	for (i = 0; i < 5; i++)
+		libusb_free_transfer(transfers[i]);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+struct sync_io_state {
+	libusb_device_handle *handle;
+	int result;
+};
+
+static void LIBUSB_CALL sync_io_cb(struct libusb_transfer *transfer)
+{
+	struct sync_io_state *sync_io = transfer->user_data;
+	int transferred;
+
+	sync_io->result = libusb_bulk_transfer(sync_io->handle, 0x02, NULL, 0,
+		&transferred, 1000);
+}
+
+/** Test that a deferred callback can do synchronous I/O on another handle
+ * while libusb_close() waits for it. */
+static libusb_testlib_result test_executor_close(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfer = NULL;
+	struct delayed_task delayed = { 0 };
+	struct sync_io_state sync_io = { NULL, 1 };
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_wrap_sys_device(ctx, 2, &sync_io.handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		goto out;
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, NULL, 0, sync_io_cb,
+		&sync_io, 1000);
+	transfer->flags = LIBUSB_TRANSFER_DEFER_CALLBACK;
+
+	libusb_set_executor(ctx, thread_executor, &delayed);
+	complete_on_submit = 1;
+
+	r = libusb_submit_transfer(transfer);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || !delayed.run) {
+		libusb_testlib_logf("Deferred callback was not handed to the executor");
+		goto out;
+	}
+
+	/* the callback handles the events of its synchronous transfer itself */
+	libusb_close(handle);
+	handle = NULL;
+	pthread_join(delayed.thread, NULL);
+	if (sync_io.result != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Synchronous I/O from a deferred callback failed: %d",
+			sync_io.result);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	complete_on_submit = 0;
+	libusb_free_transfer(transfer);
+	if (handle)
+		libusb_close(handle);
+	if (sync_io.handle)
+		libusb_close(sync_io.handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that transfers completing in timeout order do not rearm the timer
+ * for every completion. */
+static libusb_testlib_result test_timer_updates(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfers[100] = { NULL };
+	struct libusb_event_stats before, after;
+	int completed = 0;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	libusb_get_event_stats(ctx, &before);
+
+	for (i = 0; i < 100; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			goto out;
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, count_cb, &completed, 10000);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", i, r);
+			goto out;
+		}
+	}
+
+	/* complete the transfers oldest first, as a stream would */
+	for (i = 0; i < 100; i++) {
+		r = libusb_cancel_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to cancel transfer %d: %d", i, r);
+			goto out;
+		}
+	}
+	while (completed < 100) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+
+	/* the timer is armed once for the first transfer and left alone */
+	libusb_get_event_stats(ctx, &after);
+	if (after.timer_updates - before.timer_updates > 1) {
+		libusb_testlib_logf("Timer updated %llu times for 100 transfers",
+			(unsigned long long)(after.timer_updates - before.timer_updates));
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	for (i = 0; i < 100; i++)
+		libusb_free_transfer(transfers[i]);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that earlier timeouts within the timer slack share the armed timer
+ * expiry, and that the slack delays timeouts by no more than itself. */
+static libusb_testlib_result test_timer_slack(void)
+{
+	static const unsigned int timeouts[] = { 1000, 980, 900, 50 };
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfers[4] = { NULL };
+	struct libusb_event_stats before, after;
+	struct timespec start;
+	long elapsed;
+	int completed = 0;
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_set_option(ctx, LIBUSB_OPTION_TIMER_SLACK, -1) != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Negative timer slack accepted");
+		goto out;
+	}
+	r = libusb_set_option(ctx, LIBUSB_OPTION_TIMER_SLACK, 50);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to set timer slack: %d", r);
+		goto out;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	usbi_get_monotonic_time(&start);
+	for (i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			goto out;
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN,
+			NULL, 0, count_cb, &completed, timeouts[i]);
+		libusb_get_event_stats(ctx, &before);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", i, r);
+			goto out;
+		}
+		libusb_get_event_stats(ctx, &after);
+
+#ifdef HAVE_OS_TIMER
+		/* only the first timeout and those earlier by more than the
+		 * slack arm the timer */
+		if (after.timer_updates - before.timer_updates != (i != 1)) {
+			libusb_testlib_logf("Transfer %d updated the timer %llu times", i,
+				(unsigned long long)(after.timer_updates - before.timer_updates));
+			goto out;
+		}
+#endif
+	}
+
+	/* the shortest timeout expires, late by at most the slack */
+	while (!completed) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	elapsed = elapsed_ns(&start);
+	if (elapsed < 50 * 1000000L || elapsed > 500 * 1000000L ||
+	    transfers[3]->status != LIBUSB_TRANSFER_TIMED_OUT) {
+		libusb_testlib_logf("Short timeout expired after %ldms", elapsed / 1000000L);
+		goto out;
+	}
+
+	for (i = 0; i < 3; i++) {
+		r = libusb_cancel_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to cancel transfer %d: %d", i, r);
+			goto out;
+		}
+	}
+	while (completed < 4) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS)
+			goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	for (i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that a composite configuration descriptor parses into the expected
+ * tree, with the extra descriptors attached at each level. */
+static libusb_testlib_result test_config_descriptor(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_config_descriptor *config = NULL;
+	const struct libusb_interface_descriptor *alt;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	r = libusb_get_config_descriptor(libusb_get_device(handle), 0, &config);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to get config descriptor: %d", r);
+		goto out;
+	}
+
+	if (config->wTotalLength != sizeof(mock_config) || config->bNumInterfaces != 2 ||
+	    config->extra_length != 8 || config->extra[1] != LIBUSB_DT_INTERFACE_ASSOCIATION) {
+		libusb_testlib_logf("Unexpected config descriptor");
+		goto out;
+	}
+
+	if (config->interface[0].num_altsetting != 2 ||
+	    config->interface[1].num_altsetting != 1) {
+		libusb_testlib_logf("Unexpected altsettings");
+		goto out;
+	}
+
+	alt = &config->interface[0].altsetting[0];
+	if (alt->extra_length != 5 || alt->extra[1] != 0x24 || alt->bNumEndpoints != 1 ||
+	    alt->endpoint[0].wMaxPacketSize != 8 || alt->endpoint[0].extra) {
+		libusb_testlib_logf("Unexpected interface 0 altsetting 0");
+		goto out;
+	}
+
+	alt = &config->interface[0].altsetting[1];
+	if (alt->bAlternateSetting != 1 || alt->extra ||
+	    alt->endpoint[0].wMaxPacketSize != 64) {
+		libusb_testlib_logf("Unexpected interface 0 altsetting 1");
+		goto out;
+	}
+
+	alt = &config->interface[1].altsetting[0];
+	if (alt->bNumEndpoints != 2 || alt->endpoint[0].bEndpointAddress != 0x82 ||
+	    alt->endpoint[0].extra_length != 6 ||
+	    alt->endpoint[0].extra[1] != LIBUSB_DT_SS_ENDPOINT_COMPANION ||
+	    alt->endpoint[1].bEndpointAddress != 0x02 || alt->endpoint[1].extra) {
+		libusb_testlib_logf("Unexpected interface 1");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_config_descriptor(config);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that parsed configuration descriptors are shared until the
+ * configuration is set again, and stay valid for their holders after. A
+ * configuration changed outside of libusb is picked up once
+ * libusb_get_configuration() reads it. */
+static libusb_testlib_result test_config_cache(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_config_descriptor *active = NULL, *again = NULL;
+	struct libusb_config_descriptor *by_index = NULL, *by_value = NULL;
+	libusb_device *dev;
+	int config = -1;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+	dev = libusb_get_device(handle);
+
+	if (libusb_get_active_config_descriptor(dev, &active) != LIBUSB_SUCCESS ||
+	    libusb_get_active_config_descriptor(dev, &again) != LIBUSB_SUCCESS ||
+	    libusb_get_config_descriptor(dev, 0, &by_index) != LIBUSB_SUCCESS ||
+	    libusb_get_config_descriptor_by_value(dev, 1, &by_value) != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to get config descriptors");
+		goto out;
+	}
+
+	if (again != active || by_value != by_index) {
+		libusb_testlib_logf("Config descriptors not shared");
+		goto out;
+	}
+	libusb_free_config_descriptor(again);
+	again = NULL;
+
+	/* setting the configuration drops the cache, not the descriptors */
+	r = libusb_set_configuration(handle, 1);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to set configuration: %d", r);
+		goto out;
+	}
+	r = libusb_get_active_config_descriptor(dev, &again);
+	if (r != LIBUSB_SUCCESS || again == active ||
+	    active->interface[1].altsetting[0].endpoint[0].wMaxPacketSize != 1024) {
+		libusb_testlib_logf("Config descriptor cache not refreshed");
+		goto out;
+	}
+
+	if (libusb_get_max_packet_size(dev, 0x82) != 1024) {
+		libusb_testlib_logf("Unexpected max packet size");
+		goto out;
+	}
+	libusb_free_config_descriptor(again);
+	again = NULL;
+
+	/* the configuration changes behind the back of libusb */
+	mock_active_config = 2;
+	r = libusb_get_configuration(handle, &config);
+	if (r != LIBUSB_SUCCESS || config != 2) {
+		libusb_testlib_logf("Unexpected configuration %d: %d", config, r);
+		goto out;
+	}
+	r = libusb_get_active_config_descriptor(dev, &again);
+	if (r != LIBUSB_SUCCESS || again->bConfigurationValue != 2 ||
+	    libusb_get_max_packet_size(dev, 0x82) != 512) {
+		libusb_testlib_logf("Changed configuration not picked up");
+		goto out;
+	}
+	libusb_free_config_descriptor(again);
+	again = NULL;
+
+	/* an unconfigured device has no active configuration descriptor */
+	mock_active_config = 0;
+	r = libusb_get_configuration(handle, &config);
+	if (r != LIBUSB_SUCCESS || config != 0) {
+		libusb_testlib_logf("Unexpected configuration %d: %d", config, r);
+		goto out;
+	}
+	r = libusb_get_active_config_descriptor(dev, &again);
+	if (r != LIBUSB_ERROR_NOT_FOUND) {
+		libusb_testlib_logf("Unconfigured device returned %d", r);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	mock_active_config = 1;
+	libusb_free_config_descriptor(active);
+	libusb_free_config_descriptor(again);
+	libusb_free_config_descriptor(by_index);
+	libusb_free_config_descriptor(by_value);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test walking the raw configuration descriptors in place, and the
+ * endpoint lookups built on it. */
+static libusb_testlib_result test_descriptor_iterator(void)
+{
+	static const struct {
+		unsigned char type;
+		int interface_index;
+		int altsetting_index;
+	} expected[] = {
+		{ LIBUSB_DT_CONFIG, -1, -1 },
+		{ LIBUSB_DT_INTERFACE_ASSOCIATION, -1, -1 },
+		{ LIBUSB_DT_INTERFACE, 0, 0 },
+		{ 0x24, 0, 0 },
+		{ LIBUSB_DT_ENDPOINT, 0, 0 },
+		{ LIBUSB_DT_INTERFACE, 0, 1 },
+		{ LIBUSB_DT_ENDPOINT, 0, 1 },
+		{ LIBUSB_DT_INTERFACE, 1, 0 },
+		{ LIBUSB_DT_ENDPOINT, 1, 0 },
+		{ LIBUSB_DT_SS_ENDPOINT_COMPANION, 1, 0 },
+		{ LIBUSB_DT_ENDPOINT, 1, 0 },
+	};
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_descriptor_iterator iter;
+	const unsigned char *data, *desc;
+	libusb_device *dev;
+	size_t i;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+	dev = libusb_get_device(handle);
+
+	r = libusb_get_raw_active_config_descriptor(dev, &data);
+	if (r != (int)sizeof(mock_config) || data != mock_config) {
+		libusb_testlib_logf("Raw config descriptor not returned in place: %d", r);
+		goto out;
+	}
+
+	libusb_descriptor_iterator_init(&iter, data, r);
+	for (i = 0; i < ARRAYSIZE(expected); i++) {
+		r = libusb_descriptor_iterator_next(&iter, &desc);
+		if (r != 1 || desc[1] != expected[i].type ||
+		    iter.interface_index != expected[i].interface_index ||
+		    iter.altsetting_index != expected[i].altsetting_index) {
+			libusb_testlib_logf("Unexpected descriptor %zu: %d", i, r);
+			goto out;
+		}
+	}
+	if (libusb_descriptor_iterator_next(&iter, &desc) != 0) {
+		libusb_testlib_logf("Iterator did not stop at the end");
+		goto out;
+	}
+
+	libusb_descriptor_iterator_init(&iter, data, (int)sizeof(mock_config));
+	if (libusb_descriptor_iterator_find(&iter, LIBUSB_DT_SS_ENDPOINT_COMPANION, &desc) != 1 ||
+	    desc[2] != 0x0f ||
+	    libusb_descriptor_iterator_find(&iter, LIBUSB_DT_SS_ENDPOINT_COMPANION, &desc) != 0) {
+		libusb_testlib_logf("Failed to find the endpoint companion");
+		goto out;
+	}
+
+	/* the interface descriptor runs past the end of the data */
+	libusb_descriptor_iterator_init(&iter, data, 20);
+	if (libusb_descriptor_iterator_next(&iter, &desc) != 1 ||
+	    libusb_descriptor_iterator_next(&iter, &desc) != 1 ||
+	    libusb_descriptor_iterator_next(&iter, &desc) != LIBUSB_ERROR_IO) {
+		libusb_testlib_logf("Truncated descriptor not detected");
+		goto out;
+	}
+
+	if (libusb_get_max_packet_size(dev, 0x81) != 8 ||
+	    libusb_get_max_alt_packet_size(dev, 0, 1, 0x81) != 64 ||
+	    libusb_get_max_alt_packet_size(dev, 1, 0, 0x81) != LIBUSB_ERROR_NOT_FOUND ||
+	    libusb_get_max_iso_packet_size(dev, 0x82) != 1024) {
+		libusb_testlib_logf("Unexpected max packet sizes");
+		goto out;
+	}
+
+	/* SuperSpeed devices report wBytesPerInterval from the companion */
+	dev->speed = LIBUSB_SPEED_SUPER;
+	if (libusb_get_max_iso_packet_size(dev, 0x82) != 4096 ||
+	    libusb_get_max_iso_packet_size(dev, 0x02) != 1024) {
+		libusb_testlib_logf("Unexpected SuperSpeed max packet sizes");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Test that the endpoint table is built once, serves all the max packet
+ * size queries and is rebuilt after the configuration is set, or found to
+ * have changed by libusb_get_configuration(). */
+static libusb_testlib_result test_endpoint_table(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct usbi_endpoint_table *table;
+	libusb_device *dev;
+	int config = -1;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+	dev = libusb_get_device(handle);
+
+	if (dev->endpoint_table) {
+		libusb_testlib_logf("Endpoint table built before use");
+		goto out;
+	}
+
+	if (libusb_get_max_packet_size(dev, 0x82) != 1024) {
+		libusb_testlib_logf("Unexpected max packet size");
+		goto out;
+	}
+	table = dev->endpoint_table;
+	if (!table || table->bConfigurationValue != 1 ||
+	    table->first[USBI_ENDPOINT_SLOTS] != 4 ||
+	    table->first[usbi_endpoint_slot(0x81) + 1] -
+	    table->first[usbi_endpoint_slot(0x81)] != 2) {
+		libusb_testlib_logf("Unexpected endpoint table");
+		goto out;
+	}
+
+	if (libusb_get_max_alt_packet_size(dev, 0, 1, 0x81) != 64 ||
+	    libusb_get_max_alt_packet_size(dev, 0, 2, 0x81) != LIBUSB_ERROR_NOT_FOUND ||
+	    libusb_get_max_alt_packet_size(dev, -1, 0, 0x81) != LIBUSB_ERROR_NOT_FOUND ||
+	    libusb_get_max_packet_size(dev, 0x83) != LIBUSB_ERROR_NOT_FOUND ||
+	    libusb_get_max_packet_size(dev, 0x92) != LIBUSB_ERROR_NOT_FOUND ||
+	    dev->endpoint_table != table) {
+		libusb_testlib_logf("Endpoint table not reused");
+		goto out;
+	}
+
+	r = libusb_set_configuration(handle, 1);
+	if (r != LIBUSB_SUCCESS || dev->endpoint_table) {
+		libusb_testlib_logf("Endpoint table not dropped: %d", r);
+		goto out;
+	}
+
+	if (libusb_get_max_iso_packet_size(dev, 0x81) != 8 || !dev->endpoint_table) {
+		libusb_testlib_logf("Endpoint table not rebuilt");
+		goto out;
+	}
+
+	/* the configuration changes behind the back of libusb */
+	mock_active_config = 2;
+	r = libusb_get_configuration(handle, &config);
+	if (r != LIBUSB_SUCCESS || config != 2 || dev->endpoint_table) {
+		libusb_testlib_logf("Endpoint table not dropped on change: %d", r);
+		goto out;
+	}
+	if (libusb_get_max_packet_size(dev, 0x82) != 512 ||
+	    libusb_get_max_packet_size(dev, 0x81) != LIBUSB_ERROR_NOT_FOUND) {
+		libusb_testlib_logf("Changed configuration not picked up");
+		goto out;
+	}
+
+	/* as before the table, an unconfigured device has no endpoints */
+	mock_active_config = 0;
+	r = libusb_get_configuration(handle, &config);
+	if (r != LIBUSB_SUCCESS || config != 0 ||
+	    libusb_get_max_packet_size(dev, 0x82) != LIBUSB_ERROR_OTHER) {
+		libusb_testlib_logf("Unconfigured device has endpoints");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	mock_active_config = 1;
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+struct stream_state {
+	int callbacks;
+	int errors;
+	uint32_t min_active;
+};
+
+static void LIBUSB_CALL stream_cb(libusb_stream *stream,
+	struct libusb_transfer *transfer, void *user_data)
+{
+	struct stream_state *state = user_data;
+	struct libusb_stream_stats stats;
+
+	state->callbacks++;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		state->errors++;
+	if (libusb_stream_get_stats(stream, &stats) == LIBUSB_SUCCESS &&
+	    stats.active < state->min_active)
+		state->min_active = stats.active;
+}
+
+/** Test that a stream keeps all its transfers queued while the callback
+ * runs, and that closing it cancels queued transfers. */
+static libusb_testlib_result test_stream(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_stream *stream = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_stream_stats stats;
+	struct stream_state state = { 0, 0, UINT32_MAX };
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	complete_on_submit = 1;
+	r = libusb_stream_open(handle, LIBUSB_ENDPOINT_IN | 1,
+		LIBUSB_TRANSFER_TYPE_BULK, 4, 512, stream_cb, &state, &stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to open stream: %d", r);
+		goto out;
+	}
+
+	while (state.callbacks < 20) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	complete_on_submit = 0;
+
+	r = libusb_stream_get_stats(stream, &stats);
+	if (r != LIBUSB_SUCCESS || stats.transfers != (uint64_t)state.callbacks ||
+	    stats.errors || stats.submit_errors) {
+		libusb_testlib_logf("Unexpected stream statistics");
+		goto out;
+	}
+	if (state.min_active != 4 || state.errors) {
+		libusb_testlib_logf("Stream ran with %u transfers queued, %d errors",
+			state.min_active, state.errors);
+		goto out;
+	}
+
+	r = libusb_stream_close(stream);
+	stream = NULL;
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to close stream: %d", r);
+		goto out;
+	}
+
+	/* transfers cancelled by closing are not passed to the callback */
+	state.callbacks = 0;
+	r = libusb_stream_open(handle, LIBUSB_ENDPOINT_IN | 1,
+		LIBUSB_TRANSFER_TYPE_BULK, 4, 512, stream_cb, &state, &stream);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_stream_close(stream);
+	stream = NULL;
+	if (r != LIBUSB_SUCCESS || state.callbacks) {
+		libusb_testlib_logf("Closing an idle stream returned %d with %d callbacks",
+			r, state.callbacks);
+		goto out;
+	}
+
+	/* OUT streams must not send uninitialized memory */
+	r = libusb_stream_open(handle, LIBUSB_ENDPOINT_OUT | 2,
+		LIBUSB_TRANSFER_TYPE_BULK, 4, 512, stream_cb, &state, &stream);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to open OUT stream: %d", r);
+		goto out;
+	}
+	for (i = 0; i < 512; i++) {
+		if (last_buffer[i]) {
+			libusb_testlib_logf("OUT stream buffer not zeroed at %d", i);
+			goto out;
+		}
+	}
+	r = libusb_stream_close(stream);
+	stream = NULL;
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to close OUT stream: %d", r);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	complete_on_submit = 0;
+	libusb_stream_close(stream);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+struct stream_open_state {
+	struct stream_state stream;
+	int result;
+};
+
+static void LIBUSB_CALL open_stream_cb(struct libusb_transfer *transfer)
+{
+	struct stream_open_state *state = transfer->user_data;
+	libusb_stream *stream = NULL;
+
+	limit_submissions = 1;
+	submissions_left = 2;
+	state->result = libusb_stream_open(transfer->dev_handle,
+		LIBUSB_ENDPOINT_IN | 1, LIBUSB_TRANSFER_TYPE_BULK, 4, 512, stream_cb,
+		&state->stream, &stream);
+	limit_submissions = 0;
+}
+
+/** Test that a stream whose transfers could only partly be submitted from
+ * event handling context winds down without further callbacks. */
+static libusb_testlib_result test_stream_open_failure(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfer = NULL;
+	struct stream_open_state state = { { 0, 0, UINT32_MAX }, 0 };
+	int i, r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_wrap_sys_device(ctx, 1, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to wrap mock device: %d", r);
+		goto out;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		goto out;
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_OUT | 2, NULL,
+		0, open_stream_cb, &state, 1000);
+
+	/* open the stream from a transfer callback, where it cannot wait */
+	complete_on_submit = 1;
+	r = libusb_submit_transfer(transfer);
+	complete_on_submit = 0;
+	transfer_privs_freed = 0;
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_handle_events(ctx);
+	if (r != LIBUSB_SUCCESS || state.result != LIBUSB_ERROR_IO) {
+		libusb_testlib_logf("Opening a stream with rejected transfers returned %d",
+			state.result);
+		goto out;
+	}
+
+	/* the two queued transfers were cancelled, the last of them frees
+	 * all five transfers of the stream */
+	for (i = 0; i < 10 && transfer_privs_freed < 5; i++) {
+		struct timeval tv = { 0, 100000 };
+
+		r = libusb_handle_events_timeout(ctx, &tv);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to handle events: %d", r);
+			goto out;
+		}
+	}
+	if (transfer_privs_freed != 5 || state.stream.callbacks) {
+		libusb_testlib_logf("Failed stream freed %d transfers and passed %d to the callback",
+			transfer_privs_freed, state.stream.callbacks);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	complete_on_submit = 0;
+	libusb_free_transfer(transfer);
+	if (handle)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "submit_scaling", &test_submit_scaling },
+	{ "timeout_order", &test_timeout_order },
+	{ "close_in_flight", &test_close_in_flight },
+	{ "submit_batch", &test_submit_batch },
+	{ "transfer_buffers", &test_transfer_buffers },
+	{ "sync_session", &test_sync_session },
+	{ "stream", &test_stream },
+	{ "stream_open_failure", &test_stream_open_failure },
+	{ "free_transfer_priv", &test_free_transfer_priv },
+	{ "completion_queue", &test_completion_queue },
+	{ "signal_coalescing", &test_signal_coalescing },
+	{ "busy_poll", &test_busy_poll },
+	{ "executor", &test_executor },
+	{ "executor_close", &test_executor_close },
+	{ "timer_updates", &test_timer_updates },
+	{ "timer_slack", &test_timer_slack },
+	{ "config_descriptor", &test_config_descriptor },
+	{ "config_cache", &test_config_cache },
+	{ "descriptor_iterator", &test_descriptor_iterator },
+	{ "endpoint_table", &test_endpoint_table },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
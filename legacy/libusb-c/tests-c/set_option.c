@@ -237,10 +237,95 @@ static libusb_testlib_result test_set_log_cb(void)
 #endif
 }
 
+static libusb_testlib_result test_transfer_pool(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_transfer_pool_stats stats;
+  struct libusb_transfer *transfer, *recycled;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_TRANSFER_POOL, .value = { .ival = 1 } },
+  };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_transfer_pool_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.limit, 1);
+  LIBUSB_EXPECT(==, stats.retained, 0);
+
+  /* the first allocation can only miss, freeing it fills the pool */
+  transfer = libusb_alloc_pooled_transfer(test_ctx, 0);
+  LIBUSB_EXPECT(!=, transfer, NULL);
+  transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
+  libusb_free_transfer(transfer);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_transfer_pool_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.misses, 1);
+  LIBUSB_EXPECT(==, stats.retained, 1);
+
+  /* the same allocation comes back reset */
+  recycled = libusb_alloc_pooled_transfer(test_ctx, 0);
+  LIBUSB_EXPECT(==, recycled, transfer);
+  LIBUSB_EXPECT(==, recycled->flags, 0);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_transfer_pool_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.hits, 1);
+  LIBUSB_EXPECT(==, stats.retained, 0);
+
+  /* a different size class misses, and the pool only retains one transfer */
+  transfer = libusb_alloc_pooled_transfer(test_ctx, 4);
+  LIBUSB_EXPECT(!=, transfer, NULL);
+  libusb_free_transfer(recycled);
+  libusb_free_transfer(transfer);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_transfer_pool_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.misses, 2);
+  LIBUSB_EXPECT(==, stats.overflows, 1);
+  LIBUSB_EXPECT(==, stats.retained, 1);
+
+  /* disabling the pool releases what it retains */
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx,
+                                                LIBUSB_OPTION_TRANSFER_POOL, 0));
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_transfer_pool_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.retained, 0);
+
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_TRANSFER_POOL, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_reap_budget(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_event_stats stats;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_REAP_BUDGET, .value = { .ival = 64 } },
+  };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_event_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.reap_budget, 64);
+  LIBUSB_EXPECT(==, stats.reaps, 0);
+  LIBUSB_EXPECT(==, stats.max_reaps_per_wakeup, 0);
+
+  /* 0 restores the default */
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx,
+                                                LIBUSB_OPTION_REAP_BUDGET, 0));
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_event_stats(test_ctx, &stats));
+  LIBUSB_EXPECT(==, stats.reap_budget, 25);
+
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_REAP_BUDGET, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_get_event_stats(test_ctx, NULL),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
 static const libusb_testlib_test tests[] = {
   { "test_set_log_level_basic", &test_set_log_level_basic },
   { "test_set_log_level_env", &test_set_log_level_env },
   { "test_no_discovery", &test_no_discovery },
+  { "test_transfer_pool", &test_transfer_pool },
+  { "test_reap_budget", &test_reap_budget },
   /* since default options can't be unset, run this one last */
   { "test_set_log_level_default", &test_set_log_level_default },
   { "test_set_log_cb", &test_set_log_cb },
@@ -88,6 +88,7 @@ typedef struct {
 	UsbChat *chat;
 	GList *flying_urbs;
 	GList *discarded_urbs;
+	int reap_ioctls;
 
 	/* GMutex confuses TSan unnecessarily */
 	pthread_mutex_t mutex;
@@ -329,6 +330,8 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 		g_autoptr(UMockdevIoctlData) urb_ptr = NULL;
 		g_autoptr(UMockdevIoctlData) urb_data = NULL;
 
+		fixture->reap_ioctls += 1;
+
 		if (fixture->discarded_urbs) {
 			urb_data = fixture->discarded_urbs->data;
 			urb = (struct usbdevfs_urb*) urb_data->data;
@@ -955,6 +958,274 @@ test_threaded_submit(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 	g_free (c);
 }
 
+static void
+test_reap_syscalls(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+		},
+		{
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+		},
+		{ .submit = FALSE }
+	};
+	unsigned char buffer[4];
+	int completed = 0;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer,
+				  handle,
+				  LIBUSB_ENDPOINT_IN,
+				  buffer,
+				  sizeof(buffer),
+				  transfer_cb_inc_user_data,
+				  &completed,
+				  0);
+
+	fixture->reap_ioctls = 0;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfer->actual_length, ==, 4);
+
+	/* The only URB in flight was reaped, so there is no reap that would
+	 * fail with EAGAIN. */
+	g_assert_cmpint(fixture->reap_ioctls, ==, 1);
+
+	/* Nothing is reaped while no URBs are in flight */
+	g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &(struct timeval) { 0 }), ==, 0);
+	g_assert_cmpint(fixture->reap_ioctls, ==, 1);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+}
+
+#define REAP_BUDGET 40
+#define REAP_BUDGET_URBS 100
+
+static void LIBUSB_CALL
+transfer_cb_check_order(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+
+	/* Each buffer holds the index of its URB */
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(*(int*)transfer->buffer, ==, *completed);
+	*completed += 1;
+}
+
+static void
+test_reap_budget(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	struct libusb_transfer *transfers[REAP_BUDGET_URBS];
+	struct libusb_event_stats stats;
+	libusb_device_handle *handle = NULL;
+	int completed = 0;
+	UsbChat *c;
+
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_REAP_BUDGET, REAP_BUDGET), ==, 0);
+
+	/* All URBs are submitted first and then complete in order, more than
+	 * a budget and more than a reap batch of them */
+	c = fixture->chat = g_new0(UsbChat, REAP_BUDGET_URBS * 2 + 1);
+	for (int i = 0; i < REAP_BUDGET_URBS; i++) {
+		c[i].submit = TRUE;
+		c[i].reaps = &c[REAP_BUDGET_URBS + i];
+		c[i].type = USBDEVFS_URB_TYPE_BULK;
+		c[i].endpoint = LIBUSB_ENDPOINT_IN;
+		c[i].buffer_length = sizeof(int);
+
+		c[REAP_BUDGET_URBS + i].reap = TRUE;
+		c[REAP_BUDGET_URBS + i].actual_length = sizeof(int);
+		c[REAP_BUDGET_URBS + i].buffer = (unsigned char*) g_new0(int, 1);
+		*(int*) c[REAP_BUDGET_URBS + i].buffer = i;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < REAP_BUDGET_URBS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i],
+					  handle,
+					  LIBUSB_ENDPOINT_IN,
+					  g_malloc(sizeof(int)),
+					  sizeof(int),
+					  transfer_cb_check_order,
+					  &completed,
+					  0);
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	fixture->libusb_log_silence = TRUE;
+
+	/* A wakeup stops at the budget and leaves the rest pending */
+	g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &(struct timeval) { 0 }), ==, 0);
+	g_assert_cmpint(completed, ==, REAP_BUDGET);
+
+	while (completed < REAP_BUDGET_URBS)
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &(struct timeval) { 0 }), ==, 0);
+
+	fixture->libusb_log_silence = FALSE;
+
+	/* Wakeups reaped 40, 40 and 20 URBs, the last one emptying the device */
+	g_assert_cmpint(libusb_get_event_stats(fixture->ctx, &stats), ==, 0);
+	g_assert_cmpuint(stats.reaps, ==, REAP_BUDGET_URBS);
+	g_assert_cmpuint(stats.budget_exhausted, ==, 2);
+	g_assert_cmpuint(stats.max_reaps_per_wakeup, ==, REAP_BUDGET);
+	g_assert_cmpuint(stats.reap_budget, ==, REAP_BUDGET);
+
+	for (int i = 0; i < REAP_BUDGET_URBS; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+
+	fixture->chat = NULL;
+	for (int i = 0; i < REAP_BUDGET_URBS; i++)
+		g_free((void*) c[REAP_BUDGET_URBS + i].buffer);
+	g_free(c);
+}
+
+static void LIBUSB_CALL
+transfer_cb_record_thread(struct libusb_transfer *transfer)
+{
+	*(GThread**)transfer->user_data = g_thread_self();
+}
+
+static void
+test_completion_thread(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+		},
+		{
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+		},
+		{ .submit = FALSE }
+	};
+	unsigned char buffer[4];
+	GThread *cb_thread = NULL;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	g_assert_cmpint(libusb_stop_completion_thread(handle), ==, LIBUSB_ERROR_NOT_FOUND);
+	g_assert_cmpint(libusb_start_completion_thread(handle, -2), ==, LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_start_completion_thread(handle, 0), ==, 0);
+	g_assert_cmpint(libusb_start_completion_thread(handle, -1), ==, LIBUSB_ERROR_BUSY);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer,
+				  handle,
+				  LIBUSB_ENDPOINT_IN,
+				  buffer,
+				  sizeof(buffer),
+				  transfer_cb_record_thread,
+				  &cb_thread,
+				  0);
+
+	/* The callback runs in the completion thread, which wakes up the
+	 * event handling of the context */
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	while (!g_atomic_pointer_get(&cb_thread))
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+
+	g_assert_true(cb_thread != g_thread_self());
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfer->actual_length, ==, 4);
+
+	g_assert_cmpint(libusb_stop_completion_thread(handle), ==, 0);
+	g_assert_cmpint(libusb_stop_completion_thread(handle), ==, LIBUSB_ERROR_NOT_FOUND);
+
+	/* Closing also stops a running completion thread */
+	g_assert_cmpint(libusb_start_completion_thread(handle, -1), ==, 0);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+}
+
+#define DISPATCH_SCALING_MAX_HANDLES 256
+#define DISPATCH_SCALING_ITERATIONS 200
+
+/* Measures the cost of dispatching a ready fd to its handle as more handles
+ * are open. With epoll the handle comes with the event; the poll() path,
+ * used when configured with --disable-epoll, looks it up in the fd index
+ * of the Linux backend. Either way the cost per handle must stay flat,
+ * where a search of the open handles would grow with their number. */
+static void
+test_dispatch_scaling(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	static const int handle_counts[] = { 1, 16, 64, DISPATCH_SCALING_MAX_HANDLES };
+	libusb_device_handle *handles[DISPATCH_SCALING_MAX_HANDLES];
+	struct timeval zero_tv = { 0 };
+	gint64 ns_per_handle[G_N_ELEMENTS(handle_counts)];
+	int opened = 0;
+
+#ifdef HAVE_EPOLL
+	g_test_message("measuring the epoll path, the fd index is only used with --disable-epoll");
+#else
+	g_test_message("measuring the poll() path and its fd index");
+#endif
+
+	/* Logging would dominate the measurement */
+	libusb_set_option(fixture->ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+
+	for (guint i = 0; i < G_N_ELEMENTS(handle_counts); i++) {
+		gint64 start, elapsed;
+
+		for (; opened < handle_counts[i]; opened++) {
+			handles[opened] = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+			g_assert_nonnull(handles[opened]);
+		}
+
+		/* The emulated device nodes are always writable, so every
+		 * iteration dispatches to all open handles. */
+		start = g_get_monotonic_time();
+		for (int j = 0; j < DISPATCH_SCALING_ITERATIONS; j++)
+			g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &zero_tv), ==, 0);
+		elapsed = g_get_monotonic_time() - start;
+
+		ns_per_handle[i] = elapsed * 1000 / (DISPATCH_SCALING_ITERATIONS * opened);
+		g_test_message("%d open handles: %" G_GINT64_FORMAT " ns per handle dispatch",
+			       opened, ns_per_handle[i]);
+	}
+
+	for (int i = 0; i < opened; i++)
+		libusb_close(handles[i]);
+
+	libusb_set_option(fixture->ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+
+	/* 16 times the handles, compared past the fixed cost of a single one */
+	g_assert_cmpint(ns_per_handle[G_N_ELEMENTS(handle_counts) - 1], <=, 4 * ns_per_handle[1]);
+}
+
 static int LIBUSB_CALL
 hotplug_count_arrival_cb(libusb_context *ctx,
                          libusb_device  *device,
@@ -1161,6 +1432,26 @@ main(int argc, char **argv)
 	           test_threaded_submit,
 	           test_fixture_teardown);
 
+	g_test_add("/libusb/reap-syscalls", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_reap_syscalls,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/reap-budget", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_reap_budget,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/completion-thread", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_completion_thread,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/dispatch-scaling", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_dispatch_scaling,
+	           test_fixture_teardown);
+
 	g_test_add("/libusb/hotplug/enumerate", UMockdevTestbedFixture, NULL,
 	           test_fixture_setup_with_canon,
 	           test_hotplug_enumerate,